@@ -0,0 +1,106 @@
+/**
+ * hamt-bench -- compare trie shapes on a few workloads.
+ *
+ * Every workload runs against the same key set on 16, 32 and 64 way
+ * tries, defined with `HAMT_DEFINE_EX`, so the fastest shape for a given
+ * size and mix of operations can be read off directly.
+ *
+ *   $ make bench
+ *   $ ./hamt-bench.out [KEYS]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hamt.h"
+
+/* the same string keys under three names, one per shape */
+typedef char Key;
+typedef Key Key4;
+typedef Key Key5;
+typedef Key Key6;
+
+static unsigned int key_hash(Key *key) { return get_hash(key); }
+
+static int key_equals(Key *k0, Key *k1) { return strcmp(k0, k1) == 0; }
+
+HAMT_DEFINE_EX(Key4, key_hash, key_equals, 4, 8, 4)
+HAMT_DEFINE_EX(Key5, key_hash, key_equals, 5, 16, 8)
+HAMT_DEFINE_EX(Key6, key_hash, key_equals, 6, 32, 16)
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* nanoseconds per operation */
+#define PER_OP(start, ops) ((now() - (start)) * 1e9 / (double)(ops))
+
+/**
+ * Insert `n` keys, look them all up `rounds` times, then remove them,
+ * and print the cost of each phase. `Key4`, `Key5` and `Key6` only
+ * differ in shape, so one body serves all three.
+ */
+#define BENCH(name, bits, label, keys, n, rounds)                              \
+  do {                                                                         \
+    name##_hamt *hamt = name##_hamt_new();                                     \
+    double start = now();                                                      \
+    size_t found = 0;                                                          \
+                                                                               \
+    for (size_t i = 0; i < (n); ++i) {                                         \
+      name##_hamt_set(hamt, (keys)[i], (keys)[i]);                             \
+    }                                                                          \
+    double set = PER_OP(start, n);                                             \
+                                                                               \
+    start = now();                                                             \
+    for (int r = 0; r < (rounds); ++r) {                                       \
+      for (size_t i = 0; i < (n); ++i) {                                       \
+        found += name##_hamt_get(hamt, (keys)[i]) != NULL;                     \
+      }                                                                        \
+    }                                                                          \
+    double get = PER_OP(start, (n) * (rounds));                                \
+                                                                               \
+    start = now();                                                             \
+    for (size_t i = 0; i < (n); ++i) {                                         \
+      name##_hamt_remove(hamt, (keys)[i]);                                     \
+    }                                                                          \
+    double remove = PER_OP(start, n);                                          \
+                                                                               \
+    if (found != (n) * (size_t)(rounds) || hamt->root != NULL) {               \
+      fprintf(stderr, "%s: %d bits lost keys\n", label, bits);                 \
+      exit(EXIT_FAILURE);                                                      \
+    }                                                                          \
+    printf("%-10s %4d %10zu %10.1f %10.1f %10.1f\n", label, bits, (size_t)(n), \
+           set, get, remove);                                                  \
+    free(hamt);                                                                \
+  } while (0)
+
+static void run(const char *label, Key **keys, size_t n, int rounds) {
+  BENCH(Key4, 4, label, keys, n, rounds);
+  BENCH(Key5, 5, label, keys, n, rounds);
+  BENCH(Key6, 6, label, keys, n, rounds);
+}
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  Key **keys;
+
+  if (n < 1000 || (keys = (Key **)malloc(sizeof(Key *) * n)) == NULL) {
+    fprintf(stderr, "usage: %s [KEYS >= 1000]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    keys[i] = (Key *)malloc(32);
+    snprintf(keys[i], 32, "session:%zu", i);
+  }
+
+  printf("%-10s %4s %10s %10s %10s %10s\n", "workload", "bits", "keys",
+         "set ns", "get ns", "remove ns");
+  /* a route table sized set, read over and over */
+  run("small", keys, 1000, 1000);
+  run("large", keys, n, 3);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+/**
+ * hamt-gen -- emit a static hamt as C source.
+ *
+ * Reads `key<TAB>value` lines and writes a C file holding a const,
+ * pointer free `hamt_static_table` with those entries, plus a function
+ * named SYMBOL returning it. Empty lines and lines starting with '#' are
+ * skipped, and a line without a tab maps its key to the empty string.
+ *
+ *   $ ./hamt-gen routes_table < routes.tsv > routes_table.c
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hamt.h"
+
+static void emit_pool(FILE *out, const char *pool, unsigned int size) {
+  fprintf(out, "    \"");
+  for (unsigned int i = 0; i < size; ++i) {
+    unsigned char c = (unsigned char)pool[i];
+
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < ' ' || c > '~' || c == '?') {
+      fprintf(out, "\\%03o", c);
+    } else {
+      fputc(c, out);
+    }
+    if (c == '\0' && i + 1 < size) {
+      fprintf(out, "\"\n    \"");
+    }
+  }
+  fprintf(out, "\"");
+}
+
+static void emit(FILE *out, const char *symbol,
+                 const hamt_static_table *table) {
+  const hamt_static_node *nodes = hamt_static_nodes(table);
+  const hamt_static_leaf *leaves = hamt_static_leaves(table);
+
+  fprintf(out, "/* Generated by hamt-gen, do not edit. */\n");
+  fprintf(out, "#include <stddef.h>\n\n#include \"hamt.h\"\n\n");
+  fprintf(out, "struct %s_image {\n", symbol);
+  fprintf(out, "  hamt_static_table table;\n");
+  fprintf(out, "  hamt_static_node nodes[%u];\n",
+          table->node_count ? table->node_count : 1);
+  fprintf(out, "  hamt_static_leaf leaves[%u];\n",
+          table->leaf_count ? table->leaf_count : 1);
+  fprintf(out, "  char pool[%u];\n};\n\n",
+          table->pool_size ? table->pool_size : 1);
+
+  fprintf(out, "static const struct %s_image %s_image = {\n", symbol, symbol);
+  fprintf(out, "    {HAMT_STATIC_MAGIC, sizeof(struct %s_image), %u, %u,\n",
+          symbol, table->node_count, table->leaf_count);
+  fprintf(out, "     offsetof(struct %s_image, nodes),\n", symbol);
+  fprintf(out, "     offsetof(struct %s_image, leaves),\n", symbol);
+  fprintf(out, "     offsetof(struct %s_image, pool), %u},\n", symbol,
+          table->pool_size);
+
+  fprintf(out, "    {");
+  for (unsigned int i = 0; i < table->node_count; ++i) {
+    fprintf(out, "%s{0x%08x, %u}", i ? ",\n     " : "", nodes[i].bitmap,
+            nodes[i].first);
+  }
+  fprintf(out, "%s},\n", table->node_count ? "" : "{0, 0}");
+
+  fprintf(out, "    {");
+  for (unsigned int i = 0; i < table->leaf_count; ++i) {
+    fprintf(out, "%s{0x%08x, %u, %u, %u, %u, %u}", i ? ",\n     " : "",
+            leaves[i].hash, leaves[i].count, leaves[i].key, leaves[i].key_len,
+            leaves[i].value, leaves[i].value_len);
+  }
+  fprintf(out, "%s},\n", table->leaf_count ? "" : "{0, 0, 0, 0, 0, 0}");
+
+  emit_pool(out, hamt_static_pool(table), table->pool_size);
+  fprintf(out, "};\n\n");
+
+  fprintf(out,
+          "const hamt_static_table *%s(void) { return &%s_image.table; }\n",
+          symbol, symbol);
+}
+
+int main(int argc, char **argv) {
+  FILE *in = stdin;
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t len;
+  hamt_static_entry *entries = NULL;
+  size_t n = 0, capacity = 0;
+
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s SYMBOL [INPUT]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (argc == 3 && (in = fopen(argv[2], "r")) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", argv[2], strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  while ((len = getline(&line, &line_cap, in)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if (len == 0 || line[0] == '#') {
+      continue;
+    }
+    if (n == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      if ((entries = realloc(entries, sizeof(*entries) * capacity)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory for entries\n");
+        return EXIT_FAILURE;
+      }
+    }
+
+    char *key = strdup(line);
+    char *tab = strchr(key, '\t');
+    char *value = "";
+    if (tab != NULL) {
+      *tab = '\0';
+      value = tab + 1;
+    }
+    entries[n].hash = get_hash(key);
+    entries[n].key = key;
+    entries[n].key_len = strlen(key);
+    entries[n].value = value;
+    entries[n++].value_len = strlen(value);
+  }
+
+  hamt_static_table *table = hamt_static_build(entries, n);
+  if (table == NULL) {
+    return EXIT_FAILURE;
+  }
+  emit(stdout, argv[1], table);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,247 @@
+/**
+ * hamt-replay -- replay a recorded trace against a trie shape.
+ *
+ * Traces come from `name##_hamt_trace_start`. Every `get`, `set` and
+ * `remove` in the trace is replayed in order against a trie with 16, 32
+ * or 64 way nodes, keyed by the recorded bytes and hashed with the
+ * recorded hash, `get_hash` or `hamt_hash_bytes`. With several threads
+ * the keys are split by hash and each thread replays its share against
+ * a trie of its own, so every key still sees its calls in order.
+ *
+ *   $ make hamt-replay
+ *   $ ./hamt-replay [-b 4|5|6] [-t THREADS] [-H trace|get|murmur] TRACE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hamt.h"
+
+/* a key as recorded, with the hash it is replayed under */
+typedef struct Key {
+  const char *bytes;
+  unsigned int len;
+  unsigned int hash;
+} Key;
+/* HAMT_DEFINE_EX names a trie after its key type, so each width gets one */
+typedef Key Key4;
+typedef Key Key5;
+typedef Key Key6;
+
+static unsigned int key_hash(Key *key) { return key->hash; }
+
+static int key_equals(Key *k0, Key *k1) {
+  return k0->len == k1->len && memcmp(k0->bytes, k1->bytes, k0->len) == 0;
+}
+
+HAMT_DEFINE_EX(Key4, key_hash, key_equals, 4, 8, 4)
+HAMT_DEFINE_EX(Key5, key_hash, key_equals, 5, 16, 8)
+HAMT_DEFINE_EX(Key6, key_hash, key_equals, 6, 32, 16)
+
+typedef struct Op {
+  Key key;
+  unsigned int op;
+} Op;
+
+/* the ops of one thread, and how long each took in nanoseconds */
+typedef struct Part {
+  Op *ops;
+  size_t n;
+  size_t capacity;
+  unsigned long long *ns;
+} Part;
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Replay part `task` in trace order against a trie of its own, timing
+ * every call. The value stored for a key is the op that set it.
+ */
+#define DEFINE_REPLAY(name)                                                    \
+  static void name##_replay(void *ctx, size_t task) {                          \
+    Part *part = (Part *)ctx + task;                                           \
+    name##_hamt *hamt = name##_hamt_new();                                     \
+                                                                               \
+    for (size_t i = 0; i < part->n; ++i) {                                     \
+      Op *op = &part->ops[i];                                                  \
+      unsigned long long start = now_ns();                                     \
+                                                                               \
+      if (op->op == HAMT_LOG_SET) {                                            \
+        name##_hamt_set(hamt, &op->key, op);                                   \
+      } else if (op->op == HAMT_LOG_REMOVE) {                                  \
+        name##_hamt_remove(hamt, &op->key);                                    \
+      } else {                                                                 \
+        name##_hamt_get(hamt, &op->key);                                       \
+      }                                                                        \
+      part->ns[i] = now_ns() - start;                                          \
+    }                                                                          \
+  }
+
+DEFINE_REPLAY(Key4)
+DEFINE_REPLAY(Key5)
+DEFINE_REPLAY(Key6)
+
+static int compare_ns(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Print the latency percentiles of every op of type `op` */
+static void report(const char *label, Part *parts, int nparts,
+                   unsigned int op) {
+  static const double ranks[] = {0.5, 0.9, 0.99, 0.999};
+  unsigned long long *ns;
+  size_t n = 0;
+
+  for (int p = 0; p < nparts; ++p) {
+    for (size_t i = 0; i < parts[p].n; ++i) {
+      n += parts[p].ops[i].op == op;
+    }
+  }
+  if (n == 0 || (ns = (unsigned long long *)malloc(sizeof(*ns) * n)) == NULL) {
+    return;
+  }
+  n = 0;
+  for (int p = 0; p < nparts; ++p) {
+    for (size_t i = 0; i < parts[p].n; ++i) {
+      if (parts[p].ops[i].op == op) {
+        ns[n++] = parts[p].ns[i];
+      }
+    }
+  }
+  qsort(ns, n, sizeof(*ns), compare_ns);
+
+  printf("%-8s %10zu", label, n);
+  for (size_t r = 0; r < sizeof(ranks) / sizeof(ranks[0]); ++r) {
+    printf(" %8llu", ns[(size_t)(ranks[r] * (n - 1))]);
+  }
+  printf(" %8llu\n", ns[n - 1]);
+  free(ns);
+}
+
+static unsigned int rehash(const char *bytes, unsigned int len,
+                           const char *hash) {
+  char *copy;
+  unsigned int result;
+
+  if (strcmp(hash, "murmur") == 0) {
+    return (unsigned int)hamt_hash_bytes(bytes, len);
+  }
+  /* `get_hash` stops at a '\0', so it needs its own copy */
+  if ((copy = (char *)malloc(len + 1)) == NULL) {
+    fprintf(stderr, "Failed to allocate memory for key\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(copy, bytes, len);
+  copy[len] = '\0';
+  result = get_hash(copy);
+  free(copy);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  const char *hash = "trace";
+  int bits = 5, nthreads = 1, opt;
+  hamt_trace_record record;
+  const char *key;
+  struct rusage usage;
+  size_t size, offset = 0, total = 0;
+  char *data;
+  Part *parts;
+
+  while ((opt = getopt(argc, argv, "b:t:H:")) != -1) {
+    if (opt == 'b') {
+      bits = atoi(optarg);
+    } else if (opt == 't') {
+      nthreads = atoi(optarg);
+    } else if (opt == 'H') {
+      hash = optarg;
+    } else {
+      optind = argc;
+      break;
+    }
+  }
+  if (optind != argc - 1 || bits < 4 || bits > 6 || nthreads < 1 ||
+      (strcmp(hash, "trace") != 0 && strcmp(hash, "get") != 0 &&
+       strcmp(hash, "murmur") != 0)) {
+    fprintf(stderr,
+            "usage: %s [-b 4|5|6] [-t THREADS] [-H trace|get|murmur] TRACE\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  if ((data = hamt_read_file(argv[optind], &size)) == NULL ||
+      (parts = (Part *)calloc(nthreads, sizeof(Part))) == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  while (hamt_trace_next(data, size, &offset, &record, &key)) {
+    Op op = {.key = {.bytes = key,
+                     .len = record.op_len & HAMT_TRACE_KEY_MAX,
+                     .hash = record.hash},
+             .op = record.op_len >> 24};
+    Part *part;
+
+    if (strcmp(hash, "trace") != 0) {
+      op.key.hash = rehash(op.key.bytes, op.key.len, hash);
+    }
+    part = &parts[op.key.hash % nthreads];
+    if (part->n == part->capacity) {
+      part->capacity = part->capacity ? part->capacity * 2 : 1024;
+      if ((part->ops = (Op *)realloc(part->ops,
+                                     sizeof(Op) * part->capacity)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory for ops\n");
+        return EXIT_FAILURE;
+      }
+    }
+    part->ops[part->n++] = op;
+    total++;
+  }
+  if (total == 0) {
+    fprintf(stderr, "%s holds no trace\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+  for (int p = 0; p < nthreads; ++p) {
+    if ((parts[p].ns = (unsigned long long *)malloc(
+             sizeof(unsigned long long) * (parts[p].n + 1))) == NULL) {
+      fprintf(stderr, "Failed to allocate memory for timings\n");
+      return EXIT_FAILURE;
+    }
+    /* touched now, so the baseline below already holds them */
+    memset(parts[p].ns, 0, sizeof(unsigned long long) * (parts[p].n + 1));
+  }
+  /* the trace and the timings are resident, only the tries come on top */
+  getrusage(RUSAGE_SELF, &usage);
+  long baseline = usage.ru_maxrss;
+
+  unsigned long long start = now_ns();
+  if (bits == 4) {
+    hamt_parallel_for(nthreads, nthreads, Key4_replay, parts);
+  } else if (bits == 5) {
+    hamt_parallel_for(nthreads, nthreads, Key5_replay, parts);
+  } else {
+    hamt_parallel_for(nthreads, nthreads, Key6_replay, parts);
+  }
+  double seconds = (now_ns() - start) / 1e9;
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("%zu ops, %d bits, %d threads, %s hash: %.3f s, %.0f ops/s, "
+         "peak RSS +%ld KB\n",
+         total, bits, nthreads, hash, seconds, total / seconds,
+         usage.ru_maxrss - baseline);
+  printf("%-8s %10s %8s %8s %8s %8s %8s\n", "op", "count", "p50 ns",
+         "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+  report("get", parts, nthreads, HAMT_TRACE_GET);
+  report("set", parts, nthreads, HAMT_LOG_SET);
+  report("remove", parts, nthreads, HAMT_LOG_REMOVE);
+  return EXIT_SUCCESS;
+}
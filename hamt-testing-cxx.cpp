@@ -0,0 +1,172 @@
+/* Tests for hamt.hpp, built as hamt-test-cxx.out */
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#include "hamt.hpp"
+
+#if __cplusplus >= 202002L
+#include <ranges>
+static_assert(std::forward_iterator<hamt::map<std::string, int>::iterator>);
+static_assert(std::forward_iterator<hamt::set<int>::iterator>);
+#endif
+
+static std::vector<std::string> load_words(size_t max) {
+  std::ifstream in("./testing/dictionary.txt");
+  std::vector<std::string> words;
+
+  for (std::string word; words.size() < max && std::getline(in, word);) {
+    words.push_back(word);
+  }
+  return words;
+}
+
+/* every key collides with a third of the others */
+struct bad_hash {
+  size_t operator()(const std::string &key) const { return key.size() % 3; }
+};
+
+template <unsigned Bits> static void test_map(const std::vector<std::string> &words) {
+  hamt::map<std::string, std::string, std::hash<std::string>,
+            std::equal_to<std::string>,
+            std::allocator<std::pair<const std::string, std::string>>, Bits>
+      map;
+
+  for (const std::string &word : words) {
+    assert(map.try_emplace(word, word).second);
+  }
+  assert(map.size() == words.size());
+  assert(!map.try_emplace(words[0], "again").second);
+  assert(map.at(words[0]) == words[0]);
+  map.insert_or_assign(words[0], "replaced");
+  assert(map.at(words[0]) == "replaced");
+
+  /* each entry is visited once */
+  size_t visited = 0;
+  for (auto &[key, value] : map) {
+    assert(key == value || key == words[0]);
+    visited++;
+  }
+  assert(visited == words.size());
+
+  for (size_t i = 0; i < words.size(); i += 2) {
+    assert(map.erase(words[i]) == 1);
+  }
+  assert(map.erase(words[0]) == 0);
+  for (size_t i = 0; i < words.size(); ++i) {
+    assert(map.contains(words[i]) == (i % 2 == 1));
+  }
+  assert(std::distance(map.begin(), map.end()) == (long)map.size());
+
+  for (size_t i = 1; i < words.size(); i += 2) {
+    map.erase(words[i]);
+  }
+  assert(map.empty() && map.begin() == map.end());
+}
+
+static void test_collisions(const std::vector<std::string> &words) {
+  hamt::map<std::string, int, bad_hash> map;
+
+  for (size_t i = 0; i < 300; ++i) {
+    map[words[i]] = (int)i;
+  }
+  auto it = map.find(words[10]);
+  assert(it != map.end() && it->second == 10);
+  assert(std::distance(it, map.end()) <= 300);
+  for (size_t i = 0; i < 300; i += 3) {
+    map.erase(words[i]);
+  }
+  for (size_t i = 0; i < 300; ++i) {
+    assert(map.contains(words[i]) == (i % 3 != 0));
+  }
+}
+
+static void test_moves() {
+  hamt::map<std::string, std::unique_ptr<int>> map;
+  std::string key = "a key long enough to live on the heap";
+
+  map.try_emplace(std::move(key), std::make_unique<int>(7));
+  assert(key.empty());
+  auto value = std::make_unique<int>(8);
+  map.insert_or_assign("a key long enough to live on the heap", std::move(value));
+  assert(value == nullptr && *map.at("a key long enough to live on the heap") == 8);
+
+  auto moved = std::move(map);
+  assert(map.empty() && moved.size() == 1);
+}
+
+static void test_copies(const std::vector<std::string> &words) {
+  hamt::set<int> ints;
+  for (int i = 0; i < 5000; ++i) {
+    ints.insert(i * 7);
+  }
+  hamt::set<int> copy = ints;
+  copy.erase(0);
+  assert(ints.contains(0) && !copy.contains(0) && copy.size() == 4999);
+
+  hamt::map<std::string, std::string> map;
+  for (size_t i = 0; i < 1000; ++i) {
+    map.try_emplace(words[i], words[i]);
+  }
+  auto other = map;
+  other.clear();
+  other = map;
+  assert(other.size() == 1000 && other.at(words[999]) == words[999]);
+}
+
+static void test_pmr(const std::vector<std::string> &words) {
+  std::pmr::monotonic_buffer_resource arena;
+  hamt::pmr::map<std::string, size_t> map(&arena);
+
+  for (size_t i = 0; i < words.size(); ++i) {
+    map.try_emplace(words[i], i);
+  }
+  assert(map.get_allocator().resource() == &arena);
+  for (size_t i = 0; i < words.size(); ++i) {
+    assert(map.at(words[i]) == i);
+  }
+
+  hamt::pmr::set<std::string> set(&arena);
+  set.emplace("pmr");
+  assert(set.contains("pmr") && *set.begin() == "pmr");
+}
+
+static void test_algorithms(const std::vector<std::string> &words) {
+  hamt::map<std::string, size_t, std::hash<std::string>,
+            std::equal_to<std::string>,
+            std::allocator<std::pair<const std::string, size_t>>, 6>
+      map;
+
+  for (size_t i = 0; i < words.size(); ++i) {
+    map.try_emplace(words[i], i);
+  }
+  auto odd = std::count_if(map.begin(), map.end(),
+                           [](const auto &entry) { return entry.second % 2; });
+  assert((size_t)odd == words.size() / 2);
+#if __cplusplus >= 202002L
+  auto keys = map | std::views::keys;
+  assert(std::ranges::find(keys, words[42]) != keys.end());
+#endif
+}
+
+int main() {
+  std::vector<std::string> words = load_words(100000);
+  assert(words.size() == 100000);
+
+  test_map<4>(words);
+  test_map<5>(words);
+  test_map<6>(words);
+  test_collisions(words);
+  test_moves();
+  test_copies(words);
+  test_pmr(words);
+  test_algorithms(words);
+  std::printf("C++ checks passed\n");
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
@@ -7,6 +8,7 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "hamt.h"
@@ -44,6 +46,7 @@ static inline unsigned int get_hash_from_value(Value *value) {
   case U8:
     return (unsigned int)value->actual_value.u8;
   }
+  return 0;
 }
 static inline int value_equals(void *v0, void *v1) {
   /* "Equality is the ideal of the ugly loser" */
@@ -74,6 +77,23 @@ static inline int value_equals(void *v0, void *v1) {
 
 HAMT_DEFINE(Value, get_hash_from_value, value_equals)
 
+/* the same keys on 16 and 64 way tries */
+typedef Value Narrow;
+typedef Value Wide;
+HAMT_DEFINE_EX(Narrow, get_hash_from_value, value_equals, 4, 8, 4)
+HAMT_DEFINE_EX(Wide, get_hash_from_value, value_equals, 6, 32, 16)
+
+/* keys hashed by the batch kernels */
+typedef char Str;
+typedef unsigned long long U64;
+static int str_equals(Str *s0, Str *s1) { return strcmp(s0, s1) == 0; }
+static int u64_equals(U64 *k0, U64 *k1) { return *k0 == *k1; }
+HAMT_DEFINE(Str, get_hash, str_equals)
+HAMT_DEFINE(U64, hamt_hash_u64, u64_equals)
+
+/* keys copied into the hamt */
+HAMT_DEFINE_STRKEY(Word)
+
 Value *mkkey_string(char *cool_string) {
   Value *v;
   v = malloc(sizeof(Value));
@@ -291,6 +311,1323 @@ void test_case_2(char *contents) {
   dictionary_check(hamt, strdup(contents));
 }
 
+/* 16 keys built from "Aa" and "BB", which all hash alike */
+void test_many_collisions() {
+  struct Value_hamt *hamt = Value_hamt_new();
+  char words[16][9];
+
+  for (int i = 0; i < 16; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      memcpy(&words[i][j * 2], i & (1 << j) ? "BB" : "Aa", 2);
+    }
+    words[i][8] = '\0';
+    hamt = Value_hamt_set(hamt, mkkey_string(words[i]), words[i]);
+  }
+  hamt = Value_hamt_set(hamt, mkkey_string("hello"), "world");
+  assert(hamt->root->type == BRANCH);
+
+  for (int i = 0; i < 16; ++i) {
+    assert(strcmp(Value_hamt_get(hamt, mkkey_string(words[i])), words[i]) ==
+           0);
+  }
+  for (int i = 0; i < 16; ++i) {
+    hamt = Value_hamt_remove(hamt, mkkey_string(words[i]));
+    assert(Value_hamt_get(hamt, mkkey_string(words[i])) == NULL);
+    if (i < 15) {
+      assert(strcmp(Value_hamt_get(hamt, mkkey_string(words[15])),
+                    words[15]) == 0);
+    }
+  }
+  assert(hamt->root->type == LEAF);
+  hamt = Value_hamt_remove(hamt, mkkey_string("hello"));
+  assert(hamt->root == NULL);
+}
+void test_from_array(char *contents) {
+  size_t n = 0, capacity = 1024;
+  Value **keys = malloc(sizeof(Value *) * capacity);
+  void **values = malloc(sizeof(void *) * capacity);
+  char *dictionary = strdup(contents);
+  char *ptr = dictionary;
+
+  while (*dictionary != '\0') {
+    if (*dictionary == '\n') {
+      *dictionary = '\0';
+      if (n + 2 > capacity) {
+        capacity *= 2;
+        keys = realloc(keys, sizeof(Value *) * capacity);
+        values = realloc(values, sizeof(void *) * capacity);
+      }
+      keys[n] = mkkey_string(ptr);
+      values[n++] = ptr;
+      ptr = dictionary + 1;
+    }
+    dictionary++;
+  }
+  /* these collide, and the later of two equal keys wins */
+  keys[n] = mkkey_string("Aa collision");
+  values[n++] = "collision 1";
+  keys[n] = mkkey_string("BB collision");
+  values[n++] = "collision 2";
+  keys[n] = mkkey_string("Aa collision");
+  values[n++] = "collision 3";
+
+  struct Value_hamt *hamt = Value_hamt_from_array(keys, values, n);
+  printf("Built from array: %zu entries\n", n);
+  dictionary_check(hamt, strdup(contents));
+  assert(hamt->root->type == ARRAY_NODE);
+  assert(strcmp(Value_hamt_get(hamt, mkkey_string("Aa collision")),
+                "collision 3") == 0);
+  assert(strcmp(Value_hamt_get(hamt, mkkey_string("BB collision")),
+                "collision 2") == 0);
+  /* more entries than memory can size are refused before any is read */
+  assert(Value_hamt_from_array(NULL, NULL, SIZE_MAX / 16) == NULL);
+
+  hamt = Value_hamt_set(hamt, mkkey_string("added later"), "still works");
+  assert(strcmp(Value_hamt_get(hamt, mkkey_string("added later")),
+                "still works") == 0);
+  hamt = Value_hamt_remove(hamt, mkkey_string("BB collision"));
+  assert(Value_hamt_get(hamt, mkkey_string("BB collision")) == NULL);
+  assert(strcmp(Value_hamt_get(hamt, mkkey_string("Aa collision")),
+                "collision 3") == 0);
+
+  assert(Value_hamt_from_array(keys, values, 0)->root == NULL);
+}
+
+static Value *parse_dictionary_line(char *line, size_t len, void **value,
+                                    void *ctx) {
+  (void)ctx;
+  if (len == 0) {
+    return NULL;
+  }
+  char *str = strndup(line, len);
+  *value = str;
+  return mkkey_string(str);
+}
+
+void test_load_parallel(char *contents, size_t len) {
+  struct Value_hamt *hamt =
+      Value_hamt_load_parallel(contents, len, 4, parse_dictionary_line, NULL);
+  printf("Loaded in parallel\n");
+  dictionary_check(hamt, strdup(contents));
+
+  char lines[] = "alpha\nbeta\n\ngamma\nalpha";
+  hamt = Value_hamt_load_parallel(lines, strlen(lines), 3,
+                                  parse_dictionary_line, NULL);
+  assert(strcmp(Value_hamt_get(hamt, mkkey_string("beta")), "beta") == 0);
+  assert(strcmp(Value_hamt_get(hamt, mkkey_string("alpha")), "alpha") == 0);
+  assert(strcmp(Value_hamt_get(hamt, mkkey_string("gamma")), "gamma") == 0);
+  assert(Value_hamt_get(hamt, mkkey_string("")) == NULL);
+  assert(Value_hamt_load_parallel(lines, 0, 2, parse_dictionary_line, NULL)
+             ->root == NULL);
+
+  /* a single key, or keys sharing one hash, need no Branch above them */
+  char one[] = "alpha\nalpha\n";
+  hamt = Value_hamt_load_parallel(one, strlen(one), 2, parse_dictionary_line,
+                                  NULL);
+  assert(hamt->root->type == LEAF);
+  char clash[] = "Aa collision\nBB collision\n";
+  hamt = Value_hamt_load_parallel(clash, strlen(clash), 2,
+                                  parse_dictionary_line, NULL);
+  assert(hamt->root->type == COLLISION);
+}
+
+void frozen_check(struct Value_hamt_frozen *frozen, char *dictionary) {
+  char *ptr = dictionary;
+  int missing_count = 0;
+  int accounted_for = 0;
+
+  while (*dictionary != '\0') {
+    if (*dictionary == '\n') {
+      *dictionary = '\0';
+      char *value = (char *)Value_hamt_get_frozen(frozen, mkkey_string(ptr));
+      if (value == NULL || strcmp(value, ptr) != 0) {
+        missing_count++;
+      } else {
+        accounted_for++;
+      }
+      ptr = dictionary + 1;
+    }
+    dictionary++;
+  }
+
+  printf("Frozen missing: %d\n", missing_count);
+  printf("Frozen present: %d\n", accounted_for);
+  assert(missing_count == 0);
+}
+
+void test_freeze(char *contents) {
+  struct Value_hamt *hamt = Value_hamt_new();
+  insert_dictionary(&hamt, strdup(contents));
+  hamt = Value_hamt_set(hamt, mkkey_string("Aa collision"), "collision 1");
+  hamt = Value_hamt_set(hamt, mkkey_string("BB collision"), "collision 2");
+
+  struct Value_hamt_frozen *frozen = Value_hamt_freeze(hamt);
+  printf("Frozen: %u nodes, %u leaves, %zu bytes\n", frozen->node_count,
+         frozen->leaf_count, frozen->size);
+  frozen_check(frozen, strdup(contents));
+  assert(strcmp(Value_hamt_get_frozen(frozen, mkkey_string("Aa collision")),
+                "collision 1") == 0);
+  assert(strcmp(Value_hamt_get_frozen(frozen, mkkey_string("BB collision")),
+                "collision 2") == 0);
+  assert(Value_hamt_get_frozen(frozen, mkkey_string("not a word!")) == NULL);
+  free(frozen);
+
+  hamt = Value_hamt_new();
+  frozen = Value_hamt_freeze(hamt);
+  assert(Value_hamt_get_frozen(frozen, mkkey_string("hello")) == NULL);
+  free(frozen);
+
+  hamt = Value_hamt_set(hamt, mkkey_string("hello"), "world");
+  frozen = Value_hamt_freeze(hamt);
+  assert(strcmp(Value_hamt_get_frozen(frozen, mkkey_string("hello")),
+                "world") == 0);
+  assert(Value_hamt_get_frozen(frozen, mkkey_string("hey")) == NULL);
+  free(frozen);
+}
+
+/* Generated by hamt-gen from testing/routes.tsv */
+const hamt_static_table *routes_table(void);
+
+void test_static_table() {
+  const hamt_static_table *routes = routes_table();
+  char *probes[][2] = {{"GET /", "index"},
+                       {"GET /api/v1/users/:id", "get_user"},
+                       {"DELETE /api/v1/users/:id", "delete_user"},
+                       {"GET /static/*", "serve_static"},
+                       {"Aa collision", "collision 1"},
+                       {"BB collision", "collision 2"},
+                       {"GET /empty", ""},
+                       {"GET /missing", NULL},
+                       {"POST /", NULL},
+                       {"", NULL}};
+  struct Value_hamt *hamt = Value_hamt_new();
+
+  assert(routes->magic == HAMT_STATIC_MAGIC);
+  assert(routes->leaf_count == 17);
+  for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); ++i) {
+    if (probes[i][1] != NULL) {
+      hamt = Value_hamt_set(hamt, mkkey_string(probes[i][0]), probes[i][1]);
+    }
+  }
+  for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); ++i) {
+    const char *value = hamt_static_get(routes, probes[i][0]);
+    char *expected = Value_hamt_get(hamt, mkkey_string(probes[i][0]));
+
+    if (probes[i][1] == NULL) {
+      assert(value == NULL && expected == NULL);
+    } else {
+      assert(value != NULL && strcmp(value, probes[i][1]) == 0);
+      assert(strcmp(value, expected) == 0);
+    }
+  }
+  printf("Static table: %u nodes, %u leaves\n", routes->node_count,
+         routes->leaf_count);
+}
+
+void test_filter(char *contents) {
+  struct Value_hamt *hamt = Value_hamt_new();
+  char key[32];
+  int passed = 0;
+
+  /* enabled while empty, so it has to grow along with the trie */
+  Value_hamt_enable_filter(hamt, 0);
+  insert_dictionary(&hamt, strdup(contents));
+  dictionary_check(hamt, strdup(contents));
+
+  for (int i = 0; i < 100000; ++i) {
+    snprintf(key, sizeof(key), "not a word %d", i);
+    if (hamt_filter_maybe(hamt->filter, get_hash(key))) {
+      passed++;
+    }
+    assert(Value_hamt_get(hamt, mkkey_string(key)) == NULL);
+  }
+  printf("Filter let %d of 100000 misses through\n", passed);
+  assert(passed < 5000);
+
+  /* removals rebuild the filter once enough of it is stale */
+  remove_all(hamt, strdup(contents));
+  assert(hamt->filter->inserted < 1000);
+  hamt = Value_hamt_set(hamt, mkkey_string("hello"), "world");
+  assert(strcmp(Value_hamt_get(hamt, mkkey_string("hello")), "world") == 0);
+
+  /* only new keys and keys really removed are counted */
+  Value *again[] = {mkkey_string("hello"), mkkey_string("absent")};
+  void *values[] = {"world", "world"};
+  assert(Value_hamt_enable_filter(hamt, 0));
+  assert(hamt->filter->inserted == 1);
+  hamt = Value_hamt_set(hamt, again[0], "world");
+  hamt = Value_hamt_set_many(hamt, again, values, 1);
+  assert(hamt->filter->inserted == 1);
+  hamt = Value_hamt_remove(hamt, again[1]);
+  hamt = Value_hamt_remove_many(hamt, again + 1, 1);
+  assert(hamt->filter->removed == 0);
+  Value_hamt_disable_filter(hamt);
+  assert(strcmp(Value_hamt_get(hamt, mkkey_string("hello")), "world") == 0);
+}
+
+typedef struct cache_reader {
+  struct Value_hamt *hamt;
+  Value **keys;
+  int count;
+} cache_reader;
+
+static void read_hot_keys(void *ctx, size_t task) {
+  cache_reader *reader = (cache_reader *)ctx;
+
+  for (int round = 0; round < 2000; ++round) {
+    int i = (int)((task * 7 + round) % reader->count);
+    char *value = Value_hamt_get(reader->hamt, reader->keys[i]);
+    assert(value != NULL &&
+           strcmp(value, reader->keys[i]->actual_value.string) == 0);
+  }
+}
+
+void test_cache() {
+  struct Value_hamt *hamt = Value_hamt_new();
+  char *words[] = {"GET /", "GET /health", "POST /login", "GET /users",
+                   "Aa collision", "BB collision"};
+  Value *keys[6];
+
+  for (int i = 0; i < 6; ++i) {
+    keys[i] = mkkey_string(words[i]);
+    hamt = Value_hamt_set(hamt, keys[i], words[i]);
+  }
+  Value_hamt_enable_cache(hamt, 64);
+
+  /* fill the cache from several readers at once */
+  cache_reader reader = {.hamt = hamt, .keys = keys, .count = 6};
+  hamt_parallel_for(8, 4, read_hot_keys, &reader);
+
+  /* lookups with an equal key that is a different pointer still hit */
+  assert(strcmp(Value_hamt_get(hamt, mkkey_string("GET /")), "GET /") == 0);
+
+  /* any change makes earlier entries stale */
+  hamt = Value_hamt_set(hamt, mkkey_string("GET /"), "replaced");
+  assert(strcmp(Value_hamt_get(hamt, keys[0]), "replaced") == 0);
+  hamt = Value_hamt_remove(hamt, keys[4]);
+  assert(Value_hamt_get(hamt, keys[4]) == NULL);
+  assert(strcmp(Value_hamt_get(hamt, keys[5]), "BB collision") == 0);
+  assert(Value_hamt_get(hamt, mkkey_string("GET /missing")) == NULL);
+
+  Value_hamt_disable_cache(hamt);
+  assert(strcmp(Value_hamt_get(hamt, keys[0]), "replaced") == 0);
+  printf("Cache checks passed\n");
+}
+
+/* Insert or remove every word of `dictionary` in a 32-bit hamt */
+void hamt32_each(struct Value_hamt32 *hamt, char *dictionary, int insert) {
+  char *ptr = dictionary;
+
+  while (*dictionary != '\0') {
+    if (*dictionary == '\n') {
+      *dictionary = '\0';
+      if (insert) {
+        Value_hamt32_set(hamt, mkkey_string(ptr), ptr);
+      } else {
+        Value_hamt32_remove(hamt, mkkey_string(ptr));
+      }
+      ptr = dictionary + 1;
+    }
+    dictionary++;
+  }
+}
+
+void test_hamt32(char *contents) {
+  struct Value_hamt32 *hamt = Value_hamt32_new();
+  assert(Value_hamt32_get(hamt, mkkey_string("hello")) == NULL);
+
+  hamt32_each(hamt, strdup(contents), 1);
+  Value_hamt32_set(hamt, mkkey_string("Aa collision"), "collision 1");
+  Value_hamt32_set(hamt, mkkey_string("BB collision"), "collision 2");
+  assert(strcmp(Value_hamt32_get(hamt, mkkey_string("BB collision")),
+                "collision 2") == 0);
+  assert(Value_hamt32_get(hamt, mkkey_string("not a word!")) == NULL);
+
+  Value_hamt32_compact(hamt);
+  printf("Hamt32: %u nodes, %u leaves\n", hamt->node_count, hamt->leaf_count);
+  struct Value_hamt_frozen *frozen = Value_hamt32_freeze(hamt);
+  frozen_check(frozen, strdup(contents));
+
+  /* the frozen layouts agree, so a frozen copy can be picked up again */
+  struct Value_hamt32 *thawed = Value_hamt32_from_frozen(frozen);
+  free(frozen);
+  Value_hamt32_remove(thawed, mkkey_string("Aa collision"));
+  assert(Value_hamt32_get(thawed, mkkey_string("Aa collision")) == NULL);
+  assert(strcmp(Value_hamt32_get(thawed, mkkey_string("BB collision")),
+                "collision 2") == 0);
+  assert(strcmp(Value_hamt32_get(hamt, mkkey_string("Aa collision")),
+                "collision 1") == 0);
+
+  hamt32_each(thawed, strdup(contents), 0);
+  Value_hamt32_remove(thawed, mkkey_string("BB collision"));
+  assert(thawed->root == HAMT_NONE);
+  Value_hamt32_compact(thawed);
+  assert(thawed->node_count == 0 && thawed->leaf_count == 0);
+  Value_hamt32_free(thawed);
+  Value_hamt32_free(hamt);
+}/**
+ * Run the dictionary through tries of other shapes, with every word set,
+ * looked up in the trie and in a frozen copy, and removed again.
+ */
+#define SHAPE_CHECK(name, dictionary)                                          \
+  do {                                                                         \
+    name##_hamt *hamt = name##_hamt_new();                                     \
+    char *words = strdup(dictionary);                                          \
+    size_t count = 0;                                                          \
+                                                                               \
+    for (char *word = strtok(words, "\n"); word; word = strtok(NULL, "\n")) { \
+      hamt = name##_hamt_set(hamt, mkkey_string(word), word);                  \
+      count++;                                                                 \
+    }                                                                          \
+    name##_hamt_frozen *frozen = name##_hamt_freeze(hamt);                     \
+    for (char *word = words; count > 0; word += strlen(word) + 1, --count) {   \
+      assert(strcmp(name##_hamt_get(hamt, mkkey_string(word)), word) == 0);    \
+      assert(strcmp(name##_hamt_get_frozen(frozen, mkkey_string(word)),        \
+                    word) == 0);                                               \
+      hamt = name##_hamt_remove(hamt, mkkey_string(word));                     \
+    }                                                                          \
+    assert(hamt->root == NULL);                                                \
+    free(frozen);                                                              \
+  } while (0)
+
+void test_shapes(char *contents) {
+  SHAPE_CHECK(Narrow, contents);
+  SHAPE_CHECK(Wide, contents);
+  printf("Shape checks passed\n");
+}
+
+typedef struct scan_state {
+  struct Value_hamt *seen;
+  int count;
+} scan_state;
+
+static void scan_collect(Value *key, void *value, void *ctx) {
+  scan_state *state = (scan_state *)ctx;
+
+  /* present for the whole scan means handed out exactly once */
+  assert(Value_hamt_get(state->seen, key) == NULL);
+  state->seen = Value_hamt_set(state->seen, key, value);
+  state->count++;
+}
+
+void test_scan(char *contents) {
+  struct Value_hamt *hamt = Value_hamt_new();
+  scan_state state = {.seen = Value_hamt_new(), .count = 0};
+  char **words = malloc(sizeof(char *) * 200000);
+  int n = 0, slices = 0;
+
+  for (char *word = strtok(strdup(contents), "\n"); word && n < 200000;
+       word = strtok(NULL, "\n")) {
+    words[n++] = word;
+  }
+  for (int i = 0; i < n / 2; ++i) {
+    hamt = Value_hamt_set(hamt, mkkey_string(words[i]), words[i]);
+  }
+  hamt = Value_hamt_set(hamt, mkkey_string("Aa collision"), "collision 1");
+  hamt = Value_hamt_set(hamt, mkkey_string("BB collision"), "collision 2");
+
+  /* the trie keeps changing between slices */
+  unsigned long long cursor = 0;
+  int added = n / 2;
+  do {
+    cursor = Value_hamt_scan(hamt, cursor, 100, scan_collect, &state);
+    for (int i = 0; i < 50 && added < n; ++i, ++added) {
+      hamt = Value_hamt_set(hamt, mkkey_string(words[added]), words[added]);
+      hamt = Value_hamt_remove(hamt, mkkey_string(words[added - n / 2]));
+    }
+    slices++;
+  } while (cursor != 0);
+
+  printf("Scanned %d entries in %d slices\n", state.count, slices);
+  assert(Value_hamt_get(state.seen, mkkey_string("Aa collision")) != NULL);
+  assert(Value_hamt_get(state.seen, mkkey_string("BB collision")) != NULL);
+  for (int i = added - n / 2; i < n / 2; ++i) {
+    assert(Value_hamt_get(state.seen, mkkey_string(words[i])) == words[i]);
+  }
+
+  /* an empty trie is done straight away */
+  assert(Value_hamt_scan(Value_hamt_new(), 0, 10, scan_collect, &state) == 0);
+  free(words);
+}
+static void encode_string(Value *key, void *value, hamt_static_entry *entry,
+                          void *ctx) {
+  (void)ctx;
+  entry->key = key->actual_value.string;
+  entry->key_len = strlen(entry->key);
+  entry->value = (char *)value;
+  entry->value_len = value ? strlen(entry->value) : 0;
+}
+
+void test_shared_memory() {
+  char name[64];
+  snprintf(name, sizeof(name), "/hamt-test-%d", (int)getpid());
+  hamt_shm *writer = hamt_shm_open(name, 1 << 16);
+  hamt_shm *reader = hamt_shm_open(name, 0);
+  assert(writer != NULL && reader != NULL);
+  int slot = hamt_shm_attach(reader);
+  assert(hamt_shm_enter(reader, slot) == NULL);
+  hamt_shm_leave(reader, slot);
+
+  struct Value_hamt *hamt = Value_hamt_new();
+  hamt = Value_hamt_set(hamt, mkkey_string("GET /"), "index");
+  hamt = Value_hamt_set(hamt, mkkey_string("Aa collision"), "collision 1");
+  hamt = Value_hamt_set(hamt, mkkey_string("BB collision"), "collision 2");
+  assert(Value_hamt_publish_shm(hamt, writer, encode_string, NULL) == 0);
+
+  /* a worker process sees the table through its own mapping */
+  pid_t pid = fork();
+  if (pid == 0) {
+    hamt_shm *worker = hamt_shm_open(name, 0);
+    int own = hamt_shm_attach(worker);
+    const hamt_static_table *table = hamt_shm_enter(worker, own);
+    bool ok =
+        strcmp(hamt_static_get(table, "BB collision"), "collision 2") == 0;
+    hamt_shm_leave(worker, own);
+    _exit(ok ? 0 : 1);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0);
+
+  /* a pinned version survives one publish, and blocks the next */
+  const hamt_static_table *pinned = hamt_shm_enter(reader, slot);
+  hamt = Value_hamt_set(hamt, mkkey_string("GET /"), "home");
+  assert(Value_hamt_publish_shm(hamt, writer, encode_string, NULL) == 0);
+  assert(Value_hamt_publish_shm(hamt, writer, encode_string, NULL) == -1 &&
+         errno == EBUSY);
+  assert(strcmp(hamt_static_get(pinned, "GET /"), "index") == 0);
+  hamt_shm_leave(reader, slot);
+  assert(Value_hamt_publish_shm(hamt, writer, encode_string, NULL) == 0);
+
+  const hamt_static_table *current = hamt_shm_enter(reader, slot);
+  assert(strcmp(hamt_static_get(current, "GET /"), "home") == 0);
+  assert(hamt_static_get(current, "GET /missing") == NULL);
+  hamt_shm_leave(reader, slot);
+
+  /* a restarted writer keeps the table and readers it finds */
+  hamt_shm *restarted = hamt_shm_open(name, 1 << 10);
+  assert(restarted != NULL);
+  current = hamt_shm_enter(reader, slot);
+  assert(strcmp(hamt_static_get(current, "GET /"), "home") == 0);
+  hamt_shm_leave(reader, slot);
+  assert(Value_hamt_publish_shm(hamt, restarted, encode_string, NULL) == 0);
+  hamt_shm_close(restarted);
+  assert(hamt_shm_open(name, 1 << 20) == NULL);
+
+  hamt_shm_detach(reader, slot);
+  hamt_shm_close(reader);
+  hamt_shm_close(writer);
+  shm_unlink(name);
+  printf("Shared memory checks passed\n");
+}
+static Value *decode_string(const char *key, size_t key_len, const char *value,
+                            size_t value_len, void **value_out, void *ctx) {
+  (void)ctx;
+  *value_out = strndup(value, value_len);
+  return mkkey_string(strndup(key, key_len));
+}
+
+static void log_check(struct Value_hamt *hamt, char **words, int removed,
+                      int n) {
+  for (int i = 0; i < n; ++i) {
+    char *value = Value_hamt_get(hamt, mkkey_string(words[i]));
+    assert(i < removed ? value == NULL : strcmp(value, words[i]) == 0);
+  }
+}
+
+void test_log(char *contents) {
+  char dir[64], path[96];
+  char **words = malloc(sizeof(char *) * 20000);
+  int n = 0;
+
+  for (char *word = strtok(strdup(contents), "\n"); word && n < 20000;
+       word = strtok(NULL, "\n")) {
+    words[n++] = word;
+  }
+  snprintf(dir, sizeof(dir), "/tmp/hamt-test-log-%d", (int)getpid());
+
+  struct Value_hamt *hamt =
+      Value_hamt_recover(dir, encode_string, decode_string, NULL, 0);
+  assert(hamt != NULL && hamt->root == NULL);
+  for (int i = 0; i < n / 2; ++i) {
+    hamt = Value_hamt_set(hamt, mkkey_string(words[i]), words[i]);
+  }
+  for (int i = 0; i < 1000; ++i) {
+    hamt = Value_hamt_remove(hamt, mkkey_string(words[i]));
+  }
+  /* synced operations survive without a clean close */
+  assert(Value_hamt_sync(hamt) == 0);
+  hamt = Value_hamt_recover(dir, encode_string, decode_string, NULL, 0);
+  log_check(hamt, words, 1000, n / 2);
+
+  /* the rest goes on top of a checkpoint, and more automatic ones */
+  assert(Value_hamt_checkpoint(hamt) == 0);
+  assert(Value_hamt_close_log(hamt) == 0);
+  hamt = Value_hamt_recover(dir, encode_string, decode_string, NULL, 3000);
+  for (int i = n / 2; i < n; ++i) {
+    hamt = Value_hamt_set(hamt, mkkey_string(words[i]), words[i]);
+  }
+  for (int i = 1000; i < 2000; ++i) {
+    hamt = Value_hamt_remove(hamt, mkkey_string(words[i]));
+  }
+  assert(Value_hamt_close_log(hamt) == 0);
+
+  /* a torn record at the end is dropped */
+  snprintf(path, sizeof(path), "%s/log", dir);
+  FILE *log = fopen(path, "a");
+  fwrite("\x01\x00\x00\x00\x10", 1, 5, log);
+  fclose(log);
+  hamt = Value_hamt_recover(dir, encode_string, decode_string, NULL, 0);
+  log_check(hamt, words, 2000, n);
+  hamt = Value_hamt_set(hamt, mkkey_string("Aa collision"), "collision 1");
+  assert(Value_hamt_close_log(hamt) == 0);
+  hamt = Value_hamt_recover(dir, encode_string, decode_string, NULL, 0);
+  assert(strcmp(Value_hamt_get(hamt, mkkey_string("Aa collision")),
+                "collision 1") == 0);
+  log_check(hamt, words, 2000, n);
+
+  /* failed writes keep the batch, which only a sync tries again */
+  int fd = hamt->log->file.fd;
+  hamt->log->file.fd = open("/dev/null", O_RDONLY);
+  for (int i = 0; i < n; ++i) {
+    hamt = Value_hamt_set(hamt, mkkey_string(words[i]), words[i]);
+  }
+  assert(hamt->log->file.failing && hamt->log->file.len > HAMT_LOG_BATCH);
+  assert(Value_hamt_sync(hamt) == -1);
+  close(hamt->log->file.fd);
+  hamt->log->file.fd = fd;
+  assert(Value_hamt_sync(hamt) == 0 && !hamt->log->file.failing);
+  assert(Value_hamt_close_log(hamt) == 0);
+  hamt = Value_hamt_recover(dir, encode_string, decode_string, NULL, 0);
+  log_check(hamt, words, 0, n);
+  assert(Value_hamt_close_log(hamt) == 0);
+
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/checkpoint", dir);
+  unlink(path);
+  rmdir(dir);
+  free(words);
+  printf("Log checks passed\n");
+}
+void test_compact(char *contents) {
+  char **words = malloc(sizeof(char *) * 50000);
+  Value **keys = malloc(sizeof(Value *) * 50000);
+  int n = 0, steps = 0;
+
+  for (char *word = strtok(strdup(contents), "\n"); word && n < 50000;
+       word = strtok(NULL, "\n")) {
+    keys[n] = mkkey_string(word);
+    words[n++] = word;
+  }
+  /* bulk built nodes, grown nodes and collisions all get moved */
+  struct Value_hamt *hamt =
+      Value_hamt_from_array(keys, (void **)words, (size_t)n / 2);
+  for (int i = n / 2; i < n; ++i) {
+    hamt = Value_hamt_set(hamt, keys[i], words[i]);
+  }
+  for (int i = 0; i < n; i += 3) {
+    hamt = Value_hamt_remove(hamt, keys[i]);
+  }
+  hamt = Value_hamt_set(hamt, mkkey_string("Aa collision"), "collision 1");
+  hamt = Value_hamt_set(hamt, mkkey_string("BB collision"), "collision 2");
+
+  /* an update part way through starts the pass over */
+  while (Value_hamt_compact_step(hamt, 1000)) {
+    if (++steps == 40) {
+      hamt = Value_hamt_remove(hamt, keys[1]);
+    }
+  }
+  assert(steps > 40 && hamt->arena != NULL && hamt->compaction == NULL);
+  for (int i = 0; i < n; ++i) {
+    void *value = Value_hamt_get(hamt, keys[i]);
+    assert(i % 3 == 0 || i == 1 ? value == NULL : value == words[i]);
+  }
+
+  /* updates land in the arena, and the next pass frees what it replaces */
+  for (int i = 0; i < n; i += 3) {
+    hamt = Value_hamt_set(hamt, keys[i], words[i]);
+  }
+
+  /* updates between every step only restart the pass so often */
+  steps = 0;
+  while (Value_hamt_compact_step(hamt, 100)) {
+    hamt = Value_hamt_set(hamt, keys[0], words[0]);
+    assert(++steps < HAMT_COMPACT_RESTARTS * 2);
+  }
+  assert(hamt->compaction == NULL);
+
+  hamt = Value_hamt_remove(hamt, mkkey_string("BB collision"));
+  Value_hamt_compact(hamt);
+  for (int i = 0; i < n; ++i) {
+    assert(Value_hamt_get(hamt, keys[i]) == (i == 1 ? NULL : words[i]));
+  }
+  assert(strcmp(Value_hamt_get(hamt, mkkey_string("Aa collision")),
+                "collision 1") == 0);
+  assert(Value_hamt_get(hamt, mkkey_string("BB collision")) == NULL);
+
+  hamt_stats stats;
+  Value_hamt_stats(hamt, &stats);
+  assert(stats.entries == (size_t)n && stats.nodes > stats.entries);
+  assert(stats.arena_nodes == stats.nodes &&
+         stats.storage == HAMT_STORAGE_MALLOC);
+
+  /* big enough for huge pages, if the system has them */
+  Value_hamt_enable_huge_pages(hamt);
+  Value_hamt_compact(hamt);
+  hamt = Value_hamt_set(hamt, keys[1], words[1]);
+  Value_hamt_compact(hamt);
+  Value_hamt_stats(hamt, &stats);
+  assert(stats.arena_nodes == stats.nodes &&
+         stats.arena_bytes >= HAMT_HUGE_PAGE / 2);
+  for (int i = 0; i < n; ++i) {
+    assert(Value_hamt_get(hamt, keys[i]) == words[i]);
+  }
+  printf("Compaction arena on %s\n", hamt_storage_name(stats.storage));
+
+  /* nothing to do for an empty trie */
+  assert(!Value_hamt_compact_step(Value_hamt_new(), 10));
+  free(keys);
+  free(words);
+  printf("Compaction checks passed\n");
+}
+void test_hash_batch(char *contents) {
+  char **keys = malloc(sizeof(char *) * 1003);
+  unsigned long long *ints = malloc(sizeof(unsigned long long) * 1003);
+  void **int_keys = malloc(sizeof(void *) * 1003);
+  unsigned int *hashes = malloc(sizeof(unsigned int) * 1003);
+  char *word = strtok(strdup(contents), "\n");
+
+  /* uneven lengths, and chars above 127 which `get_hash` sign extends */
+  for (int i = 0; i < 1003; ++i, word = strtok(NULL, "\n")) {
+    keys[i] = i % 5 == 0 ? strdup("") : strdup(word);
+    if (i % 7 == 0 && keys[i][0] != '\0') {
+      keys[i][0] = (char)(0x80 + i % 100);
+    }
+    ints[i] = (unsigned long long)i * 0x9E3779B97F4A7C15ULL;
+    int_keys[i] = &ints[i];
+  }
+
+  Str_hamt_hash_batch(keys, 1003, hashes);
+  for (int i = 0; i < 1003; ++i) {
+    assert(hashes[i] == get_hash(keys[i]));
+  }
+  U64_hamt_hash_batch((U64 **)int_keys, 1003, hashes);
+  for (int i = 0; i < 1003; ++i) {
+    assert(hashes[i] == hamt_hash_u64(&ints[i]));
+  }
+  hamt_hash_ints(int_keys, 1003, hashes, false);
+  for (int i = 0; i < 1003; ++i) {
+    assert(hashes[i] == hamt_hash_u32((unsigned int *)&ints[i]));
+  }
+
+  /* bulk construction hashes through the batch path */
+  struct Str_hamt *hamt =
+      Str_hamt_from_array(keys + 1, (void **)keys + 1, 1002);
+  for (int i = 1; i < 1003; ++i) {
+    assert(strcmp(Str_hamt_get(hamt, keys[i]), keys[i]) == 0);
+  }
+  free(keys);
+  free(ints);
+  free(int_keys);
+  free(hashes);
+  printf("Batch hashing checks passed\n");
+}
+void test_strkey(char *contents) {
+  struct Word_hamt *hamt = Word_hamt_new();
+  char *copy = strdup(contents);
+  char **words = malloc(sizeof(char *) * 20000);
+  char *word = strtok(copy, "\n");
+  int n = 0;
+
+  for (; n < 20000 && word != NULL; ++n, word = strtok(NULL, "\n")) {
+    words[n] = word;
+    Word_hamt_put(hamt, word, strlen(word), word);
+  }
+  for (int i = 0; i < n; ++i) {
+    assert(Word_hamt_get_bytes(hamt, words[i], strlen(words[i])) == words[i]);
+  }
+
+  /* the hamt owns its keys, so the caller's bytes can change */
+  char buf[40] = "a key long enough to spill";
+  Word_hamt_put(hamt, buf, strlen(buf), "long");
+  Word_hamt_put(hamt, buf, 16, "inline");
+  Word_hamt_put(hamt, buf, 17, "spilled");
+  Word_hamt_put(hamt, "", 0, "empty");
+  memset(buf, 'x', sizeof(buf));
+  assert(strcmp(Word_hamt_get_bytes(hamt, "a key long enough to spill", 26),
+                "long") == 0);
+  assert(strcmp(Word_hamt_get_bytes(hamt, "a key long enoug", 16), "inline") ==
+         0);
+  assert(strcmp(Word_hamt_get_bytes(hamt, "a key long enough", 17),
+                "spilled") == 0);
+  assert(strcmp(Word_hamt_get_bytes(hamt, "", 0), "empty") == 0);
+  assert(Word_hamt_get_bytes(hamt, "a key long enough to spil", 25) == NULL);
+
+  /* keys may hold any bytes, and replacing keeps the stored copy */
+  Word_hamt_put(hamt, "nul\0inside", 11, "first");
+  Word_hamt_put(hamt, "nul\0inside", 11, "second");
+  assert(strcmp(Word_hamt_get_bytes(hamt, "nul\0inside", 11), "second") == 0);
+  assert(Word_hamt_get_bytes(hamt, "nul", 3) == NULL);
+
+  for (int i = 0; i < n; i += 2) {
+    Word_hamt_delete(hamt, words[i], strlen(words[i]));
+  }
+  Word_hamt_delete(hamt, "missing", 7);
+  for (int i = 0; i < n; ++i) {
+    assert(Word_hamt_get_bytes(hamt, words[i], strlen(words[i])) ==
+           (i % 2 == 0 ? NULL : words[i]));
+  }
+  free(words);
+  free(copy);
+  printf("String key checks passed\n");
+}
+/* recount every subtree, checking the sizes kept in the nodes */
+static unsigned int check_sizes(Value_hamt_node *node) {
+  unsigned int size = 0;
+
+  if (node == NULL || node->type == LEAF) {
+    return node != NULL;
+  }
+  if (node->type == COLLISION) {
+    return node->bitmap;
+  }
+  for (unsigned int i = 0; i < Value_hamt_slots(node); ++i) {
+    size += check_sizes(node->children[i]);
+  }
+  assert(node->size == size);
+  return size;
+}
+void test_counts(char *contents) {
+  struct Value_hamt *hamt = Value_hamt_new();
+  char **words = malloc(sizeof(char *) * 50000);
+  Value **keys = malloc(sizeof(Value *) * 50000);
+  int n = 0;
+
+  for (char *word = strtok(strdup(contents), "\n"); word && n < 50000;
+       word = strtok(NULL, "\n"), ++n) {
+    words[n] = word;
+    keys[n] = mkkey_string(word);
+    hamt = Value_hamt_set(hamt, keys[n], word);
+  }
+  /* replacing a key or removing a missing one changes nothing */
+  hamt = Value_hamt_set(hamt, mkkey_string(words[7]), words[7]);
+  hamt = Value_hamt_remove(hamt, mkkey_string("not a word"));
+  hamt = Value_hamt_set(hamt, mkkey_string("Aa collision"), "collision 1");
+  hamt = Value_hamt_set(hamt, mkkey_string("BB collision"), "collision 2");
+  assert(Value_hamt_size(hamt) == (size_t)n + 2);
+  assert(check_sizes(hamt->root) == (unsigned int)n + 2);
+
+  /* nth walks every entry once, in trie order */
+  struct Value_hamt *seen = Value_hamt_new();
+  unsigned long long last = 0;
+  Value *key;
+  void *value;
+  for (size_t i = 0; i < Value_hamt_size(hamt); ++i) {
+    assert(Value_hamt_nth(hamt, i, &key, &value));
+    unsigned long long order = Value_hamt_scan_order(get_hash_from_value(key));
+    assert(order >= last && Value_hamt_get(seen, key) == NULL);
+    last = order;
+    seen = Value_hamt_set(seen, key, value);
+  }
+  assert(!Value_hamt_nth(hamt, Value_hamt_size(hamt), &key, &value));
+
+  for (int i = 0; i < n; i += 3) {
+    hamt = Value_hamt_remove(hamt, keys[i]);
+  }
+  hamt = Value_hamt_remove(hamt, mkkey_string("Aa collision"));
+  assert(Value_hamt_size(hamt) == (size_t)(n - (n + 2) / 3) + 1);
+  assert(check_sizes(hamt->root) == Value_hamt_size(hamt));
+
+  /* samples land on live entries, and cover a small trie */
+  Value *sample_keys[64];
+  void *sample_values[64];
+  unsigned long long rng = 42;
+  assert(Value_hamt_sample(hamt, &rng, 64, sample_keys, sample_values) == 64);
+  for (int i = 0; i < 64; ++i) {
+    assert(Value_hamt_get(hamt, sample_keys[i]) == sample_values[i]);
+  }
+  struct Value_hamt *small = Value_hamt_new();
+  bool hit[4] = {false};
+  for (int i = 0; i < 4; ++i) {
+    small = Value_hamt_set(small, keys[i], &hit[i]);
+  }
+  for (int i = 0; i < 64; ++i) {
+    Value_hamt_sample(small, &rng, 1, sample_keys, sample_values);
+    *(bool *)sample_values[0] = true;
+  }
+  assert(hit[0] && hit[1] && hit[2] && hit[3]);
+  assert(Value_hamt_sample(Value_hamt_new(), &rng, 4, sample_keys,
+                           sample_values) == 0);
+
+  /* bulk loads and compaction keep the counts */
+  struct Value_hamt *bulk = Value_hamt_from_array(keys, (void **)words, n);
+  assert(Value_hamt_size(bulk) == (size_t)n);
+  assert(check_sizes(bulk->root) == (unsigned int)n);
+  Value_hamt_compact(hamt);
+  assert(check_sizes(hamt->root) == Value_hamt_size(hamt));
+  free(words);
+  free(keys);
+  printf("Count checks passed\n");
+}
+static bool keep_a(Value *key, void *value, void *ctx) {
+  (void)value;
+  (void)ctx;
+  return key->actual_value.string[0] == 'a';
+}
+static bool keep_all(Value *key, void *value, void *ctx) {
+  (void)key;
+  (void)value;
+  (void)ctx;
+  return true;
+}
+/* upper case the words starting with `*ctx`, leave the rest alone */
+static void *shout(Value *key, void *value, void *ctx) {
+  char *word = value;
+
+  (void)key;
+  if (word[0] != *(char *)ctx) {
+    return value;
+  }
+  char *loud = strdup(word);
+  for (char *c = loud; *c; ++c) {
+    *c = toupper(*c);
+  }
+  return loud;
+}
+/* keep every entry but the one whose value is `ctx` */
+static bool keep_others(Value *key, void *value, void *ctx) {
+  (void)key;
+  return value != ctx;
+}
+static size_t visited;
+static void count_visit(Value *key, void *value) {
+  (void)key;
+  (void)value;
+  visited++;
+}
+void test_derive(char *contents) {
+  struct Value_hamt *hamt = Value_hamt_new();
+  char **words = malloc(sizeof(char *) * 50000);
+  int n = 0, starts_a = 0;
+
+  for (char *word = strtok(strdup(contents), "\n"); word && n < 50000;
+       word = strtok(NULL, "\n"), ++n) {
+    words[n] = word;
+    starts_a += word[0] == 'a';
+    hamt = Value_hamt_set(hamt, mkkey_string(word), word);
+  }
+  hamt = Value_hamt_set(hamt, mkkey_string("Aa collision"), "collision 1");
+  hamt = Value_hamt_set(hamt, mkkey_string("BB collision"), "collision 2");
+  hamt = Value_hamt_set(hamt, mkkey_string("aa collision"), "collision 3");
+  visited = 0;
+  Value_hamt_visit_all(hamt, count_visit);
+  assert(visited == (size_t)n + 3);
+
+  for (int nthreads = 1; nthreads <= 4; nthreads += 3) {
+    struct Value_hamt *only_a = Value_hamt_filter(hamt, keep_a, NULL, nthreads);
+    assert(Value_hamt_size(only_a) == (size_t)starts_a + 1);
+    assert(check_sizes(only_a->root) == Value_hamt_size(only_a));
+    for (int i = 0; i < n; ++i) {
+      assert(Value_hamt_get(only_a, mkkey_string(words[i])) ==
+             (words[i][0] == 'a' ? words[i] : NULL));
+      assert(Value_hamt_get(hamt, mkkey_string(words[i])) == words[i]);
+    }
+    assert(Value_hamt_get(only_a, mkkey_string("aa collision")) != NULL);
+    assert(Value_hamt_get(only_a, mkkey_string("Aa collision")) == NULL);
+
+    /* only the paths to changed entries are new */
+    char first = 'q';
+    struct Value_hamt *loud =
+        Value_hamt_map_values(hamt, shout, &first, nthreads);
+    assert(Value_hamt_size(loud) == Value_hamt_size(hamt));
+    for (int i = 0; i < n; ++i) {
+      char *value = Value_hamt_get(loud, mkkey_string(words[i]));
+      assert(words[i][0] == 'q' ? value != words[i] && value[0] == 'Q'
+                                : value == words[i]);
+    }
+    assert(Value_hamt_filter(hamt, keep_all, NULL, nthreads)->root ==
+           hamt->root);
+    first = '\0';
+    assert(Value_hamt_map_values(hamt, shout, &first, nthreads)->root ==
+           hamt->root);
+  }
+  assert(Value_hamt_filter(Value_hamt_new(), keep_a, NULL, 2)->root == NULL);
+
+  /* changing either trie leaves the other alone */
+  Value **keys = malloc(sizeof(Value *) * 2000);
+  void **values = malloc(sizeof(void *) * 2000);
+  struct Value_hamt *source = Value_hamt_new();
+  struct Value_hamt *derived;
+
+  for (int i = 0; i < 2000; ++i) {
+    keys[i] = mkkey_string(words[i]);
+    source = Value_hamt_set(source, keys[i], words[i]);
+  }
+  derived = Value_hamt_filter(source, keep_others, words[0], 2);
+  source = Value_hamt_set(source, keys[5], "changed");
+  for (int i = 1; i < 2000; i += 2) {
+    source = Value_hamt_remove(source, keys[i]);
+  }
+  for (int i = 0; i < 200; ++i) {
+    values[i] = words[i + 1];
+  }
+  source = Value_hamt_set_many(source, keys, values, 200);
+  source = Value_hamt_remove_many(source, keys + 200, 200);
+  Value_hamt_compact(source);
+  assert(Value_hamt_size(derived) == 1999);
+  assert(check_sizes(derived->root) == 1999);
+  for (int i = 0; i < 2000; ++i) {
+    assert(Value_hamt_get(derived, keys[i]) == (i == 0 ? NULL : words[i]));
+  }
+
+  for (int i = 0; i < 2000; ++i) {
+    values[i] = Value_hamt_get(source, keys[i]);
+  }
+  derived = Value_hamt_remove_many(derived, keys, 1000);
+  derived = Value_hamt_set_many(derived, keys + 1000, (void **)words, 1000);
+  derived = Value_hamt_set(derived, keys[0], "changed");
+  Value_hamt_compact(derived);
+  assert(check_sizes(source->root) == Value_hamt_size(source));
+  for (int i = 0; i < 2000; ++i) {
+    assert(Value_hamt_get(source, keys[i]) == values[i]);
+  }
+  free(keys);
+  free(values);
+  free(words);
+  printf("Derive checks passed\n");
+}
+/* every key of `words` maps to the same value in both tries */
+static void assert_same(struct Value_hamt *h0, struct Value_hamt *h1,
+                        char **words, int n) {
+  assert(Value_hamt_size(h0) == Value_hamt_size(h1));
+  assert(check_sizes(h0->root) == Value_hamt_size(h0));
+  for (int i = 0; i < n; ++i) {
+    Value key = {.type = STRING, .actual_value.string = words[i]};
+    assert(Value_hamt_get(h0, &key) == Value_hamt_get(h1, &key));
+  }
+}
+void test_set_many(char *contents) {
+  struct Value_hamt *batched = Value_hamt_new();
+  struct Value_hamt *single = Value_hamt_new();
+  char **words = malloc(sizeof(char *) * 40016);
+  Value **keys = malloc(sizeof(Value *) * 40016);
+  void **values = malloc(sizeof(void *) * 40016);
+  int n = 0;
+
+  for (char *word = strtok(strdup(contents), "\n"); word && n < 40000;
+       word = strtok(NULL, "\n"), ++n) {
+    words[n] = word;
+  }
+  /* colliding keys, which land in the same collision nodes */
+  for (int i = 0; i < 16; ++i, ++n) {
+    words[n] = malloc(9);
+    for (int j = 0; j < 4; ++j) {
+      memcpy(&words[n][j * 2], i & (1 << j) ? "BB" : "Aa", 2);
+    }
+    words[n][8] = '\0';
+  }
+  for (int i = 0; i < n; ++i) {
+    keys[i] = mkkey_string(words[i]);
+    values[i] = words[i];
+  }
+
+  /* batches of growing size, some overlapping, with repeated keys */
+  srand(7);
+  for (int round = 0, size = 1; round < 14; ++round, size *= 2) {
+    int count = size < n ? size : n;
+    Value **batch = malloc(sizeof(Value *) * count);
+    void **batch_values = malloc(sizeof(void *) * count);
+
+    for (int i = 0; i < count; ++i) {
+      int at = rand() % n;
+      batch[i] = keys[at];
+      batch_values[i] = (char *)values[at] + (i % 3 == 0);
+    }
+    batched = Value_hamt_set_many(batched, batch, batch_values, count);
+    for (int i = 0; i < count; ++i) {
+      single = Value_hamt_set(single, batch[i], batch_values[i]);
+    }
+    assert_same(batched, single, words, n);
+
+    count = count / 2 + 1;
+    for (int i = 0; i < count; ++i) {
+      batch[i] = keys[rand() % n];
+    }
+    batched = Value_hamt_remove_many(batched, batch, count);
+    for (int i = 0; i < count; ++i) {
+      single = Value_hamt_remove(single, batch[i]);
+    }
+    assert_same(batched, single, words, n);
+    free(batch);
+    free(batch_values);
+  }
+
+  /* everything in, then everything out */
+  batched = Value_hamt_set_many(batched, keys, values, n);
+  assert(Value_hamt_size(batched) == (size_t)n);
+  batched = Value_hamt_remove_many(batched, keys, n);
+  assert(batched->root == NULL && Value_hamt_size(batched) == 0);
+  batched = Value_hamt_set_many(batched, keys, values, 1);
+  assert(batched->root->type == LEAF);
+
+  /* two keys below one Branch at depth 0 shrink to a leaf either way */
+  int pair = 1;
+  while (Value_hamt_get_frag(get_hash_from_value(keys[pair]), 0) !=
+         Value_hamt_get_frag(get_hash_from_value(keys[0]), 0)) {
+    pair++;
+  }
+  batched = Value_hamt_set_many(batched, keys + pair, values + pair, 1);
+  single = Value_hamt_set_many(Value_hamt_new(), keys, values, 1);
+  single = Value_hamt_set(single, keys[pair], values[pair]);
+  assert(batched->root->type == BRANCH && single->root->type == BRANCH);
+  batched = Value_hamt_remove_many(batched, keys, 1);
+  single = Value_hamt_remove(single, keys[0]);
+  assert(batched->root->type == LEAF && single->root->type == LEAF);
+  free(words);
+  free(keys);
+  free(values);
+  printf("Batch update checks passed\n");
+}
+void test_trace(void) {
+  char path[64], *data;
+  const char *keys[] = {"GET /", "GET /", "Aa collision", "GET /"};
+  unsigned int ops[] = {HAMT_LOG_SET, HAMT_TRACE_GET, HAMT_TRACE_GET,
+                        HAMT_LOG_REMOVE};
+  hamt_trace_record record;
+  const char *key;
+  size_t size, offset = 0, i = 0;
+  unsigned long long last = 0;
+
+  snprintf(path, sizeof(path), "/tmp/hamt-test-trace-%d", (int)getpid());
+  struct Value_hamt *hamt = Value_hamt_new();
+  assert(Value_hamt_trace_start(hamt, path, encode_string, NULL) == 0);
+  hamt = Value_hamt_set(hamt, mkkey_string("GET /"), "index");
+  assert(Value_hamt_get(hamt, mkkey_string("GET /")) != NULL);
+  assert(Value_hamt_get(hamt, mkkey_string("Aa collision")) == NULL);
+  hamt = Value_hamt_remove(hamt, mkkey_string("GET /"));
+  assert(Value_hamt_trace_stop(hamt) == 0 && hamt->trace == NULL);
+  /* untraced calls leave the file alone */
+  hamt = Value_hamt_set(hamt, mkkey_string("GET /"), "index");
+
+  assert((data = hamt_read_file(path, &size)) != NULL);
+  for (; hamt_trace_next(data, size, &offset, &record, &key); ++i) {
+    size_t key_len = record.op_len & HAMT_TRACE_KEY_MAX;
+
+    assert(i < 4 && record.op_len >> 24 == ops[i] && record.time >= last);
+    assert(record.hash == get_hash((char *)keys[i]));
+    assert(key_len == strlen(keys[i]) && memcmp(key, keys[i], key_len) == 0);
+    last = record.time;
+  }
+  assert(i == 4 && offset == size);
+
+  /* a record cut short ends the trace */
+  size_t cut = 0;
+  for (i = 0; hamt_trace_next(data, size - 1, &cut, &record, &key);) {
+    i++;
+  }
+  assert(i == 3);
+  free(data);
+  unlink(path);
+  printf("Trace checks passed\n");
+}
+void test_flood(void) {
+  struct Str_hamt *hamt = Str_hamt_new();
+  struct U64_hamt *ints = U64_hamt_new();
+  int n = 1 << 11;
+  char **keys = malloc(sizeof(char *) * n);
+  U64 *int_keys = malloc(sizeof(U64) * n);
+  char miss[32];
+
+  /* every key hashes alike, as "Aa" and "BB" do */
+  for (int i = 0; i < n; ++i) {
+    keys[i] = malloc(26);
+    for (int j = 0; j < 11; ++j) {
+      memcpy(&keys[i][j * 2], i & (1 << j) ? "BB" : "Aa", 2);
+    }
+    strcpy(&keys[i][22], "-Aa");
+    hamt = Str_hamt_set(hamt, keys[i], keys[i]);
+    /* and so do these, both halves being equal */
+    int_keys[i] = (U64)i << 32 | (U64)i;
+    ints = U64_hamt_set(ints, &int_keys[i], keys[i]);
+  }
+  snprintf(miss, sizeof(miss), "%.22s-BB", keys[5]);
+  assert(hamt->root->type == COLLISION && hamt->root->bitmap == n);
+  assert(ints->root->type == COLLISION && ints->root->bitmap == n);
+  for (int i = 0; i < n; ++i) {
+    assert(Str_hamt_get(hamt, keys[i]) == keys[i]);
+    assert(U64_hamt_get(ints, &int_keys[i]) == keys[i]);
+  }
+  assert(Str_hamt_get(hamt, miss) == NULL);
+
+  for (int i = 0; i < n; i += 3) {
+    hamt = Str_hamt_remove(hamt, keys[i]);
+  }
+  hamt = Str_hamt_set(hamt, keys[1], keys[0]);
+  Str_hamt_compact(hamt);
+  for (int i = 0; i < n; ++i) {
+    assert(Str_hamt_get(hamt, keys[i]) ==
+           (i % 3 == 0 ? NULL : i == 1 ? keys[0] : keys[i]));
+  }
+
+  /* built in one go, and in batches */
+  hamt = Str_hamt_from_array(keys, (void **)keys, n);
+  struct Str_hamt *batched = Str_hamt_new();
+  batched = Str_hamt_set_many(batched, keys, (void **)keys, n / 2);
+  batched = Str_hamt_set_many(batched, keys + n / 4, (void **)keys, n / 2);
+  batched = Str_hamt_remove_many(batched, keys, n / 8);
+  for (int i = 0; i < n; ++i) {
+    assert(Str_hamt_get(hamt, keys[i]) == keys[i]);
+    assert(Str_hamt_get(batched, keys[i]) ==
+           (i < n / 8 || i >= 3 * n / 4 ? NULL
+            : i < n / 4                 ? keys[i]
+                                        : keys[i - n / 4]));
+  }
+  free(keys);
+  free(int_keys);
+  printf("Hash flooding checks passed\n");
+}
+static unsigned long long check_content(Value_hamt_node *node) {
+  unsigned long long content = 0;
+
+  if (node == NULL || node->type == LEAF) {
+    return node ? hamt_content_entry(node->hash, node->value) : 0;
+  }
+  for (unsigned int i = 0; i < Value_hamt_slots(node); ++i) {
+    content += check_content(node->children[i]);
+  }
+  assert(node->content == content);
+  return content;
+}
+void test_content(char *contents) {
+  char **words = malloc(sizeof(char *) * 20000);
+  Value **keys = malloc(sizeof(Value *) * 20000);
+  Value **reversed = malloc(sizeof(Value *) * 20000);
+  void **values = malloc(sizeof(void *) * 20000);
+  int n = 0;
+
+  for (char *word = strtok(strdup(contents), "\n"); word && n < 20000;
+       word = strtok(NULL, "\n"), ++n) {
+    words[n] = word;
+    keys[n] = mkkey_string(word);
+  }
+  for (int i = 0; i < n; ++i) {
+    reversed[i] = keys[n - 1 - i];
+    values[i] = words[n - 1 - i];
+  }
+
+  /* the same entries, however they went in */
+  struct Value_hamt *one = Value_hamt_new();
+  for (int i = 0; i < n; ++i) {
+    one = Value_hamt_set(one, keys[i], words[i]);
+  }
+  struct Value_hamt *two = Value_hamt_from_array(reversed, values, n);
+  struct Value_hamt *three = Value_hamt_new();
+  three = Value_hamt_set_many(three, reversed, values, n);
+  assert(check_content(one->root) == Value_hamt_content_hash(one));
+  assert(Value_hamt_content_hash(one) == Value_hamt_content_hash(two));
+  assert(Value_hamt_content_hash(one) == Value_hamt_content_hash(three));
+  assert(Value_hamt_equals(one, two) && Value_hamt_equals(two, three));
+  assert(Value_hamt_probably_equals(one, two));
+
+  /* a new value tells them apart, until it's put back */
+  one = Value_hamt_set(one, keys[7], words[8]);
+  assert(Value_hamt_content_hash(one) != Value_hamt_content_hash(two));
+  assert(!Value_hamt_equals(one, two) && !Value_hamt_probably_equals(one, two));
+  one = Value_hamt_set(one, keys[7], words[7]);
+  assert(Value_hamt_equals(one, two));
+
+  /* shrunk one key at a time and in a batch, then moved */
+  for (int i = 0; i < n; i += 2) {
+    one = Value_hamt_remove(one, keys[i]);
+  }
+  three = Value_hamt_remove_many(three, keys, n);
+  three = Value_hamt_set_many(three, keys + 1, (void **)words + 1, n - 1);
+  for (int i = 2; i < n; i += 2) {
+    three = Value_hamt_remove(three, keys[i]);
+  }
+  Value_hamt_compact(one);
+  assert(check_content(one->root) == Value_hamt_content_hash(one));
+  assert(check_content(three->root) == Value_hamt_content_hash(three));
+  assert(Value_hamt_equals(one, three) && !Value_hamt_equals(one, two));
+
+  /* derived tries, shared subtrees and all */
+  struct Value_hamt *loud = Value_hamt_map_values(two, shout, words[0], 4);
+  struct Value_hamt *kept = Value_hamt_filter(two, keep_a, NULL, 4);
+  assert(check_content(loud->root) == Value_hamt_content_hash(loud));
+  assert(!Value_hamt_equals(loud, two));
+  assert(Value_hamt_equals(Value_hamt_filter(one, keep_a, NULL, 1),
+                           Value_hamt_filter(three, keep_a, NULL, 4)));
+  assert(check_content(kept->root) == Value_hamt_content_hash(kept));
+  assert(!Value_hamt_equals(kept, two));
+  assert(Value_hamt_equals(Value_hamt_filter(two, keep_all, NULL, 4), two));
+
+  /* keys sharing a hash only differ to `equals` */
+  struct Value_hamt *aa = Value_hamt_new(), *bb = Value_hamt_new();
+  aa = Value_hamt_set(aa, mkkey_string("Aa collision"), "value");
+  bb = Value_hamt_set(bb, mkkey_string("BB collision"), "value");
+  assert(Value_hamt_content_hash(aa) == Value_hamt_content_hash(bb));
+  assert(!Value_hamt_equals(aa, bb) && Value_hamt_probably_equals(aa, bb));
+  aa = Value_hamt_set(aa, mkkey_string("BB collision"), "value");
+  bb = Value_hamt_set(bb, mkkey_string("Aa collision"), "value");
+  assert(check_content(aa->root) == Value_hamt_content_hash(aa));
+  assert(Value_hamt_equals(aa, bb));
+  aa = Value_hamt_remove(aa, mkkey_string("Aa collision"));
+  assert(!Value_hamt_equals(aa, bb));
+  bb = Value_hamt_remove(bb, mkkey_string("Aa collision"));
+  assert(Value_hamt_equals(aa, bb));
+  assert(Value_hamt_equals(Value_hamt_new(), Value_hamt_new()));
+  assert(Value_hamt_content_hash(Value_hamt_new()) == 0);
+  free(words);
+  free(keys);
+  free(reversed);
+  free(values);
+  printf("Content checks passed\n");
+}
+/* Updates change the nodes a trie holds alone and copy the shared ones */
+void test_in_place(char *contents) {
+  struct Value_hamt *hamt = Value_hamt_new();
+  struct Value_hamt *shared;
+  Value **keys = malloc(sizeof(Value *) * 20000);
+  char **words = malloc(sizeof(char *) * 20000);
+  Value_hamt_node *root;
+  int n = 0;
+
+  for (char *word = strtok(strdup(contents), "\n"); word && n < 20000;
+       word = strtok(NULL, "\n"), ++n) {
+    words[n] = word;
+    keys[n] = mkkey_string(word);
+    hamt = Value_hamt_set(hamt, keys[n], word);
+  }
+
+  /* a new value for a key moves no node the trie holds alone */
+  root = hamt->root;
+  hamt = Value_hamt_set(hamt, keys[1], words[2]);
+  assert(hamt->root == root);
+
+  /* once shared, the path down to a change is copied instead */
+  shared = Value_hamt_filter(hamt, keep_all, NULL, 2);
+  assert(shared->root == root);
+  hamt = Value_hamt_set(hamt, keys[1], words[1]);
+  assert(hamt->root != root && shared->root == root);
+  assert(Value_hamt_get(shared, keys[1]) == words[2]);
+
+  for (int i = 0; i < n; i += 2) {
+    hamt = Value_hamt_remove(hamt, keys[i]);
+  }
+  assert(check_sizes(hamt->root) == (unsigned int)n / 2);
+  assert(check_sizes(shared->root) == (unsigned int)n);
+  for (int i = 0; i < n; ++i) {
+    assert(Value_hamt_get(hamt, keys[i]) == (i % 2 == 0 ? NULL : words[i]));
+    assert(Value_hamt_get(shared, keys[i]) == (i == 1 ? words[2] : words[i]));
+  }
+  for (int i = 1; i < n; i += 2) {
+    hamt = Value_hamt_remove(hamt, keys[i]);
+  }
+  assert(hamt->root == NULL && Value_hamt_size(shared) == (size_t)n);
+  free(keys);
+  free(words);
+  printf("In place checks passed\n");
+}
 int main(void) {
   int fd;
   struct stat sb;
@@ -318,6 +1655,28 @@ int main(void) {
 
   test_case_1();
   test_case_2(contents);
+  test_many_collisions();
+  test_shapes(contents);
+  test_from_array(contents);
+  test_load_parallel(contents, sb.st_size);
+  test_freeze(contents);
+  test_static_table();
+  test_filter(contents);
+  test_cache();
+  test_hamt32(contents);
+  test_scan(contents);
+  test_shared_memory();
+  test_log(contents);
+  test_compact(contents);
+  test_hash_batch(contents);
+  test_strkey(contents);
+  test_counts(contents);
+  test_derive(contents);
+  test_set_many(contents);
+  test_trace();
+  test_flood();
+  test_content(contents);
+  test_in_place(contents);
 
   munmap(contents, sb.st_size);
   close(fd);
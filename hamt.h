@@ -32,18 +32,45 @@ of this software, even if advised of the possibility of such damage.
 #ifndef HAMT_H
 #define HAMT_H
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAMT_HASH_SIMD
+#endif
+
 enum NODE_TYPE { LEAF, BRANCH, COLLISION, ARRAY_NODE };
 
 #define BITS     5
 #define SIZE     32
 #define MASK     31
 
-/* This is arbitrary, as a collision should only have two nodes */
-#define MIN_COLLISION_NODE_SIZE 8
-
 #define MAX_BRANCH_SIZE         16
 #define MIN_ARRAY_NODE_SIZE     8
 
+/* marks a missing node index in the 32-bit layouts */
+#define HAMT_NONE 0xFFFFFFFFU
+
+/* Branch bitmaps wide enough for 2^bits children, see HAMT_DEFINE_EX */
+#define HAMT_BITMAP(bits)  HAMT_BITMAP_(bits)
+#define HAMT_BITMAP_(bits) HAMT_BITMAP_##bits
+#define HAMT_BITMAP_4      unsigned int
+#define HAMT_BITMAP_5      unsigned int
+#define HAMT_BITMAP_6      unsigned long long
+
 /**
  * convert a string to a 32bit unsigned integer
  */
@@ -58,751 +85,5420 @@ static inline unsigned int get_hash(char *str) {
   return hash;
 }
 
-// clang-format off
-/** HAMT_DEFINE: Macro achieve polymorphism.
-Your type must have a single-symbol name.
-```
-typedef struct MyKeyType {
-  char *str;
-} MyKeyType;
-```
-It must be able to check equality, for example when
-inserting with a hash collission
-```
-bool mykeytype_equals(MyKeyType *s0, MyKeyType *s1) {
-  bool return_value = strcmp(s0->str, s1->str) == 0;
-  return return_value;
+/**
+ * Hashes for integer keys, usable as `hashof` for `unsigned int` and
+ * `unsigned long long` keys. The bits are mixed with the MurmurHash3
+ * finalizer, so sequential keys still spread over the whole trie.
+ */
+static inline unsigned int hamt_mix32(unsigned int hash) {
+  hash ^= hash >> 16;
+  hash *= 0x85EBCA6BU;
+  hash ^= hash >> 13;
+  hash *= 0xC2B2AE35U;
+  return hash ^ (hash >> 16);
 }
-unsigned int get_hash_of_mykeytype(MyKeyType *s) { return get_hash(s->str); }
-```
-`HAMT_DEFINE` will define types & functions prefixed
-with `name_hamt_`, where `name` in this example is `MyKeyType`.
-```
-HAMT_DEFINE(MyKeyType, get_hash_of_mykeytype, mykeytype_equals)
-```
+
+static inline unsigned int hamt_hash_u32(unsigned int *key) {
+  return hamt_mix32(*key);
+}
+
+static inline unsigned int hamt_hash_u64(unsigned long long *key) {
+  return hamt_mix32((unsigned int)(*key ^ (*key >> 32)));
+}
+
+/* ====== Batch hashing ====== */
+/**
+ * `get_hash` over many keys at once, one key per vector lane. Each
+ * step folds the next 4 characters of every key into its lane, as
+ * h * 31^4 + c0 * 31^3 + c1 * 31^2 + c2 * 31 + c3. Lanes whose key has
+ * fewer than 4 characters left keep their hash, and finish their last
+ * `len % 4` characters one at a time. The AVX2 kernel runs 8 lanes and
+ * gathers the words straight from the keys, the SSE4.2 one runs 4. The
+ * best one the CPU supports is picked at run time, other compilers and
+ * targets use the scalar loop.
  */
-// clang-format on
-#define HAMT_DEFINE(name, hashof, equals)                                            \
-  typedef struct name##_hamt_node {                                                  \
-    enum NODE_TYPE type;                                                             \
-    unsigned int hash;                                                               \
-    /**                                                                              \
-     * This is only used by the collision node and array_node and is a               \
-     * count of the total number of children held in the node                        \
-     */                                                                              \
-    int bitmap;                                                                      \
-    name *key;                                                                       \
-    void *value;                                                                     \
-    struct name##_hamt_node **children;                                              \
-  } name##_hamt_node;                                                                \
+#ifdef HAMT_HASH_SIMD
+
+/* the 4 chars of each 32-bit lane, widened the way `get_hash` does */
+#define HAMT_HASH_CHARS(isa, shr, and, set1, block, c)                               \
+  do {                                                                               \
+    if ((char)-1 < 0) {                                                              \
+      c[0] = _mm##isa##_srai_epi32(_mm##isa##_slli_epi32(block, 24), 24);            \
+      c[1] = _mm##isa##_srai_epi32(_mm##isa##_slli_epi32(block, 16), 24);            \
+      c[2] = _mm##isa##_srai_epi32(_mm##isa##_slli_epi32(block, 8), 24);             \
+      c[3] = _mm##isa##_srai_epi32(block, 24);                                       \
+    } else {                                                                         \
+      c[0] = and(block, set1(0xFF));                                                 \
+      c[1] = and(shr(block, 8), set1(0xFF));                                         \
+      c[2] = and(shr(block, 16), set1(0xFF));                                        \
+      c[3] = shr(block, 24);                                                         \
+    }                                                                                \
+  } while (0)
+
+/* Finish each lane's last `len % 4` characters */
+static inline void hamt_hash_tails(char **keys, const unsigned int *len,
+                                   const unsigned int *hash, int lanes,
+                                   unsigned int *out) {
+  for (int l = 0; l < lanes; ++l) {
+    unsigned int h = hash[l];
+
+    for (char *ptr = keys[l] + (len[l] & ~3U); *ptr; ++ptr) {
+      h = ((h << BITS) - h) + *ptr;
+    }
+    out[l] = h;
+  }
+}
+
+__attribute__((target("avx2"))) static inline void
+hamt_hash_strings_avx2(char **keys, size_t n, unsigned int *out) {
+  for (size_t i = 0; i + 8 <= n; i += 8) {
+    unsigned int len[8], most = 0, hashes[8];
+    __m256i hash = _mm256_setzero_si256(), c[4];
+
+    for (int l = 0; l < 8; ++l) {
+      len[l] = (unsigned int)strlen(keys[i + l]);
+      most = len[l] > most ? len[l] : most;
+    }
+    __m256i lens = _mm256_loadu_si256((const __m256i *)len);
+    __m256i lo = _mm256_loadu_si256((const __m256i *)(keys + i));
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(keys + i + 4));
+
+    for (unsigned int at = 0; at + 4 <= most; at += 4) {
+      __m256i offset = _mm256_set1_epi64x(at);
+      /* lanes with 4 more chars, the others must not be read */
+      __m256i live = _mm256_cmpgt_epi32(lens, _mm256_set1_epi32(at + 3));
+      __m128i words_lo = _mm256_mask_i64gather_epi32(
+          _mm_setzero_si128(), (const int *)0, _mm256_add_epi64(lo, offset),
+          _mm256_castsi256_si128(live), 1);
+      __m128i words_hi = _mm256_mask_i64gather_epi32(
+          _mm_setzero_si128(), (const int *)0, _mm256_add_epi64(hi, offset),
+          _mm256_extracti128_si256(live, 1), 1);
+      __m256i block = _mm256_set_m128i(words_hi, words_lo);
+
+      HAMT_HASH_CHARS(256, _mm256_srli_epi32, _mm256_and_si256,
+                      _mm256_set1_epi32, block, c);
+      __m256i next = _mm256_mullo_epi32(hash, _mm256_set1_epi32(923521));
+      next = _mm256_add_epi32(
+          next, _mm256_mullo_epi32(c[0], _mm256_set1_epi32(29791)));
+      next = _mm256_add_epi32(next,
+                              _mm256_mullo_epi32(c[1], _mm256_set1_epi32(961)));
+      next = _mm256_add_epi32(next,
+                              _mm256_mullo_epi32(c[2], _mm256_set1_epi32(31)));
+      next = _mm256_add_epi32(next, c[3]);
+      hash = _mm256_or_si256(_mm256_and_si256(live, next),
+                             _mm256_andnot_si256(live, hash));
+    }
+    _mm256_storeu_si256((__m256i *)hashes, hash);
+    hamt_hash_tails(keys + i, len, hashes, 8, out + i);
+  }
+}
+
+__attribute__((target("sse4.2"))) static inline void
+hamt_hash_strings_sse42(char **keys, size_t n, unsigned int *out) {
+  for (size_t i = 0; i + 4 <= n; i += 4) {
+    unsigned int len[4], most = 0, hashes[4], words[4];
+    __m128i hash = _mm_setzero_si128(), c[4];
+
+    for (int l = 0; l < 4; ++l) {
+      len[l] = (unsigned int)strlen(keys[i + l]);
+      most = len[l] > most ? len[l] : most;
+    }
+    __m128i lens = _mm_loadu_si128((const __m128i *)len);
+
+    for (unsigned int at = 0; at + 4 <= most; at += 4) {
+      __m128i live = _mm_cmpgt_epi32(lens, _mm_set1_epi32(at + 3));
+
+      for (int l = 0; l < 4; ++l) {
+        words[l] = 0;
+        if (at + 4 <= len[l]) {
+          memcpy(&words[l], keys[i + l] + at, 4);
+        }
+      }
+      __m128i block = _mm_setr_epi32(words[0], words[1], words[2], words[3]);
+
+      HAMT_HASH_CHARS(, _mm_srli_epi32, _mm_and_si128, _mm_set1_epi32, block,
+                      c);
+      __m128i next = _mm_mullo_epi32(hash, _mm_set1_epi32(923521));
+      next = _mm_add_epi32(next, _mm_mullo_epi32(c[0], _mm_set1_epi32(29791)));
+      next = _mm_add_epi32(next, _mm_mullo_epi32(c[1], _mm_set1_epi32(961)));
+      next = _mm_add_epi32(next, _mm_mullo_epi32(c[2], _mm_set1_epi32(31)));
+      next = _mm_add_epi32(next, c[3]);
+      hash = _mm_or_si128(_mm_and_si128(live, next),
+                          _mm_andnot_si128(live, hash));
+    }
+    _mm_storeu_si128((__m128i *)hashes, hash);
+    hamt_hash_tails(keys + i, len, hashes, 4, out + i);
+  }
+}
+
+#endif
+
+/* Hash `n` strings with `get_hash` into `out` */
+static inline void hamt_hash_strings(char **keys, size_t n,
+                                     unsigned int *out) {
+  size_t done = 0;
+
+#ifdef HAMT_HASH_SIMD
+  if (__builtin_cpu_supports("avx2")) {
+    hamt_hash_strings_avx2(keys, n, out);
+    done = n - n % 8;
+  } else if (__builtin_cpu_supports("sse4.2")) {
+    hamt_hash_strings_sse42(keys, n, out);
+    done = n - n % 4;
+  }
+#endif
+  for (size_t i = done; i < n; ++i) {
+    out[i] = get_hash(keys[i]);
+  }
+}
+
+/**
+ * Hash `n` integers with `hamt_hash_u64`, or `hamt_hash_u32` if not
+ * `wide`. The keys are reached through pointers, and gathering them
+ * into vectors costs more than the mixing saves, so this stays scalar.
+ */
+static inline void hamt_hash_ints(void **keys, size_t n, unsigned int *out,
+                                  bool wide) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = wide ? hamt_hash_u64((unsigned long long *)keys[i])
+                  : hamt_hash_u32((unsigned int *)keys[i]);
+  }
+}
+
+/* ====== Collision fingerprints ====== */
+/**
+ * Keys in a collision share their whole hash, so a flood of them would
+ * make every lookup call `equals` on each. Collisions larger than
+ * `HAMT_FINGERPRINT_SCAN` keep a byte per key from a second hash right
+ * after their children, and lookups compare 32 of those at a time before
+ * calling `equals` on the few that match. The bytes are padded to whole
+ * blocks, so the last block can always be loaded.
+ */
+#define HAMT_FINGERPRINT_SCAN  8
+#define HAMT_FINGERPRINT_BLOCK 32
+
+static inline size_t hamt_fingerprint_bytes(unsigned int slots) {
+  return (slots + HAMT_FINGERPRINT_BLOCK - 1) &
+         ~(size_t)(HAMT_FINGERPRINT_BLOCK - 1);
+}
+
+#ifdef HAMT_HASH_SIMD
+/* whether the CPU has AVX2, looked up once as the program loads */
+static bool hamt_fingerprint_avx2;
+
+__attribute__((constructor)) static void hamt_fingerprint_init(void) {
+  __builtin_cpu_init();
+  hamt_fingerprint_avx2 = __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2"))) static inline unsigned int
+hamt_fingerprint_match_avx2(const unsigned char *block, unsigned char fp) {
+  __m256i bytes = _mm256_loadu_si256((const __m256i *)block);
+
+  return (unsigned int)_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8((char)fp)));
+}
+#endif
+
+/* A bit for each of the `HAMT_FINGERPRINT_BLOCK` bytes equal to `fp` */
+static inline unsigned int hamt_fingerprint_match(const unsigned char *block,
+                                                  unsigned char fp) {
+  unsigned int hits = 0;
+
+#ifdef HAMT_HASH_SIMD
+  if (hamt_fingerprint_avx2) {
+    return hamt_fingerprint_match_avx2(block, fp);
+  }
+  /* SSE2 is part of x86-64 */
+  __m128i probe = _mm_set1_epi8((char)fp);
+  hits = (unsigned int)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)block), probe));
+  hits |= (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(
+              _mm_loadu_si128((const __m128i *)(block + 16)), probe))
+          << 16;
+#else
+  for (int i = 0; i < HAMT_FINGERPRINT_BLOCK; ++i) {
+    hits |= (unsigned int)(block[i] == fp) << i;
+  }
+#endif
+  return hits;
+}
+
+/* ====== Content hashes ====== */
+/**
+ * The share of one entry in a trie's content hash. Every node sums the
+ * shares of the entries below it, so the sum doesn't depend on the order
+ * the entries went in, and an update adjusts each node on its path by
+ * the difference. Values count by pointer, keys by their hash.
+ */
+static inline unsigned long long hamt_content_entry(unsigned int hash,
+                                                    const void *value) {
+  unsigned long long x = ((unsigned long long)hash << 32 | hash) ^
+                         (unsigned long long)(uintptr_t)value;
+
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+/**
+ * Run `fn(ctx, i)` for every `i` below `tasks` on up to `nthreads`
+ * threads, the calling thread included. Tasks are handed out one at a
+ * time so uneven tasks still balance. If threads can't be started the
+ * remaining work simply runs on the threads we have.
+ */
+typedef struct hamt_parallel {
+  void (*fn)(void *ctx, size_t task);
+  void *ctx;
+  size_t tasks;
+  atomic_size_t next;
+} hamt_parallel;
+
+static inline void *hamt_parallel_worker(void *arg) {
+  hamt_parallel *p = (hamt_parallel *)arg;
+  size_t task;
+
+  while ((task = atomic_fetch_add(&p->next, 1)) < p->tasks) {
+    p->fn(p->ctx, task);
+  }
+  return NULL;
+}
+
+static inline void hamt_parallel_for(size_t tasks, int nthreads,
+                                     void (*fn)(void *ctx, size_t task),
+                                     void *ctx) {
+  hamt_parallel p = {.fn = fn, .ctx = ctx, .tasks = tasks};
+  pthread_t *threads = NULL;
+  int started = 0;
+
+  atomic_init(&p.next, 0);
+  if (nthreads > 1 && (size_t)nthreads > tasks) {
+    nthreads = (int)tasks;
+  }
+  if (nthreads > 1 &&
+      (threads = (pthread_t *)malloc(sizeof(pthread_t) * nthreads)) != NULL) {
+    while (started < nthreads - 1 &&
+           pthread_create(&threads[started], NULL, hamt_parallel_worker, &p) ==
+               0) {
+      started++;
+    }
+  }
+
+  hamt_parallel_worker(&p);
+  for (int i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+}
+
+/**
+ * Make room for `needed` items of `size` bytes in the array at `*items`,
+ * doubling `*capacity` as needed. Capacities stay below HAMT_NONE so
+ * every slot has a 32-bit index.
+ */
+static inline bool hamt_grow(void **items, unsigned int *capacity,
+                             size_t needed, size_t size) {
+  size_t grown = *capacity ? *capacity : 64;
+  void *resized;
+
+  if (needed <= *capacity) {
+    return true;
+  }
+  while (grown < needed) {
+    grown *= 2;
+  }
+  if (grown >= HAMT_NONE && (grown = needed) >= HAMT_NONE) {
+    fprintf(stderr, "Too many nodes for 32-bit indices\n");
+    return false;
+  }
+  if ((resized = realloc(*items, grown * size)) == NULL) {
+    fprintf(stderr, "Failed to allocate memory for arena\n");
+    return false;
+  }
+  *items = resized;
+  *capacity = grown;
+  return true;
+}
+
+/* ====== Huge pages ====== */
+/**
+ * Where the arena of a compacted trie lives. With huge pages enabled an
+ * arena is mapped with explicit 2MB pages if the system has some set
+ * aside, or else with ordinary pages the kernel is asked to merge into
+ * transparent huge pages. Lookups in a trie much larger than the cache
+ * then miss the TLB far less than with nodes spread over 4KB pages.
+ * Small arenas, and systems with neither, use `malloc`.
+ */
+enum hamt_storage {
+  HAMT_STORAGE_MALLOC,
+  HAMT_STORAGE_HUGETLB,
+  HAMT_STORAGE_THP
+};
+
+#define HAMT_HUGE_PAGE ((size_t)2 << 20)
+/* restarts after which a compaction pass runs to the end in one step */
+#define HAMT_COMPACT_RESTARTS 4
+
+static inline const char *hamt_storage_name(enum hamt_storage storage) {
+  static const char *names[] = {"malloc", "hugetlb", "thp"};
+
+  return names[storage];
+}
+
+static inline size_t hamt_huge_round(size_t size) {
+  return (size + HAMT_HUGE_PAGE - 1) & ~(HAMT_HUGE_PAGE - 1);
+}
+
+/* Allocate `size` bytes, on huge pages if `huge` and we can */
+static inline char *hamt_storage_alloc(size_t size, bool huge,
+                                       enum hamt_storage *storage) {
+  *storage = HAMT_STORAGE_MALLOC;
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+  if (huge && size >= HAMT_HUGE_PAGE / 2) {
+    size_t mapped = hamt_huge_round(size);
+    char *data;
+
+#ifdef MAP_HUGETLB
+    data = (char *)mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data != MAP_FAILED) {
+      *storage = HAMT_STORAGE_HUGETLB;
+      return data;
+    }
+#endif
+    /* one huge page more, to trim down to an aligned range */
+    data = (char *)mmap(NULL, mapped + HAMT_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data != MAP_FAILED) {
+      size_t head = (HAMT_HUGE_PAGE - (uintptr_t)data % HAMT_HUGE_PAGE) %
+                    HAMT_HUGE_PAGE;
+
+      if (head > 0) {
+        munmap(data, head);
+      }
+      munmap(data + head + mapped, HAMT_HUGE_PAGE - head);
+      data += head;
+      if (madvise(data, mapped, MADV_HUGEPAGE) == 0) {
+        *storage = HAMT_STORAGE_THP;
+        return data;
+      }
+      munmap(data, mapped);
+    }
+  }
+#else
+  (void)huge;
+#endif
+  return (char *)malloc(size);
+}
+
+static inline void hamt_storage_free(char *data, size_t size,
+                                     enum hamt_storage storage) {
+  if (storage == HAMT_STORAGE_MALLOC) {
+    free(data);
+  } else if (data != NULL) {
+    munmap(data, hamt_huge_round(size));
+  }
+}
+
+/**
+ * Shape and storage of a trie, from `name##_hamt_stats`. Nodes count
+ * Branches, ArrayNodes and Collisions as well as leaves.
+ */
+typedef struct hamt_stats {
+  size_t entries;
+  size_t nodes;
+  /* of those, the ones laid out by the last compaction */
+  size_t arena_nodes;
+  size_t arena_bytes;
+  enum hamt_storage storage;
+} hamt_stats;
+
+/* ====== Filters ====== */
+/**
+ * A blocked Bloom filter over 32-bit hashes. Every hash maps to one 64
+ * byte block and sets `HAMT_FILTER_PROBES` bits within it, so a query
+ * touches a single cache line. It is sized at `HAMT_FILTER_BITS_PER_KEY`
+ * bits per key, giving roughly a 1-2% false positive rate.
+ */
+#define HAMT_FILTER_BITS_PER_KEY 10
+#define HAMT_FILTER_PROBES       4
+#define HAMT_FILTER_BLOCK_WORDS  16
+
+typedef struct hamt_filter {
+  unsigned int *blocks;
+  size_t block_mask;
+  /* number of keys the filter was sized for */
+  size_t capacity;
+  size_t inserted;
+  size_t removed;
+} hamt_filter;
+
+/* splitmix64 finaliser, to spread weak hashes over the whole filter */
+static inline unsigned long long hamt_mix64(unsigned int hash) {
+  unsigned long long x = hash + 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+static inline hamt_filter *hamt_filter_new(size_t capacity) {
+  hamt_filter *filter;
+  size_t blocks = 1;
+
+  while (blocks * HAMT_FILTER_BLOCK_WORDS * 32 <
+         capacity * HAMT_FILTER_BITS_PER_KEY) {
+    blocks <<= 1;
+  }
+  if ((filter = (hamt_filter *)malloc(sizeof(hamt_filter))) == NULL ||
+      (filter->blocks = (unsigned int *)aligned_alloc(
+           64, blocks * HAMT_FILTER_BLOCK_WORDS * sizeof(unsigned int))) ==
+          NULL) {
+    fprintf(stderr, "Failed to allocate memory for filter\n");
+    free(filter);
+    return NULL;
+  }
+
+  memset(filter->blocks, 0,
+         blocks * HAMT_FILTER_BLOCK_WORDS * sizeof(unsigned int));
+  filter->block_mask = blocks - 1;
+  filter->capacity = capacity;
+  filter->inserted = 0;
+  filter->removed = 0;
+  return filter;
+}
+
+static inline void hamt_filter_free(hamt_filter *filter) {
+  if (filter != NULL) {
+    free(filter->blocks);
+    free(filter);
+  }
+}
+
+/* Set the bits of `hash` without counting it as inserted */
+static inline void hamt_filter_mark(hamt_filter *filter, unsigned int hash) {
+  unsigned long long x = hamt_mix64(hash);
+  size_t at = ((x >> 36) & filter->block_mask) * HAMT_FILTER_BLOCK_WORDS;
+  unsigned int *block = &filter->blocks[at];
+
+  for (int i = 0; i < HAMT_FILTER_PROBES; ++i, x >>= 9) {
+    block[(x >> 5) & (HAMT_FILTER_BLOCK_WORDS - 1)] |= 1U << (x & 31);
+  }
+}
+
+static inline void hamt_filter_add(hamt_filter *filter, unsigned int hash) {
+  hamt_filter_mark(filter, hash);
+  filter->inserted++;
+}
+
+/* false means the hash was never added, true that it may have been */
+static inline bool hamt_filter_maybe(const hamt_filter *filter,
+                                     unsigned int hash) {
+  unsigned long long x = hamt_mix64(hash);
+  size_t at = ((x >> 36) & filter->block_mask) * HAMT_FILTER_BLOCK_WORDS;
+  const unsigned int *block = &filter->blocks[at];
+
+  for (int i = 0; i < HAMT_FILTER_PROBES; ++i, x >>= 9) {
+    if (!(block[(x >> 5) & (HAMT_FILTER_BLOCK_WORDS - 1)] & (1U << (x & 31)))) {
+      return false;
+    }
+  }
+  return true;
+}
+/* ====== Front caches ====== */
+/**
+ * A small set associative cache of recent lookups. Each set holds
+ * `HAMT_CACHE_WAYS` entries in one 64 byte line. An entry remembers the
+ * hash, key and value of a hit along with the version of the hamt it was
+ * found in, so bumping the version invalidates every entry at once.
+ *
+ * Readers fill the cache as they go, so entries are guarded by a
+ * sequence number which is odd while an entry is written. A reader that
+ * sees it change treats the entry as a miss, and a writer that finds it
+ * odd leaves the entry to whoever holds it.
+ */
+#define HAMT_CACHE_WAYS 2
+
+typedef struct hamt_cache_entry {
+  atomic_uint seq;
+  atomic_uint hash;
+  atomic_ulong version;
+  _Atomic(void *) key;
+  _Atomic(void *) value;
+} hamt_cache_entry;
+
+typedef struct hamt_cache {
+  hamt_cache_entry *entries;
+  size_t set_mask;
+} hamt_cache;
+
+static inline hamt_cache *hamt_cache_new(size_t sets) {
+  hamt_cache *cache;
+  size_t count = 1;
+
+  while (count < sets) {
+    count <<= 1;
+  }
+  if ((cache = (hamt_cache *)malloc(sizeof(hamt_cache))) == NULL ||
+      (cache->entries = (hamt_cache_entry *)aligned_alloc(
+           64, count * HAMT_CACHE_WAYS * sizeof(hamt_cache_entry))) == NULL) {
+    fprintf(stderr, "Failed to allocate memory for cache\n");
+    free(cache);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < count * HAMT_CACHE_WAYS; ++i) {
+    atomic_init(&cache->entries[i].seq, 0);
+    atomic_init(&cache->entries[i].hash, 0);
+    atomic_init(&cache->entries[i].version, 0);
+    atomic_init(&cache->entries[i].key, NULL);
+    atomic_init(&cache->entries[i].value, NULL);
+  }
+  cache->set_mask = count - 1;
+  return cache;
+}
+
+static inline void hamt_cache_free(hamt_cache *cache) {
+  if (cache != NULL) {
+    free(cache->entries);
+    free(cache);
+  }
+}
+
+static inline hamt_cache_entry *hamt_cache_set(hamt_cache *cache,
+                                               unsigned int hash) {
+  return &cache->entries[(hamt_mix64(hash) & cache->set_mask) *
+                         HAMT_CACHE_WAYS];
+}
+
+/**
+ * Copy out the key and value of `entry` if it holds `hash` as of
+ * `version` and wasn't being written meanwhile.
+ */
+static inline bool hamt_cache_read(hamt_cache_entry *entry, unsigned int hash,
+                                   unsigned long version, void **key,
+                                   void **value) {
+  unsigned int seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+
+  if ((seq & 1) ||
+      atomic_load_explicit(&entry->hash, memory_order_relaxed) != hash ||
+      atomic_load_explicit(&entry->version, memory_order_relaxed) != version) {
+    return false;
+  }
+  *key = atomic_load_explicit(&entry->key, memory_order_relaxed);
+  *value = atomic_load_explicit(&entry->value, memory_order_relaxed);
+  atomic_thread_fence(memory_order_acquire);
+
+  return *key != NULL &&
+         atomic_load_explicit(&entry->seq, memory_order_relaxed) == seq;
+}
+
+/**
+ * Remember a hit, preferring a way which is empty or out of date and
+ * otherwise taking turns between the ways of the set.
+ */
+static inline void hamt_cache_write(hamt_cache *cache, unsigned int hash,
+                                    void *key, void *value,
+                                    unsigned long version) {
+  hamt_cache_entry *set = hamt_cache_set(cache, hash);
+  unsigned int writes = 0;
+  int way = -1;
+
+  for (int i = 0; i < HAMT_CACHE_WAYS; ++i) {
+    writes += atomic_load_explicit(&set[i].seq, memory_order_relaxed) >> 1;
+    if (way < 0 &&
+        (atomic_load_explicit(&set[i].key, memory_order_relaxed) == NULL ||
+         atomic_load_explicit(&set[i].version, memory_order_relaxed) !=
+             version)) {
+      way = i;
+    }
+  }
+  if (way < 0) {
+    way = writes % HAMT_CACHE_WAYS;
+  }
+
+  hamt_cache_entry *entry = &set[way];
+  unsigned int seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+  if ((seq & 1) || !atomic_compare_exchange_strong_explicit(
+                       &entry->seq, &seq, seq + 1, memory_order_acquire,
+                       memory_order_relaxed)) {
+    return;
+  }
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&entry->hash, hash, memory_order_relaxed);
+  atomic_store_explicit(&entry->version, version, memory_order_relaxed);
+  atomic_store_explicit(&entry->key, key, memory_order_relaxed);
+  atomic_store_explicit(&entry->value, value, memory_order_relaxed);
+  atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+}
+/* ====== Static tables ====== */
+/**
+ * A read only trie over byte string keys and values, stored in one
+ * position independent block: everything is referenced by offset from
+ * the start of the table, so an image can be emitted as const data by
+ * `hamt-gen`, written to disk or mapped into another process as is.
+ *
+ * Nodes use the layout of a frozen hamt, and keys are placed with
+ * `get_hash` and 32-way fragments, so lookups find exactly what
+ * `name_hamt_get` would on a hamt keyed by the same strings. Keys and
+ * values are stored with a terminating '\0' which is not counted in
+ * their length.
+ */
+#define HAMT_STATIC_MAGIC 0x68616d74
+
+typedef struct hamt_static_node {
+  unsigned int bitmap;
+  unsigned int first;
+} hamt_static_node;
+
+typedef struct hamt_static_leaf {
+  unsigned int hash;
+  unsigned int count;
+  unsigned int key;
+  unsigned int key_len;
+  unsigned int value;
+  unsigned int value_len;
+} hamt_static_leaf;
+
+typedef struct hamt_static_table {
+  unsigned int magic;
+  unsigned int size;
+  unsigned int node_count;
+  unsigned int leaf_count;
+  unsigned int nodes;
+  unsigned int leaves;
+  unsigned int pool;
+  unsigned int pool_size;
+} hamt_static_table;
+
+typedef struct hamt_static_entry {
+  unsigned int hash;
+  const char *key;
+  unsigned int key_len;
+  const char *value;
+  unsigned int value_len;
+} hamt_static_entry;
+
+static inline unsigned int hamt_static_frag(unsigned int hash, int depth) {
+  return (hash >> (BITS * depth)) & MASK;
+}
+
+/* Same bit count as `name_hamt_popcount` */
+static inline int hamt_static_popcount(unsigned int bits) {
+  bits -= ((bits >> 1) & 0x55555555);
+  bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+  bits = (bits & 0xF0F0F0F) + ((bits >> 4) & 0xF0F0F0F);
+  bits += bits >> 8;
+  return (bits + (bits >> 16)) & 0x3F;
+}
+
+static inline const hamt_static_node *
+hamt_static_nodes(const hamt_static_table *table) {
+  return (const hamt_static_node *)((const char *)table + table->nodes);
+}
+
+static inline const hamt_static_leaf *
+hamt_static_leaves(const hamt_static_table *table) {
+  return (const hamt_static_leaf *)((const char *)table + table->leaves);
+}
+
+static inline const char *hamt_static_pool(const hamt_static_table *table) {
+  return (const char *)table + table->pool;
+}
+
+/**
+ * Find `key` of `len` bytes which hashes to `hash`. Returns the leaf
+ * holding it, or NULL.
+ */
+static inline const hamt_static_leaf *
+hamt_static_lookup(const hamt_static_table *table, unsigned int hash,
+                   const char *key, unsigned int len) {
+  const hamt_static_node *nodes = hamt_static_nodes(table);
+  const hamt_static_node *node = nodes;
+
+  if (table->node_count == 0) {
+    return NULL;
+  }
+  for (int depth = 0; node->bitmap; ++depth) {
+    unsigned int mask = 1U << hamt_static_frag(hash, depth);
+
+    if (!(node->bitmap & mask)) {
+      return NULL;
+    }
+    node = &nodes[node->first +
+                  hamt_static_popcount(node->bitmap & (mask - 1))];
+  }
+
+  const hamt_static_leaf *leaf = &hamt_static_leaves(table)[node->first];
+  const char *pool = hamt_static_pool(table);
+  for (unsigned int i = 0; i < leaf->count; ++i) {
+    if (leaf[i].hash == hash && leaf[i].key_len == len &&
+        memcmp(pool + leaf[i].key, key, len) == 0) {
+      return &leaf[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Look up a '\0' terminated key, hashed with `get_hash`. Returns the
+ * value as a '\0' terminated string inside the table, or NULL.
+ */
+static inline const char *hamt_static_get(const hamt_static_table *table,
+                                          const char *key) {
+  unsigned int hash = 0;
+  const char *ptr = key;
+
+  while (*ptr != '\0') {
+    hash = ((hash << BITS) - hash) + *(ptr++);
+  }
+
+  const hamt_static_leaf *leaf =
+      hamt_static_lookup(table, hash, key, (unsigned int)(ptr - key));
+  return leaf ? hamt_static_pool(table) + leaf->value : NULL;
+}
+
+/* Trie order radix sort, see `name_hamt_sort_entries` */
+static inline void hamt_static_sort(hamt_static_entry *entries,
+                                    hamt_static_entry *tmp, size_t n) {
+  hamt_static_entry *from = entries, *to = tmp, *swap;
+
+  for (int d = (32 + BITS - 1) / BITS - 1; d >= 0; --d) {
+    size_t offsets[SIZE + 1] = {0};
+
+    for (size_t i = 0; i < n; ++i) {
+      offsets[hamt_static_frag(from[i].hash, d) + 1]++;
+    }
+    for (int i = 0; i < SIZE; ++i) {
+      offsets[i + 1] += offsets[i];
+    }
+    for (size_t i = 0; i < n; ++i) {
+      to[offsets[hamt_static_frag(from[i].hash, d)]++] = from[i];
+    }
+    swap = from;
+    from = to;
+    to = swap;
+  }
+
+  if (from != entries) {
+    memcpy(entries, from, sizeof(hamt_static_entry) * n);
+  }
+}
+
+typedef struct hamt_static_range {
+  size_t start;
+  size_t end;
+  int depth;
+} hamt_static_range;
+
+/**
+ * Build a table from `n` entries, which are reordered in the process.
+ * When a key is given more than once the last one wins. Returns a single
+ * allocation of `table->size` bytes, to be released with `free`.
+ */
+static inline hamt_static_table *hamt_static_build(hamt_static_entry *entries,
+                                                   size_t n) {
+  hamt_static_entry *tmp = NULL;
+  hamt_static_range *queue = NULL;
+  hamt_static_node *nodes = NULL;
+  hamt_static_leaf *leaves = NULL;
+  hamt_static_table *table = NULL;
+  size_t node_count = 0, leaf_count = 0, pool_size = 0;
+
+  /* at most one leaf per entry, and one internal node per leaf per level */
+  size_t max_nodes = n * ((32 + BITS - 1) / BITS + 1) + 1;
+  if ((tmp = (hamt_static_entry *)malloc(sizeof(*tmp) * (n + 1))) == NULL ||
+      (queue = (hamt_static_range *)malloc(sizeof(*queue) * max_nodes)) ==
+          NULL ||
+      (nodes = (hamt_static_node *)malloc(sizeof(*nodes) * max_nodes)) ==
+          NULL ||
+      (leaves = (hamt_static_leaf *)malloc(sizeof(*leaves) * (n + 1))) ==
+          NULL) {
+    fprintf(stderr, "Failed to allocate memory for static table\n");
+    goto done;
+  }
+  hamt_static_sort(entries, tmp, n);
+
+  /* breadth first, so the children of every node are adjacent */
+  size_t tail = 0;
+  if (n > 0) {
+    queue[tail++] = (hamt_static_range){.start = 0, .end = n, .depth = 0};
+  }
+  for (size_t i = 0; i < tail; ++i) {
+    hamt_static_range range = queue[i];
+    hamt_static_node *node = &nodes[node_count++];
+
+    if (entries[range.start].hash == entries[range.end - 1].hash) {
+      /* one full hash: fold equal keys, keeping the last value */
+      size_t first = leaf_count;
+      for (size_t j = range.start; j < range.end; ++j) {
+        size_t k = first;
+        while (k < leaf_count &&
+               !(entries[leaves[k].key].key_len == entries[j].key_len &&
+                 memcmp(entries[leaves[k].key].key, entries[j].key,
+                        entries[j].key_len) == 0)) {
+          k++;
+        }
+        /* the entry index for now, swapped for pool offsets below */
+        leaves[k].key = (unsigned int)j;
+        if (k == leaf_count) {
+          leaf_count++;
+        }
+      }
+      for (size_t k = first; k < leaf_count; ++k) {
+        leaves[k].count = (unsigned int)(leaf_count - k);
+      }
+      node->bitmap = 0;
+      node->first = (unsigned int)first;
+      continue;
+    }
+
+    node->bitmap = 0;
+    node->first = (unsigned int)tail;
+    size_t start = range.start;
+    while (start < range.end) {
+      unsigned int frag = hamt_static_frag(entries[start].hash, range.depth);
+      size_t end = start + 1;
+
+      while (end < range.end &&
+             hamt_static_frag(entries[end].hash, range.depth) == frag) {
+        end++;
+      }
+      node->bitmap |= 1U << frag;
+      queue[tail++] = (hamt_static_range){
+          .start = start, .end = end, .depth = range.depth + 1};
+      start = end;
+    }
+  }
+
+  for (size_t k = 0; k < leaf_count; ++k) {
+    hamt_static_entry *entry = &entries[leaves[k].key];
+    pool_size += entry->key_len + entry->value_len + 2;
+  }
+
+  size_t nodes_at = sizeof(hamt_static_table);
+  size_t leaves_at = nodes_at + sizeof(hamt_static_node) * node_count;
+  size_t pool_at = leaves_at + sizeof(hamt_static_leaf) * leaf_count;
+  size_t size = pool_at + pool_size;
+  if (size > 0xFFFFFFFFU) {
+    fprintf(stderr, "Static table would exceed 4GB\n");
+    goto done;
+  }
+  if ((table = (hamt_static_table *)calloc(1, size)) == NULL) {
+    fprintf(stderr, "Failed to allocate memory for static table\n");
+    goto done;
+  }
+
+  table->magic = HAMT_STATIC_MAGIC;
+  table->size = (unsigned int)size;
+  table->node_count = (unsigned int)node_count;
+  table->leaf_count = (unsigned int)leaf_count;
+  table->nodes = (unsigned int)nodes_at;
+  table->leaves = (unsigned int)leaves_at;
+  table->pool = (unsigned int)pool_at;
+  table->pool_size = (unsigned int)pool_size;
+  memcpy((char *)table + nodes_at, nodes,
+         sizeof(hamt_static_node) * node_count);
+
+  hamt_static_leaf *out = (hamt_static_leaf *)((char *)table + leaves_at);
+  char *pool = (char *)table + pool_at;
+  size_t offset = 0;
+  for (size_t k = 0; k < leaf_count; ++k) {
+    hamt_static_entry *entry = &entries[leaves[k].key];
+    hamt_static_leaf *leaf = &out[k];
+
+    leaf->hash = entry->hash;
+    leaf->count = leaves[k].count;
+    leaf->key = (unsigned int)offset;
+    leaf->key_len = entry->key_len;
+    memcpy(pool + offset, entry->key, entry->key_len);
+    offset += entry->key_len + 1;
+    leaf->value = (unsigned int)offset;
+    leaf->value_len = entry->value_len;
+    memcpy(pool + offset, entry->value, entry->value_len);
+    offset += entry->value_len + 1;
+  }
+
+done:
+  free(tmp);
+  free(queue);
+  free(nodes);
+  free(leaves);
+  return table;
+}
+
+/* ====== Shared memory ====== */
+/**
+ * Static tables published through a POSIX shared memory segment, so one
+ * writer process can hand new versions to any number of reader
+ * processes without each of them building its own copy. The segment
+ * holds a header and two halves. A version is copied into the half that
+ * isn't current and then made current by storing its offset. Tables
+ * only contain offsets, so every process may map the segment anywhere.
+ *
+ * Readers pin the current version between `hamt_shm_enter` and
+ * `hamt_shm_leave`, by announcing the epoch they entered in through a
+ * slot claimed with `hamt_shm_attach`. Every publish starts a new epoch,
+ * and a half is only overwritten once no reader announces an epoch from
+ * before it was replaced. Slots of processes that died don't count.
+ */
+#define HAMT_SHM_MAGIC   0x68736d74
+#define HAMT_SHM_READERS 64
+
+typedef struct hamt_shm_slot {
+  atomic_int pid;
+  /* epoch the reader entered in, 0 while it isn't reading */
+  atomic_ulong epoch;
+} hamt_shm_slot;
+
+typedef struct hamt_shm_header {
+  unsigned int magic;
+  size_t half_size;
+  size_t halves[2];
+  /* offset of the current table, 0 before the first publish */
+  atomic_size_t root;
+  atomic_ulong epoch;
+  /* epoch in which the table in each half stopped being current */
+  unsigned long retired[2];
+  hamt_shm_slot slots[HAMT_SHM_READERS];
+} hamt_shm_header;
+
+typedef struct hamt_shm {
+  hamt_shm_header *header;
+  size_t size;
+} hamt_shm;
+
+/* Map `size` bytes of `fd`, or return NULL */
+static inline hamt_shm_header *hamt_shm_map(int fd, size_t size) {
+  void *header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  return header == MAP_FAILED ? NULL : (hamt_shm_header *)header;
+}
+
+/**
+ * Map the segment `name`. The writer passes the largest table size it
+ * will publish and readers pass 0 to map it as it is. A writer finding a
+ * segment that already holds tables keeps it, with its current table
+ * and readers, as long as its halves are big enough for `table_size`.
+ * Otherwise it creates the segment, but never replaces one that readers
+ * may be using. Processes forked after opening can share the mapping.
+ */
+static inline hamt_shm *hamt_shm_open(const char *name, size_t table_size) {
+  size_t header_size = (sizeof(hamt_shm_header) + 63) & ~(size_t)63;
+  size_t half_size = (table_size + 63) & ~(size_t)63;
+  hamt_shm_header *header = NULL;
+  hamt_shm *shm;
+  struct stat sb;
+  int fd;
+
+  if ((shm = (hamt_shm *)malloc(sizeof(hamt_shm))) == NULL) {
+    fprintf(stderr, "Failed to allocate memory for shared memory\n");
+    return NULL;
+  }
+  if ((fd = shm_open(name, table_size ? O_RDWR | O_CREAT : O_RDWR, 0600)) ==
+      -1) {
+    fprintf(stderr, "Failed to open shared memory %s: %s\n", name,
+            strerror(errno));
+    free(shm);
+    return NULL;
+  }
+  if (fstat(fd, &sb) == -1) {
+    fprintf(stderr, "Failed to size shared memory %s: %s\n", name,
+            strerror(errno));
+    goto fail;
+  }
+
+  /* a segment someone set up before, which may have readers */
+  shm->size = sb.st_size;
+  if (shm->size >= sizeof(hamt_shm_header)) {
+    if ((header = hamt_shm_map(fd, shm->size)) == NULL) {
+      fprintf(stderr, "Failed to map shared memory %s: %s\n", name,
+              strerror(errno));
+      goto fail;
+    }
+    if (header->magic == HAMT_SHM_MAGIC) {
+      atomic_thread_fence(memory_order_acquire);
+      if (header->half_size < half_size) {
+        fprintf(stderr, "Shared memory %s is too small for %zu bytes\n", name,
+                table_size);
+        goto fail;
+      }
+      close(fd);
+      shm->header = header;
+      return shm;
+    }
+  }
+  if (!table_size || shm->size != 0) {
+    fprintf(stderr, "Shared memory %s holds no tables\n", name);
+    goto fail;
+  }
+
+  /* a segment just created, which nobody has mapped yet */
+  shm->size = header_size + 2 * half_size;
+  if (ftruncate(fd, shm->size) == -1) {
+    fprintf(stderr, "Failed to size shared memory %s: %s\n", name,
+            strerror(errno));
+    goto fail;
+  }
+  if ((header = hamt_shm_map(fd, shm->size)) == NULL) {
+    fprintf(stderr, "Failed to map shared memory %s: %s\n", name,
+            strerror(errno));
+    goto fail;
+  }
+  close(fd);
+  header->half_size = half_size;
+  header->halves[0] = header_size;
+  header->halves[1] = header_size + half_size;
+  atomic_init(&header->root, 0);
+  atomic_init(&header->epoch, 1);
+  header->retired[0] = header->retired[1] = 0;
+  for (int i = 0; i < HAMT_SHM_READERS; ++i) {
+    atomic_init(&header->slots[i].pid, 0);
+    atomic_init(&header->slots[i].epoch, 0);
+  }
+  atomic_thread_fence(memory_order_release);
+  header->magic = HAMT_SHM_MAGIC;
+  shm->header = header;
+  return shm;
+
+fail:
+  if (header != NULL) {
+    munmap(header, shm->size);
+  }
+  close(fd);
+  free(shm);
+  return NULL;
+}
+
+static inline void hamt_shm_close(hamt_shm *shm) {
+  munmap(shm->header, shm->size);
+  free(shm);
+}
+
+static inline bool hamt_shm_alive(int pid) {
+  return pid != 0 && !(kill(pid, 0) == -1 && errno == ESRCH);
+}
+
+/**
+ * Claim a reader slot for the calling thread, taking over slots of
+ * processes that died. Returns the slot, or -1 when all are taken.
+ */
+static inline int hamt_shm_attach(hamt_shm *shm) {
+  for (int i = 0; i < HAMT_SHM_READERS; ++i) {
+    hamt_shm_slot *slot = &shm->header->slots[i];
+    int owner = atomic_load(&slot->pid);
+
+    if (!hamt_shm_alive(owner) &&
+        atomic_compare_exchange_strong(&slot->pid, &owner, (int)getpid())) {
+      atomic_store(&slot->epoch, 0);
+      return i;
+    }
+  }
+  fprintf(stderr, "No free shared memory reader slot\n");
+  return -1;
+}
+
+static inline void hamt_shm_detach(hamt_shm *shm, int slot) {
+  atomic_store(&shm->header->slots[slot].epoch, 0);
+  atomic_store(&shm->header->slots[slot].pid, 0);
+}
+
+/**
+ * Pin the current table until `hamt_shm_leave`, or return NULL if none
+ * was published yet. Announcing the epoch before reading the root pairs
+ * with `hamt_shm_publish` checking the slots after storing it.
+ */
+static inline const hamt_static_table *hamt_shm_enter(hamt_shm *shm,
+                                                      int slot) {
+  hamt_shm_header *header = shm->header;
+  size_t root;
+
+  atomic_store(&header->slots[slot].epoch, atomic_load(&header->epoch));
+  root = atomic_load(&header->root);
+  return root ? (const hamt_static_table *)((char *)header + root) : NULL;
+}
+
+static inline void hamt_shm_leave(hamt_shm *shm, int slot) {
+  atomic_store_explicit(&shm->header->slots[slot].epoch, 0,
+                        memory_order_release);
+}
+
+/**
+ * Copy `table` into the segment and make it the current version. Only
+ * one process may publish. Fails with EBUSY while a reader still pins
+ * the version from two publishes back, and with EFBIG if `table` is
+ * larger than the segment was made for.
+ */
+static inline int hamt_shm_publish(hamt_shm *shm,
+                                   const hamt_static_table *table) {
+  hamt_shm_header *header = shm->header;
+  size_t root = atomic_load(&header->root);
+  int half = root == header->halves[0] ? 1 : 0;
+
+  if (table->size > header->half_size) {
+    errno = EFBIG;
+    return -1;
+  }
+  for (int i = 0; i < HAMT_SHM_READERS; ++i) {
+    hamt_shm_slot *slot = &header->slots[i];
+    unsigned long epoch = atomic_load(&slot->epoch);
+
+    if (epoch != 0 && epoch < header->retired[half] &&
+        hamt_shm_alive(atomic_load(&slot->pid))) {
+      errno = EBUSY;
+      return -1;
+    }
+  }
+
+  memcpy((char *)header + header->halves[half], table, table->size);
+  atomic_store(&header->root, header->halves[half]);
+  unsigned long epoch = atomic_fetch_add(&header->epoch, 1) + 1;
+  if (root != 0) {
+    header->retired[half ^ 1] = epoch;
+  }
+  return 0;
+}
+
+/* ====== Operation log ====== */
+/**
+ * The files behind `name_hamt_recover`. A checkpoint holds a static
+ * table image of the whole trie, and a log holds the `set` and `remove`
+ * calls made since. Each log record is a `hamt_log_record` followed by
+ * the key and value bytes. Records are buffered and written with one
+ * write and fdatasync once `HAMT_LOG_BATCH` bytes have built up, or on
+ * `name_hamt_sync`, so a crash loses at most the batch being gathered. A
+ * torn record at the end fails its checksum and is dropped.
+ */
+#define HAMT_LOG_BATCH  (64 * 1024)
+#define HAMT_LOG_SET    1
+#define HAMT_LOG_REMOVE 2
+
+typedef struct hamt_log_record {
+  unsigned int op;
+  unsigned int key_len;
+  unsigned int value_len;
+  unsigned int check;
+} hamt_log_record;
+
+typedef struct hamt_log_file {
+  int fd;
+  char *buf;
+  size_t len;
+  size_t cap;
+  /* the last flush failed, so appends only buffer until one gets through */
+  bool failing;
+} hamt_log_file;
+
+/* FNV-1a over the header and the `key_len + value_len` bytes after it */
+static inline unsigned int hamt_log_check(const hamt_log_record *record,
+                                          const char *data) {
+  unsigned int fields[3] = {record->op, record->key_len, record->value_len};
+  const unsigned char *bytes = (const unsigned char *)fields;
+  unsigned int hash = 2166136261U;
+
+  for (size_t i = 0; i < sizeof(fields); ++i) {
+    hash = (hash ^ bytes[i]) * 16777619U;
+  }
+  for (size_t i = 0; i < record->key_len + (size_t)record->value_len; ++i) {
+    hash = (hash ^ (unsigned char)data[i]) * 16777619U;
+  }
+  return hash;
+}
+
+static inline char *hamt_path(const char *dir, const char *file) {
+  size_t len = strlen(dir) + strlen(file) + 2;
+  char *path;
+
+  if ((path = (char *)malloc(len)) == NULL) {
+    fprintf(stderr, "Failed to allocate memory for path\n");
+    return NULL;
+  }
+  snprintf(path, len, "%s/%s", dir, file);
+  return path;
+}
+
+/**
+ * Write out and sync the buffered records. If a write fails, what was
+ * written is dropped from the buffer and the rest kept, so the next
+ * flush carries on where this one stopped. A run of failures is only
+ * reported once.
+ */
+static inline int hamt_log_flush(hamt_log_file *log) {
+  size_t done = 0;
+
+  while (done < log->len) {
+    ssize_t n = write(log->fd, log->buf + done, log->len - done);
+
+    if (n == -1 && errno != EINTR) {
+      if (!log->failing) {
+        fprintf(stderr, "Failed to write log: %s\n", strerror(errno));
+      }
+      if (done > 0) {
+        memmove(log->buf, log->buf + done, log->len - done);
+        log->len -= done;
+      }
+      log->failing = true;
+      return -1;
+    }
+    done += n > 0 ? (size_t)n : 0;
+  }
+  log->len = 0;
+  if (fdatasync(log->fd) == -1) {
+    if (!log->failing) {
+      fprintf(stderr, "Failed to sync log: %s\n", strerror(errno));
+    }
+    log->failing = true;
+    return -1;
+  }
+  log->failing = false;
+  return 0;
+}
+
+/**
+ * Buffer one record, and flush once a batch has built up unless flushes
+ * are failing, in which case only `name_hamt_sync` or a checkpoint tries
+ * again. Returns -1 if the record is lost for lack of memory.
+ */
+static inline int hamt_log_append(hamt_log_file *log, unsigned int op,
+                                  const char *key, unsigned int key_len,
+                                  const char *value, unsigned int value_len) {
+  hamt_log_record record = {
+      .op = op, .key_len = key_len, .value_len = value_len};
+  size_t size = sizeof(record) + key_len + value_len;
+
+  if (log->len + size > log->cap) {
+    size_t cap = log->cap ? log->cap : HAMT_LOG_BATCH;
+    char *buf;
+
+    while (cap < log->len + size) {
+      cap *= 2;
+    }
+    if ((buf = (char *)realloc(log->buf, cap)) == NULL) {
+      fprintf(stderr, "Failed to allocate memory for log\n");
+      return -1;
+    }
+    log->buf = buf;
+    log->cap = cap;
+  }
+
+  char *data = log->buf + log->len + sizeof(record);
+  memcpy(data, key, key_len);
+  if (value_len != 0) {
+    memcpy(data + key_len, value, value_len);
+  }
+  record.check = hamt_log_check(&record, data);
+  memcpy(log->buf + log->len, &record, sizeof(record));
+  log->len += size;
+
+  if (log->len >= HAMT_LOG_BATCH && !log->failing) {
+    hamt_log_flush(log);
+  }
+  return 0;
+}
+
+/**
+ * Call `fn` for every intact record in the `size` bytes of `data`, and
+ * return how many bytes they take up.
+ */
+static inline size_t
+hamt_log_replay(const char *data, size_t size,
+                void (*fn)(void *ctx, unsigned int op, const char *key,
+                           unsigned int key_len, const char *value,
+                           unsigned int value_len),
+                void *ctx) {
+  size_t at = 0;
+  hamt_log_record record;
+
+  while (size - at >= sizeof(record)) {
+    memcpy(&record, data + at, sizeof(record));
+    const char *key = data + at + sizeof(record);
+
+    if (size - at - sizeof(record) <
+            record.key_len + (size_t)record.value_len ||
+        hamt_log_check(&record, key) != record.check) {
+      break;
+    }
+    fn(ctx, record.op, key, record.key_len, key + record.key_len,
+       record.value_len);
+    at += sizeof(record) + record.key_len + record.value_len;
+  }
+  return at;
+}
+
+/* Read all of `path`, a missing file reads as empty */
+static inline char *hamt_read_file(const char *path, size_t *size) {
+  struct stat sb;
+  char *data;
+  int fd;
+
+  *size = 0;
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    if (errno == ENOENT) {
+      return (char *)calloc(1, 1);
+    }
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (fstat(fd, &sb) == -1 ||
+      (data = (char *)malloc(sb.st_size + 1)) == NULL) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  while (*size < (size_t)sb.st_size) {
+    ssize_t n = read(fd, data + *size, sb.st_size - *size);
+
+    if (n <= 0 && !(n == -1 && errno == EINTR)) {
+      break;
+    }
+    *size += n > 0 ? (size_t)n : 0;
+  }
+  close(fd);
+  return data;
+}
+
+/**
+ * Replace `dir/file` with `size` bytes of `data`, such that a crash
+ * leaves either the old or the new contents: they go to a temporary
+ * file which is synced and renamed over it, then the directory is
+ * synced too.
+ */
+static inline int hamt_write_file(const char *dir, const char *file,
+                                  const void *data, size_t size) {
+  char *path = hamt_path(dir, file);
+  char *tmp = hamt_path(dir, "tmp");
+  int fd = -1, result = -1;
+  size_t done = 0;
+
+  if (path == NULL || tmp == NULL ||
+      (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+    goto done;
+  }
+  while (done < size) {
+    ssize_t n = write(fd, (const char *)data + done, size - done);
+
+    if (n == -1 && errno != EINTR) {
+      goto done;
+    }
+    done += n > 0 ? (size_t)n : 0;
+  }
+  if (fsync(fd) == -1 || rename(tmp, path) == -1) {
+    goto done;
+  }
+  close(fd);
+  if ((fd = open(dir, O_RDONLY)) != -1 && fsync(fd) == 0) {
+    result = 0;
+  }
+
+done:
+  if (result == -1) {
+    fprintf(stderr, "Failed to write %s: %s\n", path ? path : file,
+            strerror(errno));
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  free(path);
+  free(tmp);
+  return result;
+}
+
+/* ====== Tracing ====== */
+/**
+ * A record of `get`, `set` and `remove` calls, to replay real traffic
+ * with `hamt-replay`. A trace starts with `HAMT_TRACE_MAGIC`, followed
+ * by a `hamt_trace_record` per call with the key bytes right behind it.
+ * Records go out through stdio, so tracing costs a buffered write per
+ * call, and calls from several threads don't interleave their records.
+ */
+#define HAMT_TRACE_MAGIC   0x68747263U
+#define HAMT_TRACE_GET     3
+#define HAMT_TRACE_KEY_MAX 0xFFFFFFU
+
+typedef struct hamt_trace_record {
+  /* nanoseconds since the trace started */
+  unsigned long long time;
+  unsigned int hash;
+  /* the op in the top 8 bits, the key length, up to 16MB, below */
+  unsigned int op_len;
+} hamt_trace_record;
+
+static inline unsigned long long hamt_trace_now(const struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)(now.tv_sec - start->tv_sec) * 1000000000ULL +
+         now.tv_nsec - start->tv_nsec;
+}
+
+static inline void hamt_trace_write(FILE *file, unsigned long long time,
+                                    unsigned int op, unsigned int hash,
+                                    const char *key, size_t key_len) {
+  hamt_trace_record record;
+
+  key_len = key_len < HAMT_TRACE_KEY_MAX ? key_len : HAMT_TRACE_KEY_MAX;
+  record.time = time;
+  record.hash = hash;
+  record.op_len = op << 24 | (unsigned int)key_len;
+  flockfile(file);
+  fwrite(&record, sizeof(record), 1, file);
+  fwrite(key, 1, key_len, file);
+  funlockfile(file);
+}
+
+/**
+ * Read the record at `*offset` of a trace, starting from 0, and step
+ * past it. `*key` points at its key bytes inside `data`. Returns false
+ * at the end, or at a record cut short.
+ */
+static inline bool hamt_trace_next(const char *data, size_t size,
+                                   size_t *offset, hamt_trace_record *record,
+                                   const char **key) {
+  unsigned int magic, key_len;
+
+  if (*offset == 0) {
+    if (size < sizeof(magic)) {
+      return false;
+    }
+    memcpy(&magic, data, sizeof(magic));
+    if (magic != HAMT_TRACE_MAGIC) {
+      return false;
+    }
+    *offset = sizeof(magic);
+  }
+  if (size - *offset < sizeof(*record)) {
+    return false;
+  }
+  memcpy(record, data + *offset, sizeof(*record));
+  key_len = record->op_len & HAMT_TRACE_KEY_MAX;
+  if (size - *offset - sizeof(*record) < key_len) {
+    return false;
+  }
+  *key = data + *offset + sizeof(*record);
+  *offset += sizeof(*record) + key_len;
+  return true;
+}
+
+/* ====== String keys ====== */
+/**
+ * A byte string key for `HAMT_DEFINE_STRKEY`, carrying its own length
+ * and 64-bit hash so a comparison settles most mismatches without
+ * touching the bytes. Keys of up to `HAMT_STRKEY_INLINE` bytes are kept
+ * inside the key, longer ones right behind it in the same allocation,
+ * so a stored key is one block and `bytes` never leaves it.
+ */
+#define HAMT_STRKEY_INLINE 16
+
+typedef struct hamt_strkey {
+  unsigned long long hash;
+  size_t len;
+  const char *bytes;
+  char inline_bytes[HAMT_STRKEY_INLINE];
+} hamt_strkey;
+
+/* MurmurHash64A over `len` bytes */
+static inline unsigned long long hamt_hash_bytes(const char *bytes,
+                                                 size_t len) {
+  const unsigned long long m = 0xC6A4A7935BD1E995ULL;
+  unsigned long long hash = 0x8445D61A4E774912ULL ^ (len * m);
+  unsigned long long word;
+  size_t i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&word, bytes + i, 8);
+    word *= m;
+    word ^= word >> 47;
+    hash = (hash ^ word * m) * m;
+  }
+  if (i < len) {
+    word = 0;
+    memcpy(&word, bytes + i, len - i);
+    hash = (hash ^ word) * m;
+  }
+  hash ^= hash >> 47;
+  hash *= m;
+  return hash ^ (hash >> 47);
+}
+
+/* A key over `len` bytes at `bytes`, which are borrowed, not copied */
+static inline hamt_strkey hamt_strkey_of(const char *bytes, size_t len) {
+  hamt_strkey key = {.hash = hamt_hash_bytes(bytes, len),
+                     .len = len,
+                     .bytes = bytes};
+  return key;
+}
+
+/* A copy of `key` owning its bytes, freed with a single `free` */
+static inline hamt_strkey *hamt_strkey_copy(const hamt_strkey *key) {
+  size_t extra = key->len > HAMT_STRKEY_INLINE ? key->len : 0;
+  hamt_strkey *copy;
+
+  if ((copy = (hamt_strkey *)malloc(sizeof(hamt_strkey) + extra)) == NULL) {
+    fprintf(stderr, "Failed to allocate memory for key\n");
+    return NULL;
+  }
+  copy->hash = key->hash;
+  copy->len = key->len;
+  copy->bytes = extra > 0 ? (const char *)(copy + 1) : copy->inline_bytes;
+  if (key->len > 0) {
+    memcpy((char *)copy->bytes, key->bytes, key->len);
+  }
+  return copy;
+}
+
+static inline unsigned int hamt_strkey_hash(hamt_strkey *key) {
+  return (unsigned int)key->hash;
+}
+
+static inline bool hamt_strkey_equals(hamt_strkey *k0, hamt_strkey *k1) {
+  return k0->hash == k1->hash && k0->len == k1->len &&
+         (k0->len == 0 || memcmp(k0->bytes, k1->bytes, k0->len) == 0);
+}
+
+// clang-format off
+/** HAMT_DEFINE: Macro achieve polymorphism.
+Your type must have a single-symbol name.
+```
+typedef struct MyKeyType {
+  char *str;
+} MyKeyType;
+```
+It must be able to check equality, for example when
+inserting with a hash collission
+```
+bool mykeytype_equals(MyKeyType *s0, MyKeyType *s1) {
+  bool return_value = strcmp(s0->str, s1->str) == 0;
+  return return_value;
+}
+unsigned int get_hash_of_mykeytype(MyKeyType *s) { return get_hash(s->str); }
+```
+`HAMT_DEFINE` will define types & functions prefixed
+with `name_hamt_`, where `name` in this example is `MyKeyType`.
+```
+HAMT_DEFINE(MyKeyType, get_hash_of_mykeytype, mykeytype_equals)
+```
+`HAMT_DEFINE_EX` also takes the shape of the trie. Each level uses
+`bits_per_level` of the hash (4, 5 or 6, so 16, 32 or 64 way nodes), a Branch
+turns into an ArrayNode once it would hold more than `max_branch_size`
+children, and an ArrayNode shrinks back into a Branch at
+`min_array_node_size`. `HAMT_DEFINE` is the 5 bit default.
+```
+HAMT_DEFINE_EX(Session, get_hash_of_session, session_equals, 6, 32, 16)
+```
+`HAMT_DEFINE_STRKEY` defines `name` as a byte string key, see `hamt_strkey`,
+along with `name_hamt_put`, `name_hamt_get_bytes` and `name_hamt_delete`,
+which take the bytes and their length. The hamt keeps its own copy of every
+key, compared by hash and length before any bytes.
+```
+HAMT_DEFINE_STRKEY(Word)
+Word_hamt_put(hamt, "hello", 5, value);
+```
+ */
+// clang-format on
+#define HAMT_DEFINE(name, hashof, equals)                                            \
+  HAMT_DEFINE_EX(name, hashof, equals, BITS, MAX_BRANCH_SIZE,                        \
+                 MIN_ARRAY_NODE_SIZE)
+
+#define HAMT_DEFINE_STRKEY(name)                                                     \
+  typedef hamt_strkey name;                                                          \
+  HAMT_DEFINE(name, hamt_strkey_hash, hamt_strkey_equals)                            \
+                                                                                     \
+  /* Look up `len` bytes at `bytes` */                                               \
+  void *name##_hamt_get_bytes(name##_hamt *hamt, const char *bytes, size_t len) {    \
+    name key = hamt_strkey_of(bytes, len);                                           \
+                                                                                     \
+    return name##_hamt_get(hamt, &key);                                              \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Map a copy of the `len` bytes at `bytes` to `value`. A key which is             \
+   * already present keeps its copy and only takes the new value.                    \
+   */ \
+  name##_hamt *name##_hamt_put(name##_hamt *hamt, const char *bytes, size_t len,     \
+                               void *value) {                                        \
+    name probe = hamt_strkey_of(bytes, len);                                         \
+    name##_hamt_node *leaf =                                                         \
+        name##_hamt_find(hamt->root, hamt_strkey_hash(&probe), &probe);              \
+    name *key = leaf != NULL ? leaf->key : hamt_strkey_copy(&probe);                 \
+                                                                                     \
+    return key != NULL ? name##_hamt_set(hamt, key, value) : hamt;                   \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Remove the key and free its copy. Frozen copies share the stored                \
+   * keys, so drop them before deleting.                                             \
+   */ \
+  name##_hamt *name##_hamt_delete(name##_hamt *hamt, const char *bytes,              \
+                                  size_t len) {                                      \
+    name probe = hamt_strkey_of(bytes, len);                                         \
+    name##_hamt_node *leaf =                                                         \
+        name##_hamt_find(hamt->root, hamt_strkey_hash(&probe), &probe);              \
+    name *key;                                                                       \
+                                                                                     \
+    if (leaf == NULL) {                                                              \
+      return hamt;                                                                   \
+    }                                                                                \
+    key = leaf->key;                                                                 \
+    name##_hamt_remove(hamt, key);                                                   \
+    free(key);                                                                       \
+    return hamt;                                                                     \
+  }
+
+#define HAMT_DEFINE_EX(name, hashof, equals, bits_per_level, max_branch_size,        \
+                       min_array_node_size)                                          \
+  /* The shape of this trie, folded into every node operation */                     \
+  enum {                                                                             \
+    name##_hamt_BITS = bits_per_level,                                               \
+    name##_hamt_SIZE = 1 << (bits_per_level),                                        \
+    name##_hamt_MASK = (1 << (bits_per_level)) - 1,                                  \
+    name##_hamt_MAX_BRANCH_SIZE = max_branch_size,                                   \
+    name##_hamt_MIN_ARRAY_NODE_SIZE = min_array_node_size,                           \
+    /* Branches and ArrayNodes on the longest path */                                \
+    name##_hamt_MAX_DEPTH = (32 + (bits_per_level) - 1) / (bits_per_level)           \
+  };                                                                                 \
+  typedef HAMT_BITMAP(bits_per_level) name##_hamt_bitmap;                            \
+  _Static_assert(min_array_node_size < max_branch_size &&                            \
+                     max_branch_size < 1 << (bits_per_level),                        \
+                 "ArrayNodes must shrink below where Branches grow");                \
+                                                                                     \
+  /* moves on whenever two tries come to share nodes, see name##_hamt_owns */        \
+  static atomic_ullong name##_hamt_epochs = 1;                                       \
+                                                                                     \
+  typedef struct name##_hamt_node {                                                  \
+    enum NODE_TYPE type;                                                             \
+    /* the hash of a leaf, or the child bitmap of a Branch */                        \
+    name##_hamt_bitmap hash;                                                         \
+    /**                                                                              \
+     * This is only used by the collision node and array_node and is a               \
+     * count of the total number of children held in the node                        \
+     */                                                                              \
+    int bitmap;                                                                      \
+    /**                                                                              \
+     * entries below a Branch or ArrayNode, see name##_hamt_subtree_size,            \
+     * or the slots a Collision has room for                                         \
+     */                                                                              \
+    unsigned int size;                                                               \
+    /* the epoch the node was made in */                                             \
+    unsigned long long epoch;                                                        \
+    name *key;                                                                       \
+    union {                                                                          \
+      void *value;                                                                   \
+      /* any other node's content hash, see name##_hamt_content_hash */              \
+      unsigned long long content;                                                    \
+    };                                                                               \
+    struct name##_hamt_node **children;                                              \
+  } name##_hamt_node;                                                                \
+                                                                                     \
+  typedef struct name##_hamt {                                                       \
+    name##_hamt_node *root;                                                          \
+    /* optional, rejects most lookups of missing keys up front */                    \
+    hamt_filter *filter;                                                             \
+    /* optional, answers lookups of popular keys in one cache line */                \
+    hamt_cache *cache;                                                               \
+    /* bumped on every change, so cache entries from before go stale */              \
+    atomic_ulong version;                                                            \
+    /* optional, see name##_hamt_recover */                                          \
+    struct name##_hamt_log *log;                                                     \
+    /* nodes laid out by the last compaction, and the one under way */               \
+    char *arena;                                                                     \
+    size_t arena_size;                                                               \
+    enum hamt_storage arena_storage;                                                 \
+    struct name##_hamt_compaction *compaction;                                       \
+    /* see name##_hamt_enable_huge_pages */                                          \
+    bool huge_pages;                                                                 \
+    /* optional, see name##_hamt_trace_start */                                      \
+    struct name##_hamt_trace *trace;                                                 \
+    /* nodes made in this epoch or later are held by this hamt alone */              \
+    unsigned long long epoch;                                                        \
+  } name##_hamt;                                                                     \
+                                                                                     \
+  bool name##_hamt_enable_filter(name##_hamt *hamt, size_t capacity);                \
+  static void name##_hamt_log_append(name##_hamt *hamt, name *key, void *value,      \
+                                     unsigned int op);                               \
+  static void name##_hamt_trace_op(name##_hamt *hamt, name *key,                     \
+                                   unsigned int hash, unsigned int op);              \
+                                                                                     \
+  /*======= hashing =========================*/                                      \
+  /**                                                                                \
+   * From Ideal hash trees Phil Bagwell, page 3                                      \
+   * https://lampwww.epfl.ch/papers/idealhashtrees.pdf                               \
+   * Count number of bits in a number                                                \
+   */ \
+  static const unsigned int name##_hamt_SK5 = 0x55555555;                            \
+  static const unsigned int name##_hamt_SK3 = 0x33333333;                            \
+  static const unsigned int name##_hamt_SKF0 = 0xF0F0F0F;                            \
+                                                                                     \
+  static inline int name##_hamt_popcount32(unsigned int bits) {                      \
+    bits -= ((bits >> 1) & name##_hamt_SK5);                                         \
+    bits = (bits & name##_hamt_SK3) + ((bits >> 2) & name##_hamt_SK3);               \
+    bits = (bits & name##_hamt_SKF0) + ((bits >> 4) & name##_hamt_SKF0);             \
+    bits += bits >> 8;                                                               \
+    return (bits + (bits >> 16)) & 0x3F;                                             \
+  }                                                                                  \
+                                                                                     \
+  static inline int name##_hamt_popcount(name##_hamt_bitmap bits) {                  \
+    if (sizeof(bits) > sizeof(unsigned int)) {                                       \
+      return name##_hamt_popcount32((unsigned int)bits) +                            \
+             name##_hamt_popcount32(                                                 \
+                 (unsigned int)((unsigned long long)bits >> 32));                    \
+    }                                                                                \
+    return name##_hamt_popcount32(bits);                                             \
+  }                                                                                  \
+                                                                                     \
+  static inline name##_hamt_bitmap name##_hamt_get_mask(unsigned int frag) {         \
+    return (name##_hamt_bitmap)1 << frag;                                            \
+  }                                                                                  \
+                                                                                     \
+  /* take the `BITS` bits of the hash that index a node at `depth` */                \
+  static inline unsigned int name##_hamt_get_frag(unsigned int hash,                 \
+                                                  int depth) {                       \
+    return ((unsigned int)hash >> (name##_hamt_BITS * depth)) & name##_hamt_MASK;    \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Get the position in the array where the child is located                        \
+   *                                                                                 \
+   */ \
+  static unsigned int name##_hamt_get_position(name##_hamt_bitmap hash,              \
+                                               unsigned int frag) {                  \
+    return name##_hamt_popcount(hash & (name##_hamt_get_mask(frag) - 1));            \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Hash `n` keys into `out`, as `hashof` would one at a time. When                 \
+   * `hashof` is `get_hash`, `hamt_hash_u32` or `hamt_hash_u64` itself,              \
+   * the keys go through the batch kernels.                                          \
+   */ \
+  void name##_hamt_hash_batch(name **keys, size_t n, unsigned int *out) {            \
+    typedef void (*hamt_fn)(void);                                                   \
+                                                                                     \
+    if ((hamt_fn)hashof == (hamt_fn)get_hash) {                                      \
+      hamt_hash_strings((char **)keys, n, out);                                      \
+    } else if ((hamt_fn)hashof == (hamt_fn)hamt_hash_u64 ||                          \
+               (hamt_fn)hashof == (hamt_fn)hamt_hash_u32) {                          \
+      hamt_hash_ints((void **)keys, n, out,                                          \
+                     (hamt_fn)hashof == (hamt_fn)hamt_hash_u64);                     \
+    } else {                                                                         \
+      for (size_t i = 0; i < n; ++i) {                                               \
+        out[i] = hashof(keys[i]);                                                    \
+      }                                                                              \
+    }                                                                                \
+  }                                                                                  \
+  name##_hamt *name##_hamt_new() {                                                   \
+    name##_hamt *hamt;                                                               \
+                                                                                     \
+    if ((hamt = (name##_hamt *)malloc(sizeof(name##_hamt))) == NULL) {               \
+      fprintf(stderr, "Failed to allocate memory for hamt\n");                       \
+    }                                                                                \
+                                                                                     \
+    hamt->root = NULL;                                                               \
+    hamt->filter = NULL;                                                             \
+    hamt->cache = NULL;                                                              \
+    hamt->log = NULL;                                                                \
+    hamt->arena = NULL;                                                              \
+    hamt->arena_size = 0;                                                            \
+    hamt->arena_storage = HAMT_STORAGE_MALLOC;                                       \
+    hamt->compaction = NULL;                                                         \
+    hamt->huge_pages = false;                                                        \
+    hamt->trace = NULL;                                                              \
+    hamt->epoch = atomic_load(&name##_hamt_epochs);                                  \
+    atomic_init(&hamt->version, 0);                                                  \
+    return hamt;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /*======= node constructors =====================*/                                \
+  static name##_hamt_node *name##_hamt_create_node(                                  \
+      name##_hamt_bitmap hash, name *key, void *value, enum NODE_TYPE type,          \
+      name##_hamt_node **children, unsigned long bitmap) {                           \
+    name##_hamt_node *node;                                                          \
+                                                                                     \
+    if ((node = (name##_hamt_node *)malloc(sizeof(name##_hamt_node))) ==             \
+        NULL) {                                                                      \
+      fprintf(stderr, "failed to allocate memory for node\n");                       \
+      return NULL;                                                                   \
+    }                                                                                \
+                                                                                     \
+    node->hash = hash;                                                               \
+    node->type = type;                                                               \
+    node->epoch = atomic_load_explicit(&name##_hamt_epochs, memory_order_relaxed);   \
+    node->key = key;                                                                 \
+    node->content = 0;                                                               \
+    node->value = value;                                                             \
+    node->children = children;                                                       \
+    node->bitmap = bitmap;                                                           \
+    node->size = 0;                                                                  \
+                                                                                     \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  static name##_hamt_node *name##_hamt_create_leaf(unsigned int hash,                \
+                                                   name *key, void *value) {         \
+    return name##_hamt_create_node(hash, key, value, LEAF, NULL, 0);                 \
+  }                                                                                  \
+                                                                                     \
+                                                                                     \
+  static name##_hamt_node *name##_hamt_create_branch(                                \
+      name##_hamt_bitmap hash, name##_hamt_node **children) {                        \
+    return name##_hamt_create_node(hash, NULL, NULL, BRANCH, children, 0);           \
+  }                                                                                  \
+                                                                                     \
+  /* again, bitmap is size  */                                                       \
+  static name##_hamt_node *name##_hamt_create_arraynode(                             \
+      name##_hamt_node **children, unsigned int bitmap) {                            \
+    return name##_hamt_create_node(0, NULL, NULL, ARRAY_NODE, children,              \
+                                   bitmap);                                          \
+  }                                                                                  \
+                                                                                     \
+  static bool name##_hamt_is_leaf(name##_hamt_node *node) {                          \
+    return node != NULL && (node->type == LEAF || node->type == COLLISION);          \
+  }                                                                                  \
+                                                                                     \
+  /* Number of entries under `node` */                                               \
+  static inline unsigned int name##_hamt_subtree_size(name##_hamt_node *node) {      \
+    if (node == NULL) {                                                              \
+      return 0;                                                                      \
+    }                                                                                \
+    switch (node->type) {                                                            \
+    case LEAF:                                                                       \
+      return 1;                                                                      \
+    case COLLISION:                                                                  \
+      return node->bitmap;                                                           \
+    default:                                                                         \
+      return node->size;                                                             \
+    }                                                                                \
+  }                                                                                  \
+                                                                                     \
+  /* Content hash of the entries under `node` */                                     \
+  static inline unsigned long long name##_hamt_content(name##_hamt_node *node) {     \
+    if (node == NULL) {                                                              \
+      return 0;                                                                      \
+    }                                                                                \
+    return node->type == LEAF                                                        \
+               ? hamt_content_entry((unsigned int)node->hash, node->value)           \
+               : node->content;                                                      \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Allocate a node together with room for `slots` children right behind            \
+   * it, so copying a node on the way up is a single allocation.                     \
+   */ \
+  static name##_hamt_node *name##_hamt_alloc_node(enum NODE_TYPE type,               \
+                                                  name##_hamt_bitmap hash,           \
+                                                  int bitmap,                        \
+                                                  unsigned int slots) {              \
+    name##_hamt_node *node;                                                          \
+                                                                                     \
+    if ((node = (name##_hamt_node *)malloc(                                          \
+             sizeof(name##_hamt_node) + sizeof(name##_hamt_node *) * slots)) ==      \
+        NULL) {                                                                      \
+      fprintf(stderr, "failed to allocate memory for node\n");                       \
+      return NULL;                                                                   \
+    }                                                                                \
+                                                                                     \
+    node->type = type;                                                               \
+    node->hash = hash;                                                               \
+    node->bitmap = bitmap;                                                           \
+    node->size = 0;                                                                  \
+    node->epoch = atomic_load_explicit(&name##_hamt_epochs, memory_order_relaxed);   \
+    node->key = NULL;                                                                \
+    node->content = 0;                                                               \
+    node->children = (name##_hamt_node **)(node + 1);                                \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /*======= Allocators ==============*/                                              \
+  /* Assign `n` number of children, at least `CAPACITY` in size */                   \
+  static name##_hamt_node **name##_hamt_alloc_children(int size) {                   \
+    name##_hamt_node **children;                                                     \
+                                                                                     \
+    if ((children = (name##_hamt_node **)calloc(sizeof(name##_hamt_node *),          \
+                                                size)) == NULL) {                    \
+      fprintf(stderr, "Failed to allocate memory for children");                     \
+      return NULL;                                                                   \
+    }                                                                                \
+                                                                                     \
+    return children;                                                                 \
+  }                                                                                  \
+                                                                                     \
+  /*======= moving / inserting child nodes ==============*/                          \
+  /* Number of child slots, counting the empty ones of an ArrayNode */               \
+  static inline unsigned int name##_hamt_slots(name##_hamt_node *node) {             \
+    switch (node->type) {                                                            \
+    case BRANCH:                                                                     \
+      return name##_hamt_popcount(node->hash);                                       \
+    case ARRAY_NODE:                                                                 \
+      return name##_hamt_SIZE;                                                       \
+    default:                                                                         \
+      return node->bitmap;                                                           \
+    }                                                                                \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Copy of `node` with `child` inserted at `position`, with the children           \
+   * sized exactly. The caller updates the hash or count of the copy.                \
+   */ \
+  static inline name##_hamt_node *name##_hamt_insert_child(                          \
+      name##_hamt_node *node, unsigned int position, name##_hamt_node *child) {      \
+    unsigned int size = name##_hamt_slots(node);                                     \
+    name##_hamt_node *copy =                                                         \
+        name##_hamt_alloc_node(node->type, node->hash, node->bitmap, size + 1);      \
+                                                                                     \
+    copy->size = node->size;                                                         \
+    copy->content = node->content;                                                   \
+    memcpy(copy->children, node->children,                                           \
+           sizeof(name##_hamt_node *) * position);                                   \
+    copy->children[position] = child;                                                \
+    memcpy(copy->children + position + 1, node->children + position,                 \
+           sizeof(name##_hamt_node *) * (size - position));                          \
+    return copy;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Remove child in place, shifting the ones after it down                          \
+   */ \
+  static inline void name##_hamt_remove_child(name##_hamt_node *node,                \
+                                              unsigned int position) {               \
+    unsigned int size = name##_hamt_slots(node);                                     \
+                                                                                     \
+    memmove(node->children + position, node->children + position + 1,                \
+            sizeof(name##_hamt_node *) * (size - position - 1));                     \
+  }                                                                                  \
+                                                                                     \
+  /*======= collision nodes ==============*/                                         \
+  /**                                                                                \
+   * Whether `hashof` is one of the hashes `name##_hamt_fingerprint` has a           \
+   * second hash for. Collisions of other keys are scanned with `equals`.            \
+   */ \
+  static inline bool name##_hamt_fingerprinted(void) {                               \
+    typedef void (*hamt_fn)(void);                                                   \
+                                                                                     \
+    return (hamt_fn)hashof == (hamt_fn)get_hash ||                                   \
+           (hamt_fn)hashof == (hamt_fn)hamt_strkey_hash ||                           \
+           (hamt_fn)hashof == (hamt_fn)hamt_hash_u64;                                \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * A byte of a second hash of `key`. Strings are hashed again with                 \
+   * `hamt_hash_bytes`, string keys already carry 64 bits of hash, and               \
+   * 64-bit integers sharing a hash differ in their top half.                        \
+   */ \
+  static inline unsigned char name##_hamt_fingerprint(name *key) {                   \
+    typedef void (*hamt_fn)(void);                                                   \
+    void *bytes = (void *)key;                                                       \
+                                                                                     \
+    if ((hamt_fn)hashof == (hamt_fn)hamt_strkey_hash) {                              \
+      return (unsigned char)(((hamt_strkey *)bytes)->hash >> 56);                    \
+    }                                                                                \
+    if ((hamt_fn)hashof == (hamt_fn)hamt_hash_u64) {                                 \
+      return (unsigned char)(hamt_mix32((unsigned int)(                              \
+                                 *(unsigned long long *)bytes >> 32)) >>             \
+                             24);                                                    \
+    }                                                                                \
+    return (unsigned char)(hamt_hash_bytes((const char *)bytes,                      \
+                                           strlen((const char *)bytes)) >>           \
+                           56);                                                      \
+  }                                                                                  \
+                                                                                     \
+  /* Bytes for the children, and fingerprints, of a collision */                     \
+  static inline size_t name##_hamt_collision_bytes(unsigned int slots) {             \
+    size_t bytes = sizeof(name##_hamt_node *) * slots;                               \
+                                                                                     \
+    if (slots > HAMT_FINGERPRINT_SCAN && name##_hamt_fingerprinted()) {              \
+      bytes += hamt_fingerprint_bytes(slots);                                        \
+    }                                                                                \
+    return bytes;                                                                    \
+  }                                                                                  \
+                                                                                     \
+  /* The fingerprints behind the children of a collision, if it has any */           \
+  static inline unsigned char *name##_hamt_fingerprints(name##_hamt_node *node) {    \
+    if (node->size <= HAMT_FINGERPRINT_SCAN || !name##_hamt_fingerprinted()) {       \
+      return NULL;                                                                   \
+    }                                                                                \
+    return (unsigned char *)(node->children + node->size);                           \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * A collision on `hash` holding `count` children, with room for                   \
+   * `slots`. Collisions keep that capacity in `size`, as their count of             \
+   * entries is `bitmap`.                                                            \
+   */ \
+  static name##_hamt_node *name##_hamt_alloc_collision(unsigned int hash,            \
+                                                       int count,                    \
+                                                       unsigned int slots) {         \
+    name##_hamt_node *node;                                                          \
+                                                                                     \
+    if ((node = (name##_hamt_node *)malloc(                                          \
+             sizeof(name##_hamt_node) +                                              \
+             name##_hamt_collision_bytes(slots))) == NULL) {                         \
+      fprintf(stderr, "failed to allocate memory for node\n");                       \
+      return NULL;                                                                   \
+    }                                                                                \
+                                                                                     \
+    node->type = COLLISION;                                                          \
+    node->hash = hash;                                                               \
+    node->bitmap = count;                                                            \
+    node->size = slots;                                                              \
+    node->epoch = atomic_load_explicit(&name##_hamt_epochs, memory_order_relaxed);   \
+    node->key = NULL;                                                                \
+    node->content = 0;                                                               \
+    node->children = (name##_hamt_node **)(node + 1);                                \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /* Fingerprint the children of `node` from `from` on */                            \
+  static inline void name##_hamt_fingerprint_from(name##_hamt_node *node,            \
+                                                  int from) {                        \
+    unsigned char *fps = name##_hamt_fingerprints(node);                             \
+                                                                                     \
+    for (int i = from; fps != NULL && i < node->bitmap; ++i) {                       \
+      fps[i] = name##_hamt_fingerprint(node->children[i]->key);                      \
+    }                                                                                \
+  }                                                                                  \
+                                                                                     \
+  /* Position of `key` in a collision, or the count if it isn't there */             \
+  static inline int name##_hamt_collision_find(name##_hamt_node *node,               \
+                                               name *key) {                          \
+    unsigned char *fps = name##_hamt_fingerprints(node);                             \
+    int len = node->bitmap;                                                          \
+                                                                                     \
+    if (fps == NULL) {                                                               \
+      int i = 0;                                                                     \
+                                                                                     \
+      while (i < len && !equals(node->children[i]->key, key)) {                      \
+        i++;                                                                         \
+      }                                                                              \
+      return i;                                                                      \
+    }                                                                                \
+                                                                                     \
+    unsigned char fp = name##_hamt_fingerprint(key);                                 \
+    for (int at = 0; at < len; at += HAMT_FINGERPRINT_BLOCK) {                       \
+      unsigned int hits = hamt_fingerprint_match(fps + at, fp);                      \
+                                                                                     \
+      if (len - at < HAMT_FINGERPRINT_BLOCK) {                                       \
+        hits &= (1U << (len - at)) - 1;                                              \
+      }                                                                              \
+      for (; hits != 0; hits &= hits - 1) {                                          \
+        int i = at + name##_hamt_popcount32((hits & (0U - hits)) - 1);               \
+                                                                                     \
+        if (equals(node->children[i]->key, key)) {                                   \
+          return i;                                                                  \
+        }                                                                            \
+      }                                                                              \
+    }                                                                                \
+    return len;                                                                      \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Append `leaf` to a collision, in place while it has room. A full one            \
+   * moves to a copy twice its size, so keys flooding one hash cost                  \
+   * amortised constant time each to add instead of a copy of them all.              \
+   */ \
+  static inline name##_hamt_node *name##_hamt_collision_add(                         \
+      name##_hamt_node *node, name##_hamt_node *leaf) {                              \
+    unsigned char *fps;                                                              \
+                                                                                     \
+    if ((unsigned int)node->bitmap == node->size) {                                  \
+      name##_hamt_node *grown = name##_hamt_alloc_collision(                         \
+          node->hash, node->bitmap, node->size * 2);                                 \
+                                                                                     \
+      memcpy(grown->children, node->children,                                        \
+             sizeof(name##_hamt_node *) * node->bitmap);                             \
+      grown->content = node->content;                                                \
+      if ((fps = name##_hamt_fingerprints(node)) != NULL) {                          \
+        memcpy(name##_hamt_fingerprints(grown), fps, node->bitmap);                  \
+      } else {                                                                       \
+        name##_hamt_fingerprint_from(grown, 0);                                      \
+      }                                                                              \
+      node = grown;                                                                  \
+    }                                                                                \
+    node->children[node->bitmap] = leaf;                                             \
+    node->content += name##_hamt_content(leaf);                                      \
+    if ((fps = name##_hamt_fingerprints(node)) != NULL) {                            \
+      fps[node->bitmap] = name##_hamt_fingerprint(leaf->key);                        \
+    }                                                                                \
+    node->bitmap++;                                                                  \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /* Take the child at `position` out of a collision, in place */                    \
+  static inline void name##_hamt_collision_remove(name##_hamt_node *node,            \
+                                                  int position) {                    \
+    unsigned char *fps = name##_hamt_fingerprints(node);                             \
+                                                                                     \
+    node->content -= name##_hamt_content(node->children[position]);                  \
+    name##_hamt_remove_child(node, position);                                        \
+    if (fps != NULL) {                                                               \
+      memmove(fps + position, fps + position + 1, node->bitmap - position - 1);      \
+    }                                                                                \
+    node->bitmap--;                                                                  \
+  }                                                                                  \
+                                                                                     \
+  /*======= copying on write ==============*/                                        \
+  /**                                                                                \
+   * Whether `node` is held by `hamt` alone. Nodes made before the hamt              \
+   * last came to share nodes with another, see name##_hamt_share, may               \
+   * be reachable from both, so they are never changed or freed.                     \
+   */ \
+  static inline bool name##_hamt_owns(name##_hamt *hamt,                             \
+                                      name##_hamt_node *node) {                      \
+    return node->epoch >= hamt->epoch;                                               \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Free `node`, which an update has just replaced, unless some other               \
+   * hamt may still reach it or it lives in the arena. Its children are              \
+   * left alone.                                                                     \
+   */ \
+  static void name##_hamt_retire(name##_hamt *hamt, name##_hamt_node *node) {        \
+    if (!name##_hamt_owns(hamt, node) ||                                             \
+        (uintptr_t)node - (uintptr_t)hamt->arena < hamt->arena_size) {               \
+      return;                                                                        \
+    }                                                                                \
+    if (node->children != (name##_hamt_node **)(node + 1)) {                         \
+      free(node->children);                                                          \
+    }                                                                                \
+    free(node);                                                                      \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * `node` ready to be changed: itself when `hamt` holds it alone,                  \
+   * otherwise a copy with the same room for children, which replaces it             \
+   * and retires it. A node another trie can reach must not change under             \
+   * it, so only those are copied.                                                   \
+   */ \
+  static name##_hamt_node *name##_hamt_writable(name##_hamt *hamt,                   \
+                                                name##_hamt_node *node) {            \
+    name##_hamt_node *copy;                                                          \
+    unsigned int slots = name##_hamt_slots(node);                                    \
+                                                                                     \
+    if (name##_hamt_owns(hamt, node)) {                                              \
+      return node;                                                                   \
+    }                                                                                \
+    switch (node->type) {                                                            \
+    case LEAF:                                                                       \
+      copy = name##_hamt_create_leaf((unsigned int)node->hash, node->key,            \
+                                     node->value);                                   \
+      break;                                                                         \
+    case COLLISION:                                                                  \
+      copy = name##_hamt_alloc_collision((unsigned int)node->hash, node->bitmap,     \
+                                         node->size);                                \
+      if (name##_hamt_fingerprints(node) != NULL) {                                  \
+        memcpy(name##_hamt_fingerprints(copy), name##_hamt_fingerprints(node),       \
+               node->bitmap);                                                        \
+      }                                                                              \
+      break;                                                                         \
+    default:                                                                         \
+      copy = name##_hamt_alloc_node(node->type, node->hash, node->bitmap, slots);    \
+      copy->size = node->size;                                                       \
+      break;                                                                         \
+    }                                                                                \
+    if (node->type != LEAF) {                                                        \
+      copy->content = node->content;                                                 \
+      memcpy(copy->children, node->children, sizeof(name##_hamt_node *) * slots);    \
+    }                                                                                \
+    name##_hamt_retire(hamt, node);                                                  \
+    return copy;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * A Branch without the child at `position`, shrunk in place when                  \
+   * `hamt` holds it alone and otherwise copied at its new size. The                 \
+   * caller clears the bit.                                                          \
+   */ \
+  static name##_hamt_node *name##_hamt_without_child(name##_hamt *hamt,              \
+                                                     name##_hamt_node *node,         \
+                                                     unsigned int position) {        \
+    unsigned int size = name##_hamt_slots(node);                                     \
+    name##_hamt_node *copy;                                                          \
+                                                                                     \
+    if (name##_hamt_owns(hamt, node)) {                                              \
+      name##_hamt_remove_child(node, position);                                      \
+      return node;                                                                   \
+    }                                                                                \
+    copy = name##_hamt_alloc_node(BRANCH, node->hash, node->bitmap, size - 1);       \
+    copy->size = node->size;                                                         \
+    copy->content = node->content;                                                   \
+    memcpy(copy->children, node->children,                                           \
+           sizeof(name##_hamt_node *) * position);                                   \
+    memcpy(copy->children + position, node->children + position + 1,                 \
+           sizeof(name##_hamt_node *) * (size - position - 1));                      \
+    name##_hamt_retire(hamt, node);                                                  \
+    return copy;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * If the hashes clash create a new collision node                                 \
+   *                                                                                 \
+   * If the partial hashes are the same recurse                                      \
+   *                                                                                 \
+   * Otherwise create a new Branch with the new hash                                 \
+   */ \
+  static inline name##_hamt_node *name##_hamt_merge_leaves(                          \
+      unsigned int depth, unsigned int h1, name##_hamt_node *n1,                     \
+      unsigned int h2, name##_hamt_node *n2) {                                       \
+    name##_hamt_node *node;                                                          \
+                                                                                     \
+    if (h1 == h2) {                                                                  \
+      node = name##_hamt_alloc_collision(h1, 2, 2);                                  \
+      node->children[0] = n2;                                                        \
+      node->children[1] = n1;                                                        \
+      node->content = name##_hamt_content(n1) + name##_hamt_content(n2);             \
+      return node;                                                                   \
+    }                                                                                \
+                                                                                     \
+    unsigned int sub_h1 = name##_hamt_get_frag(h1, depth);                           \
+    unsigned int sub_h2 = name##_hamt_get_frag(h2, depth);                           \
+                                                                                     \
+    if (sub_h1 == sub_h2) {                                                          \
+      node = name##_hamt_alloc_node(BRANCH, name##_hamt_get_mask(sub_h1), 0, 1);     \
+      node->children[0] = name##_hamt_merge_leaves(depth + 1, h1, n1, h2, n2);       \
+      node->size = name##_hamt_subtree_size(node->children[0]);                      \
+      node->content = name##_hamt_content(node->children[0]);                        \
+      return node;                                                                   \
+    }                                                                                \
+                                                                                     \
+    node = name##_hamt_alloc_node(                                                   \
+        BRANCH, name##_hamt_get_mask(sub_h1) | name##_hamt_get_mask(sub_h2), 0,      \
+        2);                                                                          \
+    node->children[sub_h1 > sub_h2] = n1;                                            \
+    node->children[sub_h1 < sub_h2] = n2;                                            \
+    node->size = name##_hamt_subtree_size(n1) + name##_hamt_subtree_size(n2);        \
+    node->content = name##_hamt_content(n1) + name##_hamt_content(n2);               \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * A full Branch gaining `child` at `frag` turns into an ArrayNode                 \
+   */ \
+  static inline name##_hamt_node *name##_hamt_expand_branch_to_array_node(           \
+      name##_hamt_node *branch, unsigned int frag, name##_hamt_node *child) {        \
+    name##_hamt_node *node = name##_hamt_alloc_node(                                 \
+        ARRAY_NODE, 0, name##_hamt_popcount(branch->hash) + 1, name##_hamt_SIZE);    \
+    unsigned int count = 0;                                                          \
+                                                                                     \
+    for (unsigned int i = 0; i < name##_hamt_SIZE; ++i) {                            \
+      node->children[i] = branch->hash & name##_hamt_get_mask(i)                     \
+                              ? branch->children[count++]                            \
+                              : NULL;                                                \
+    }                                                                                \
+                                                                                     \
+    node->children[frag] = child;                                                    \
+    node->size = branch->size + name##_hamt_subtree_size(child);                     \
+    node->content = branch->content + name##_hamt_content(child);                    \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Step down from `node` towards `hash` until the next child would be a            \
+   * leaf, a collision or missing. The Branches and ArrayNodes passed on             \
+   * the way are pushed onto `path` and the node we stopped at returned,             \
+   * with `depth` set to its depth.                                                  \
+   */ \
+  static inline name##_hamt_node *name##_hamt_descend(name##_hamt_node *node,        \
+                                                      unsigned int hash,             \
+                                                      name##_hamt_node **path,       \
+                                                      int *depth) {                  \
+    name##_hamt_node *child;                                                         \
+                                                                                     \
+    for (*depth = 0; node->type == BRANCH || node->type == ARRAY_NODE;               \
+         node = child) {                                                             \
+      unsigned int frag = name##_hamt_get_frag(hash, *depth);                        \
+                                                                                     \
+      if (node->type == BRANCH) {                                                    \
+        if (!(node->hash & name##_hamt_get_mask(frag))) {                            \
+          return node;                                                               \
+        }                                                                            \
+        child = node->children[name##_hamt_get_position(node->hash, frag)];          \
+      } else if ((child = node->children[frag]) == NULL) {                           \
+        return node;                                                                 \
+      }                                                                              \
+      path[(*depth)++] = node;                                                       \
+    }                                                                                \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /* Put `child` below `node`, a Branch or ArrayNode at `depth`, on `hash` */        \
+  static inline void name##_hamt_link(name##_hamt_node *node, unsigned int hash,     \
+                                      int depth, name##_hamt_node *child) {          \
+    unsigned int frag = name##_hamt_get_frag(hash, depth);                           \
+                                                                                     \
+    node->children[node->type == BRANCH                                              \
+                       ? name##_hamt_get_position(node->hash, frag)                  \
+                       : frag] = child;                                              \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Insert by walking down to the node where `key` belongs, recording the           \
+   * path, and rebuilding it bottom up: the node at the bottom is changed,           \
+   * then every node on the path takes the new child and counts. Nodes               \
+   * `hamt` holds alone are changed in place, shared ones are copied and             \
+   * the original retired. Returns the new root, and sets `*added` when              \
+   * `key` wasn't there before.                                                      \
+   *                                                                                 \
+   * A leaf with the same key takes the new value. A leaf with another key           \
+   * is merged with the new one into a Branch, or a Collision if the                 \
+   * hashes clash. A Collision replaces or appends the key. A Branch gains           \
+   * the leaf, expanding into an ArrayNode once it holds `MAX_BRANCH_SIZE`           \
+   * children, and an ArrayNode fills the empty slot.                                \
+   */ \
+  static name##_hamt_node *name##_hamt_insert(name##_hamt *hamt,                     \
+                                              unsigned int hash, name *key,          \
+                                              void *value, bool *added) {            \
+    name##_hamt_node *path[name##_hamt_MAX_DEPTH];                                   \
+    int depth;                                                                       \
+    name##_hamt_node *node =                                                         \
+        name##_hamt_descend(hamt->root, hash, path, &depth);                         \
+    name##_hamt_node *child;                                                         \
+    unsigned int frag;                                                               \
+    /* what the content hash of every node on the path gains */                      \
+    unsigned long long change = hamt_content_entry(hash, value);                     \
+                                                                                     \
+    *added = true;                                                                   \
+    switch (node->type) {                                                            \
+    case LEAF:                                                                       \
+      if (node->hash == hash && equals(node->key, key)) {                            \
+        change -= name##_hamt_content(node);                                         \
+        child = name##_hamt_writable(hamt, node);                                    \
+        child->key = key;                                                            \
+        child->value = value;                                                        \
+        *added = false;                                                              \
+      } else {                                                                       \
+        child = name##_hamt_merge_leaves(                                            \
+            depth, node->hash, node, hash,                                           \
+            name##_hamt_create_leaf(hash, key, value));                              \
+      }                                                                              \
+      break;                                                                         \
+                                                                                     \
+    case COLLISION: {                                                                \
+      int i;                                                                         \
+                                                                                     \
+      if (node->hash != hash) {                                                      \
+        child = name##_hamt_merge_leaves(                                            \
+            depth, node->hash, node, hash,                                           \
+            name##_hamt_create_leaf(hash, key, value));                              \
+        break;                                                                       \
+      }                                                                              \
+      node = name##_hamt_writable(hamt, node);                                       \
+      if ((i = name##_hamt_collision_find(node, key)) < node->bitmap) {              \
+        name##_hamt_node *leaf = name##_hamt_writable(hamt, node->children[i]);      \
+                                                                                     \
+        change -= name##_hamt_content(leaf);                                         \
+        leaf->key = key;                                                             \
+        leaf->value = value;                                                         \
+        node->children[i] = leaf;                                                    \
+        node->content += change;                                                     \
+        *added = false;                                                              \
+        child = node;                                                                \
+      } else {                                                                       \
+        child = name##_hamt_collision_add(                                           \
+            node, name##_hamt_create_leaf(hash, key, value));                        \
+        if (child != node) {                                                         \
+          name##_hamt_retire(hamt, node);                                            \
+        }                                                                            \
+      }                                                                              \
+      break;                                                                         \
+    }                                                                                \
+                                                                                     \
+    case BRANCH:                                                                     \
+      frag = name##_hamt_get_frag(hash, depth);                                      \
+      child = name##_hamt_create_leaf(hash, key, value);                             \
+      if (name##_hamt_popcount(node->hash) >= name##_hamt_MAX_BRANCH_SIZE) {         \
+        child = name##_hamt_expand_branch_to_array_node(node, frag, child);          \
+      } else {                                                                       \
+        child = name##_hamt_insert_child(                                            \
+            node, name##_hamt_get_position(node->hash, frag), child);                \
+        child->hash |= name##_hamt_get_mask(frag);                                   \
+        child->size++;                                                               \
+        child->content += change;                                                    \
+      }                                                                              \
+      name##_hamt_retire(hamt, node);                                                \
+      break;                                                                         \
+                                                                                     \
+    default:                                                                         \
+      child = name##_hamt_writable(hamt, node);                                      \
+      child->children[name##_hamt_get_frag(hash, depth)] =                           \
+          name##_hamt_create_leaf(hash, key, value);                                 \
+      child->bitmap++;                                                               \
+      child->size++;                                                                 \
+      child->content += change;                                                      \
+      break;                                                                         \
+    }                                                                                \
+                                                                                     \
+    while (depth-- > 0) {                                                            \
+      node = name##_hamt_writable(hamt, path[depth]);                                \
+      name##_hamt_link(node, hash, depth, child);                                    \
+      node->size += *added;                                                          \
+      node->content += change;                                                       \
+      child = node;                                                                  \
+    }                                                                                \
+    return child;                                                                    \
+  }                                                                                  \
+  /**                                                                                \
+   * Rebuild the filter of `hamt` once it is full, or once half of what              \
+   * was added to it has been removed again. If memory runs out the old              \
+   * filter stays, as it is still correct, and the next try is put off               \
+   * until as many updates again have been made.                                     \
+   */ \
+  static void name##_hamt_refilter(name##_hamt *hamt) {                              \
+    hamt_filter *filter = hamt->filter;                                              \
+                                                                                     \
+    if (filter->removed > filter->inserted / 2) {                                    \
+      if (!name##_hamt_enable_filter(hamt, 0)) {                                     \
+        filter->removed = 0;                                                         \
+      }                                                                              \
+    } else if (filter->inserted > filter->capacity) {                                \
+      if (!name##_hamt_enable_filter(hamt, filter->capacity * 2)) {                  \
+        filter->capacity *= 2;                                                       \
+      }                                                                              \
+    }                                                                                \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Map `key` to `value`, replacing the value of an equal key. The path             \
+   * to it is updated as `insert` describes, and `hamt` itself is returned.          \
+   */ \
+  name##_hamt *name##_hamt_set(name##_hamt *hamt, name *key, void *value) {          \
+    unsigned int hash = hashof(key);                                                 \
+    bool added = true;                                                               \
+                                                                                     \
+    if (hamt->trace != NULL) {                                                       \
+      name##_hamt_trace_op(hamt, key, hash, HAMT_LOG_SET);                           \
+    }                                                                                \
+                                                                                     \
+    if (hamt->root != NULL) {                                                        \
+      hamt->root = name##_hamt_insert(hamt, hash, key, value, &added);               \
+    } else {                                                                         \
+      hamt->root = name##_hamt_create_leaf(hash, key, value);                        \
+    }                                                                                \
+                                                                                     \
+    atomic_fetch_add_explicit(&hamt->version, 1, memory_order_release);              \
+    if (hamt->filter != NULL && added) {                                             \
+      hamt_filter_add(hamt->filter, hash);                                           \
+      name##_hamt_refilter(hamt);                                                    \
+    }                                                                                \
+    if (hamt->log != NULL) {                                                         \
+      name##_hamt_log_append(hamt, key, value, HAMT_LOG_SET);                        \
+    }                                                                                \
+    return hamt;                                                                     \
+  }                                                                                  \
+  /**                                                                                \
+   * Wind down the tree to the leaf node using the hash.                             \
+   */ \
+  static name##_hamt_node *name##_hamt_find(name##_hamt_node *node,                  \
+                                            unsigned int hash, name *key) {          \
+    int depth = 0;                                                                   \
+                                                                                     \
+    for (;;) {                                                                       \
+      if (node == NULL) {                                                            \
+        return NULL;                                                                 \
+      }                                                                              \
+      switch (node->type) {                                                          \
+      case BRANCH: {                                                                 \
+        unsigned int frag = name##_hamt_get_frag(hash, depth);                       \
+        name##_hamt_bitmap mask = name##_hamt_get_mask(frag);                        \
+                                                                                     \
+        if (node->hash & mask) {                                                     \
+          unsigned int idx = name##_hamt_get_position(node->hash, frag);             \
+          node = node->children[idx];                                                \
+          depth++;                                                                   \
+          continue;                                                                  \
+        } else {                                                                     \
+          return NULL;                                                               \
+        }                                                                            \
+      }                                                                              \
+                                                                                     \
+      case COLLISION: {                                                              \
+        int i = name##_hamt_collision_find(node, key);                               \
+                                                                                     \
+        return i < node->bitmap ? node->children[i] : NULL;                          \
+      }                                                                              \
+                                                                                     \
+      case LEAF: {                                                                   \
+        if (node != NULL && node->hash == hash &&                                    \
+            equals(node->key, key) /* strcmp(node->key, key) == 0 */                 \
+        ) {                                                                          \
+          return node;                                                               \
+        }                                                                            \
+        return NULL;                                                                 \
+      }                                                                              \
+                                                                                     \
+      case ARRAY_NODE: {                                                             \
+        node = node->children[name##_hamt_get_frag(hash, depth)];                    \
+        if (node != NULL) {                                                          \
+          depth++;                                                                   \
+          continue;                                                                  \
+        }                                                                            \
+        return NULL;                                                                 \
+      }                                                                              \
+      }                                                                              \
+    }                                                                                \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Look in the front cache first, then the filter, and finally the tree.           \
+   * Hits found in the tree are remembered in the cache, tagged with the             \
+   * version of the hamt they were found in.                                         \
+   */ \
+  void *name##_hamt_get(name##_hamt *hamt, name *key) {                              \
+    unsigned int hash = hashof(key);                                                 \
+    unsigned long version = 0;                                                       \
+    name##_hamt_node *leaf;                                                          \
+                                                                                     \
+    if (hamt->trace != NULL) {                                                       \
+      name##_hamt_trace_op(hamt, key, hash, HAMT_TRACE_GET);                         \
+    }                                                                                \
+                                                                                     \
+    if (hamt->cache != NULL) {                                                       \
+      hamt_cache_entry *set = hamt_cache_set(hamt->cache, hash);                     \
+      void *cached_key, *value;                                                      \
+                                                                                     \
+      version = atomic_load_explicit(&hamt->version, memory_order_acquire);          \
+      for (int i = 0; i < HAMT_CACHE_WAYS; ++i) {                                    \
+        if (hamt_cache_read(&set[i], hash, version, &cached_key, &value) &&          \
+            (cached_key == key || equals((name *)cached_key, key))) {                \
+          return value;                                                              \
+        }                                                                            \
+      }                                                                              \
+    }                                                                                \
+    if (hamt->filter != NULL && !hamt_filter_maybe(hamt->filter, hash)) {            \
+      return NULL;                                                                   \
+    }                                                                                \
+                                                                                     \
+    if ((leaf = name##_hamt_find(hamt->root, hash, key)) == NULL) {                  \
+      return NULL;                                                                   \
+    }                                                                                \
+    if (hamt->cache != NULL) {                                                       \
+      hamt_cache_write(hamt->cache, hash, leaf->key, leaf->value, version);          \
+    }                                                                                \
+    return leaf->value;                                                              \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Transform ArrayNode into a BranchNode, leaving out the child at `idx`.          \
+   * Setting each bit in the hash for where a child is not NULL. The                 \
+   * caller takes what the removed entry added off the content hash.                 \
+   *                                                                                 \
+   * In order to have got here the lower bound limit for the ArrayNode must          \
+   * have been met, so the remaining children fit a Branch.                          \
+   */ \
+  static inline name##_hamt_node *name##_hamt_compress_array_to_branch(              \
+      name##_hamt_node *array_node, unsigned int idx) {                              \
+    name##_hamt_node *node =                                                         \
+        name##_hamt_alloc_node(BRANCH, 0, 0, array_node->bitmap - 1);                \
+    name##_hamt_node *child = NULL;                                                  \
+    int j = 0;                                                                       \
+                                                                                     \
+    node->size = array_node->size - 1;                                               \
+    node->content = array_node->content;                                             \
+    for (unsigned int i = 0; i < name##_hamt_SIZE; ++i) {                            \
+      if (i != idx) {                                                                \
+        child = array_node->children[i];                                             \
+        if (child != NULL) {                                                         \
+          node->children[j++] = child;                                               \
+          node->hash |= name##_hamt_get_mask(i);                                     \
+        }                                                                            \
+      }                                                                              \
+    }                                                                                \
+                                                                                     \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Remove by walking down to the leaf or collision holding `key`, taking           \
+   * the key out there and rebuilding the path bottom up, as `insert`                \
+   * does. Returns the new root, which is the old one if `key` is absent.            \
+   *                                                                                 \
+   * On the way back up a Branch left with a single leaf collapses into              \
+   * it, and an ArrayNode left with `MIN_ARRAY_NODE_SIZE` children or fewer          \
+   * is compressed into a Branch.                                                    \
+   */ \
+  static name##_hamt_node *name##_hamt_remove_node(name##_hamt *hamt,                \
+                                                   unsigned int hash,                \
+                                                   name *key) {                      \
+    name##_hamt_node *path[name##_hamt_MAX_DEPTH];                                   \
+    int depth;                                                                       \
+    name##_hamt_node *node =                                                         \
+        name##_hamt_descend(hamt->root, hash, path, &depth);                         \
+    name##_hamt_node *child = NULL;                                                  \
+    /* what the content hash of every node on the path loses */                      \
+    unsigned long long gone;                                                         \
+                                                                                     \
+    if (node->hash != hash) {                                                        \
+      return hamt->root;                                                             \
+    }                                                                                \
+    if (node->type == LEAF) {                                                        \
+      if (!equals(node->key, key)) {                                                 \
+        return hamt->root;                                                           \
+      }                                                                              \
+      gone = name##_hamt_content(node);                                              \
+      name##_hamt_retire(hamt, node);                                                \
+    } else if (node->type == COLLISION) {                                            \
+      int i = name##_hamt_collision_find(node, key);                                 \
+      name##_hamt_node *leaf;                                                        \
+                                                                                     \
+      if (i == node->bitmap) {                                                       \
+        return hamt->root;                                                           \
+      }                                                                              \
+      leaf = node->children[i];                                                      \
+      gone = name##_hamt_content(leaf);                                              \
+      if (node->bitmap > 2) {                                                        \
+        child = name##_hamt_writable(hamt, node);                                    \
+        name##_hamt_collision_remove(child, i);                                      \
+      } else {                                                                       \
+        /* Collapse collision node */                                                \
+        child = node->children[i ^ 1];                                               \
+        name##_hamt_retire(hamt, node);                                              \
+      }                                                                              \
+      name##_hamt_retire(hamt, leaf);                                                \
+    } else {                                                                         \
+      return hamt->root;                                                             \
+    }                                                                                \
+                                                                                     \
+    while (depth-- > 0) {                                                            \
+      name##_hamt_node *parent = path[depth];                                        \
+      unsigned int frag = name##_hamt_get_frag(hash, depth);                         \
+                                                                                     \
+      if (child != NULL) {                                                           \
+        /* A lone leaf takes the place of its Branch */                              \
+        if (parent->type == BRANCH && name##_hamt_popcount(parent->hash) == 1 &&     \
+            name##_hamt_is_leaf(child)) {                                            \
+          name##_hamt_retire(hamt, parent);                                          \
+          continue;                                                                  \
+        }                                                                            \
+        node = name##_hamt_writable(hamt, parent);                                   \
+        name##_hamt_link(node, hash, depth, child);                                  \
+      } else if (parent->type == ARRAY_NODE) {                                       \
+        if (parent->bitmap - 1 <= name##_hamt_MIN_ARRAY_NODE_SIZE) {                 \
+          child = name##_hamt_compress_array_to_branch(parent, frag);                \
+          child->content -= gone;                                                    \
+          name##_hamt_retire(hamt, parent);                                          \
+          continue;                                                                  \
+        }                                                                            \
+        node = name##_hamt_writable(hamt, parent);                                   \
+        node->children[frag] = NULL;                                                 \
+        node->bitmap--;                                                              \
+      } else {                                                                       \
+        unsigned int pos = name##_hamt_get_position(parent->hash, frag);             \
+        int size = name##_hamt_popcount(parent->hash);                               \
+                                                                                     \
+        /* Collapse the node, or drop it entirely with its last child */             \
+        if (size == 1 ||                                                             \
+            (size == 2 && name##_hamt_is_leaf(parent->children[pos ^ 1]))) {         \
+          child = size == 2 ? parent->children[pos ^ 1] : NULL;                      \
+          name##_hamt_retire(hamt, parent);                                          \
+          continue;                                                                  \
+        }                                                                            \
+        node = name##_hamt_without_child(hamt, parent, pos);                         \
+        node->hash &= ~name##_hamt_get_mask(frag);                                   \
+      }                                                                              \
+      node->size--;                                                                  \
+      node->content -= gone;                                                         \
+      child = node;                                                                  \
+    }                                                                                \
+    return child;                                                                    \
+  }                                                                                  \
+  /**                                                                                \
+   * Remove a node from the tree, the delete happens on the leaf or                  \
+   * collision node layer.                                                           \
+   *                                                                                 \
+   * I've been testing this rather horribly with a counter to ensure                 \
+   * the 466550 from the test dictionary actually get removed.                       \
+   */ \
+  name##_hamt *name##_hamt_remove(name##_hamt *hamt, name *key) {                    \
+    unsigned int hash = hashof(key);                                                 \
+    unsigned int size = name##_hamt_subtree_size(hamt->root);                        \
+                                                                                     \
+    if (hamt->trace != NULL) {                                                       \
+      name##_hamt_trace_op(hamt, key, hash, HAMT_LOG_REMOVE);                        \
+    }                                                                                \
+                                                                                     \
+    if (hamt->root != NULL) {                                                        \
+      hamt->root = name##_hamt_remove_node(hamt, hash, key);                         \
+    }                                                                                \
+                                                                                     \
+    atomic_fetch_add_explicit(&hamt->version, 1, memory_order_release);              \
+    /* stale bits only cost false positives, so rebuild once they pile up */         \
+    if (hamt->filter != NULL && name##_hamt_subtree_size(hamt->root) < size) {       \
+      hamt->filter->removed++;                                                       \
+      name##_hamt_refilter(hamt);                                                    \
+    }                                                                                \
+    if (hamt->log != NULL) {                                                         \
+      name##_hamt_log_append(hamt, key, NULL, HAMT_LOG_REMOVE);                      \
+    }                                                                                \
+    return hamt;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /* ====== Bulk construction ====== */                                              \
+  typedef struct name##_hamt_entry {                                                 \
+    unsigned int hash;                                                               \
+    name *key;                                                                       \
+    void *value;                                                                     \
+  } name##_hamt_entry;                                                               \
+                                                                                     \
+  /* Fill in the hash of every entry, a block of keys at a time */                   \
+  static void name##_hamt_hash_entries(name##_hamt_entry *entries, size_t n) {       \
+    name *keys[256];                                                                 \
+    unsigned int hashes[256];                                                        \
+                                                                                     \
+    for (size_t i = 0; i < n; i += 256) {                                            \
+      size_t block = n - i < 256 ? n - i : 256;                                      \
+                                                                                     \
+      for (size_t j = 0; j < block; ++j) {                                           \
+        keys[j] = entries[i + j].key;                                                \
+      }                                                                              \
+      name##_hamt_hash_batch(keys, block, hashes);                                   \
+      for (size_t j = 0; j < block; ++j) {                                           \
+        entries[i + j].hash = hashes[j];                                             \
+      }                                                                              \
+    }                                                                                \
+  }                                                                                  \
+  /**                                                                                \
+   * Sort entries into trie order, i.e. by the fragment at `depth`, then             \
+   * by the fragment below it and so on. This is an LSB-first radix sort             \
+   * over the fragments `get_frag` hands out, so the deepest fragment is             \
+   * sorted first and `depth` last. Being stable, entries with equal keys            \
+   * keep the order they were given in.                                              \
+   */ \
+  static void name##_hamt_sort_entries(name##_hamt_entry *entries,                   \
+                                       name##_hamt_entry *tmp, size_t n,             \
+                                       int depth) {                                  \
+    name##_hamt_entry *from = entries, *to = tmp, *swap;                             \
+    int levels = name##_hamt_MAX_DEPTH;                                              \
+                                                                                     \
+    for (int d = levels - 1; d >= depth; --d) {                                      \
+      size_t offsets[name##_hamt_SIZE + 1] = {0};                                    \
+                                                                                     \
+      for (size_t i = 0; i < n; ++i) {                                               \
+        offsets[name##_hamt_get_frag(from[i].hash, d) + 1]++;                        \
+      }                                                                              \
+      for (int i = 0; i < name##_hamt_SIZE; ++i) {                                   \
+        offsets[i + 1] += offsets[i];                                                \
+      }                                                                              \
+      for (size_t i = 0; i < n; ++i) {                                               \
+        to[offsets[name##_hamt_get_frag(from[i].hash, d)]++] = from[i];              \
+      }                                                                              \
+      swap = from;                                                                   \
+      from = to;                                                                     \
+      to = swap;                                                                     \
+    }                                                                                \
+                                                                                     \
+    if (from != entries) {                                                           \
+      memcpy(entries, from, sizeof(name##_hamt_entry) * n);                          \
+    }                                                                                \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Entries sharing a full hash go into one collision node. Equal keys              \
+   * are folded so that the last one wins, just like repeated `set` calls.           \
+   */ \
+  static name##_hamt_node *name##_hamt_build_collision(name##_hamt_entry *entries,   \
+                                                       size_t n) {                   \
+    name##_hamt_node *node =                                                         \
+        name##_hamt_alloc_collision(entries[0].hash, 0, (unsigned int)n);            \
+    name##_hamt_node *leaf;                                                          \
+                                                                                     \
+    for (size_t i = 0; i < n; ++i) {                                                 \
+      int j = name##_hamt_collision_find(node, entries[i].key);                      \
+                                                                                     \
+      leaf = name##_hamt_create_leaf(entries[i].hash, entries[i].key,                \
+                                     entries[i].value);                              \
+      if (j < node->bitmap) {                                                        \
+        node->content += name##_hamt_content(leaf) -                                 \
+                         name##_hamt_content(node->children[j]);                     \
+        node->children[j] = leaf;                                                    \
+      } else {                                                                       \
+        name##_hamt_collision_add(node, leaf);                                       \
+      }                                                                              \
+    }                                                                                \
+                                                                                     \
+    if (node->bitmap == 1) {                                                         \
+      leaf = node->children[0];                                                      \
+      free(node);                                                                    \
+      return leaf;                                                                   \
+    }                                                                                \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Build the subtree for a run of sorted entries which all agree on the            \
+   * fragments above `depth`. Every node is allocated once, and the choice           \
+   * between a Branch and an ArrayNode is made from its final child count            \
+   * using the same threshold `set` uses when expanding a Branch.                    \
+   */ \
+  static name##_hamt_node *name##_hamt_build(name##_hamt_entry *entries, size_t n,   \
+                                             int depth) {                            \
+    if (n == 1) {                                                                    \
+      return name##_hamt_create_leaf(entries[0].hash, entries[0].key,                \
+                                     entries[0].value);                              \
+    }                                                                                \
+    /* sorted on every fragment, so equal ends means one full hash */                \
+    if (entries[0].hash == entries[n - 1].hash) {                                    \
+      return name##_hamt_build_collision(entries, n);                                \
+    }                                                                                \
+                                                                                     \
+    unsigned int count = 0;                                                          \
+    name##_hamt_bitmap bitmap = 0;                                                   \
+    for (size_t i = 0; i < n; ++i) {                                                 \
+      name##_hamt_bitmap mask =                                                      \
+          name##_hamt_get_mask(name##_hamt_get_frag(entries[i].hash, depth));        \
+      if (!(bitmap & mask)) {                                                        \
+        bitmap |= mask;                                                              \
+        count++;                                                                     \
+      }                                                                              \
+    }                                                                                \
+                                                                                     \
+    bool array_node = count > name##_hamt_MAX_BRANCH_SIZE;                           \
+    name##_hamt_node **children =                                                    \
+        name##_hamt_alloc_children(array_node ? name##_hamt_SIZE : count);           \
+    size_t start = 0;                                                                \
+    unsigned int pos = 0, size = 0;                                                  \
+    unsigned long long content = 0;                                                  \
+    name##_hamt_node *node;                                                          \
+                                                                                     \
+    while (start < n) {                                                              \
+      unsigned int frag = name##_hamt_get_frag(entries[start].hash, depth);          \
+      size_t end = start + 1;                                                        \
+                                                                                     \
+      while (end < n && name##_hamt_get_frag(entries[end].hash, depth) == frag) {    \
+        end++;                                                                       \
+      }                                                                              \
+      node = name##_hamt_build(entries + start, end - start, depth + 1);             \
+      children[array_node ? frag : pos++] = node;                                    \
+      size += name##_hamt_subtree_size(node);                                        \
+      content += name##_hamt_content(node);                                          \
+      start = end;                                                                   \
+    }                                                                                \
+                                                                                     \
+    node = array_node ? name##_hamt_create_arraynode(children, count)                \
+                      : name##_hamt_create_branch(bitmap, children);                 \
+    node->size = size;                                                               \
+    node->content = content;                                                         \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Hash `n` keys and sort them into trie order. The entries come with              \
+   * as much room again for the sort to scatter into. Returns NULL if                \
+   * that doesn't fit in memory.                                                     \
+   */ \
+  static name##_hamt_entry *name##_hamt_sorted_entries(name **keys, void **values,   \
+                                                       size_t n) {                   \
+    name##_hamt_entry *entries;                                                      \
+                                                                                     \
+    if (n > SIZE_MAX / (sizeof(name##_hamt_entry) * 2) ||                            \
+        (entries = (name##_hamt_entry *)malloc(sizeof(name##_hamt_entry) * n *       \
+                                               2)) == NULL) {                        \
+      fprintf(stderr, "Failed to allocate memory for entries\n");                    \
+      return NULL;                                                                   \
+    }                                                                                \
+    for (size_t i = 0; i < n; ++i) {                                                 \
+      entries[i].key = keys[i];                                                      \
+      entries[i].value = values != NULL ? values[i] : NULL;                          \
+    }                                                                                \
+    name##_hamt_hash_entries(entries, n);                                            \
+    name##_hamt_sort_entries(entries, entries + n, n, 0);                            \
+    return entries;                                                                  \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Build a hamt from `n` keys and values in one pass, instead of `n`               \
+   * calls to `set` which each walk down from the root. Later                        \
+   * duplicates of a key win.                                                        \
+   */ \
+  name##_hamt *name##_hamt_from_array(name **keys, void **values, size_t n) {        \
+    name##_hamt *hamt = name##_hamt_new();                                           \
+    name##_hamt_entry *entries;                                                      \
+                                                                                     \
+    if (n == 0) {                                                                    \
+      return hamt;                                                                   \
+    }                                                                                \
+    if ((entries = name##_hamt_sorted_entries(keys, values, n)) == NULL) {           \
+      free(hamt);                                                                    \
+      return NULL;                                                                   \
+    }                                                                                \
+    hamt->root = name##_hamt_build(entries, n, 0);                                   \
+                                                                                     \
+    free(entries);                                                                   \
+    return hamt;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /* ====== Parallel loading ====== */                                               \
+  /**                                                                                \
+   * Turn one line of input (without its newline) into a key, storing the            \
+   * value in `*value`. Return NULL to skip the line. Called from several            \
+   * threads at once.                                                                \
+   */ \
+  typedef name *(*name##_hamt_parse_fn)(char *line, size_t len, void **value,        \
+                                        void *ctx);                                  \
+                                                                                     \
+  typedef struct name##_hamt_load_chunk {                                            \
+    char *start;                                                                     \
+    char *end;                                                                       \
+    name##_hamt_entry *entries;                                                      \
+    size_t len;                                                                      \
+    size_t capacity;                                                                 \
+    /* entries per top fragment, later where the chunk scatters to */                \
+    size_t offsets[name##_hamt_SIZE];                                                \
+  } name##_hamt_load_chunk;                                                          \
+                                                                                     \
+  typedef struct name##_hamt_load_t {                                                \
+    name##_hamt_load_chunk *chunks;                                                  \
+    name##_hamt_entry *sorted;                                                       \
+    name##_hamt_entry *tmp;                                                          \
+    size_t starts[name##_hamt_SIZE + 1];                                             \
+    name##_hamt_node *roots[name##_hamt_SIZE];                                       \
+    name##_hamt_parse_fn parse;                                                      \
+    void *ctx;                                                                       \
+    atomic_bool failed;                                                              \
+  } name##_hamt_load_t;                                                              \
+                                                                                     \
+  /* Parse and hash one chunk, counting entries per top fragment */                  \
+  static void name##_hamt_load_parse(void *arg, size_t i) {                          \
+    name##_hamt_load_t *load = (name##_hamt_load_t *)arg;                            \
+    name##_hamt_load_chunk *chunk = &load->chunks[i];                                \
+    char *line = chunk->start;                                                       \
+                                                                                     \
+    while (line < chunk->end) {                                                      \
+      char *newline = (char *)memchr(line, '\n', chunk->end - line);                 \
+      size_t len = newline ? (size_t)(newline - line)                                \
+                           : (size_t)(chunk->end - line);                            \
+      void *value = NULL;                                                            \
+      name *key = load->parse(line, len, &value, load->ctx);                         \
+                                                                                     \
+      line += len + 1;                                                               \
+      if (key == NULL) {                                                             \
+        continue;                                                                    \
+      }                                                                              \
+      if (chunk->len == chunk->capacity) {                                           \
+        size_t capacity = chunk->capacity ? chunk->capacity * 2 : 1024;              \
+        name##_hamt_entry *entries = (name##_hamt_entry *)realloc(                   \
+            chunk->entries, sizeof(name##_hamt_entry) * capacity);                   \
+        if (entries == NULL) {                                                       \
+          fprintf(stderr, "Failed to allocate memory for entries\n");                \
+          atomic_store(&load->failed, true);                                         \
+          return;                                                                    \
+        }                                                                            \
+        chunk->entries = entries;                                                    \
+        chunk->capacity = capacity;                                                  \
+      }                                                                              \
+                                                                                     \
+      chunk->entries[chunk->len].key = key;                                          \
+      chunk->entries[chunk->len++].value = value;                                    \
+    }                                                                                \
+                                                                                     \
+    name##_hamt_hash_entries(chunk->entries, chunk->len);                            \
+    for (size_t j = 0; j < chunk->len; ++j) {                                        \
+      chunk->offsets[name##_hamt_get_frag(chunk->entries[j].hash, 0)]++;             \
+    }                                                                                \
+  }                                                                                  \
+                                                                                     \
+  /* Move a chunk's entries into their bucket, keeping input order */                \
+  static void name##_hamt_load_scatter(void *arg, size_t i) {                        \
+    name##_hamt_load_t *load = (name##_hamt_load_t *)arg;                            \
+    name##_hamt_load_chunk *chunk = &load->chunks[i];                                \
+                                                                                     \
+    for (size_t j = 0; j < chunk->len; ++j) {                                        \
+      unsigned int frag = name##_hamt_get_frag(chunk->entries[j].hash, 0);           \
+      load->sorted[chunk->offsets[frag]++] = chunk->entries[j];                      \
+    }                                                                                \
+  }                                                                                  \
+                                                                                     \
+  /* Build the subtree below one slot of the root */                                 \
+  static void name##_hamt_load_build(void *arg, size_t frag) {                       \
+    name##_hamt_load_t *load = (name##_hamt_load_t *)arg;                            \
+    size_t start = load->starts[frag];                                               \
+    size_t n = load->starts[frag + 1] - start;                                       \
+                                                                                     \
+    if (n == 0) {                                                                    \
+      return;                                                                        \
+    }                                                                                \
+    name##_hamt_sort_entries(load->sorted + start, load->tmp + start, n, 1);         \
+    load->roots[frag] = name##_hamt_build(load->sorted + start, n, 1);               \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Build a hamt from newline separated records, e.g. an mmapped file,              \
+   * using `nthreads` threads. Each thread parses and hashes a slice of              \
+   * `buf`, the records are scattered into one bucket per top level hash             \
+   * fragment, and the subtree for every bucket is built independently               \
+   * before they are joined under a single root. Later duplicates of a key           \
+   * win, as with `from_array`.                                                      \
+   */ \
+  name##_hamt *name##_hamt_load_parallel(char *buf, size_t len, int nthreads,        \
+                                         name##_hamt_parse_fn parse, void *ctx) {    \
+    name##_hamt *hamt = name##_hamt_new();                                           \
+    name##_hamt_load_t load = {.parse = parse, .ctx = ctx};                          \
+    size_t total = 0;                                                                \
+                                                                                     \
+    if (nthreads < 1) {                                                              \
+      nthreads = 1;                                                                  \
+    }                                                                                \
+    atomic_init(&load.failed, false);                                                \
+    if ((load.chunks = (name##_hamt_load_chunk *)calloc(                             \
+             nthreads, sizeof(name##_hamt_load_chunk))) == NULL) {                   \
+      fprintf(stderr, "Failed to allocate memory for chunks\n");                     \
+      free(hamt);                                                                    \
+      return NULL;                                                                   \
+    }                                                                                \
+                                                                                     \
+    /* split on line boundaries */                                                   \
+    char *end = buf + len;                                                           \
+    char *start = buf;                                                               \
+    for (int i = 0; i < nthreads; ++i) {                                             \
+      char *split = i == nthreads - 1 ? end : buf + len / nthreads * (i + 1);        \
+      if (split < start) {                                                           \
+        split = start;                                                               \
+      }                                                                              \
+      while (split < end && split > buf && split[-1] != '\n') {                      \
+        split++;                                                                     \
+      }                                                                              \
+      load.chunks[i].start = start;                                                  \
+      load.chunks[i].end = split;                                                    \
+      start = split;                                                                 \
+    }                                                                                \
+                                                                                     \
+    hamt_parallel_for(nthreads, nthreads, name##_hamt_load_parse, &load);            \
+    if (atomic_load(&load.failed)) {                                                 \
+      goto done;                                                                     \
+    }                                                                                \
+                                                                                     \
+    for (int frag = 0; frag < name##_hamt_SIZE; ++frag) {                            \
+      load.starts[frag] = total;                                                     \
+      for (int i = 0; i < nthreads; ++i) {                                           \
+        size_t count = load.chunks[i].offsets[frag];                                 \
+        load.chunks[i].offsets[frag] = total;                                        \
+        total += count;                                                              \
+      }                                                                              \
+    }                                                                                \
+    load.starts[name##_hamt_SIZE] = total;                                           \
+    if (total == 0) {                                                                \
+      goto done;                                                                     \
+    }                                                                                \
+                                                                                     \
+    if (total > SIZE_MAX / (sizeof(name##_hamt_entry) * 2) ||                        \
+        (load.sorted = (name##_hamt_entry *)malloc(sizeof(name##_hamt_entry) *       \
+                                                   total * 2)) == NULL) {            \
+      fprintf(stderr, "Failed to allocate memory for entries\n");                    \
+      atomic_store(&load.failed, true);                                              \
+      goto done;                                                                     \
+    }                                                                                \
+    load.tmp = load.sorted + total;                                                  \
+    hamt_parallel_for(nthreads, nthreads, name##_hamt_load_scatter, &load);          \
+    hamt_parallel_for(name##_hamt_SIZE, nthreads, name##_hamt_load_build, &load);    \
+                                                                                     \
+    unsigned int count = 0, size = 0;                                                \
+    unsigned long long content = 0;                                                  \
+    name##_hamt_bitmap bitmap = 0;                                                   \
+    name##_hamt_node *last = NULL;                                                   \
+    for (int frag = 0; frag < name##_hamt_SIZE; ++frag) {                            \
+      if (load.roots[frag] != NULL) {                                                \
+        bitmap |= name##_hamt_get_mask(frag);                                        \
+        count++;                                                                     \
+        size += name##_hamt_subtree_size(load.roots[frag]);                          \
+        content += name##_hamt_content(load.roots[frag]);                            \
+        last = load.roots[frag];                                                     \
+      }                                                                              \
+    }                                                                                \
+    /* a lone leaf is the root by itself, as `from_array` makes it */                \
+    if (count == 1 && name##_hamt_is_leaf(last)) {                                   \
+      hamt->root = last;                                                             \
+      goto done;                                                                     \
+    }                                                                                \
+    if (count > name##_hamt_MAX_BRANCH_SIZE) {                                       \
+      name##_hamt_node **children = name##_hamt_alloc_children(name##_hamt_SIZE);    \
+      memcpy(children, load.roots, sizeof(name##_hamt_node *) * name##_hamt_SIZE);   \
+      hamt->root = name##_hamt_create_arraynode(children, count);                    \
+    } else {                                                                         \
+      name##_hamt_node **children = name##_hamt_alloc_children(count);               \
+      unsigned int pos = 0;                                                          \
+      for (int frag = 0; frag < name##_hamt_SIZE; ++frag) {                          \
+        if (load.roots[frag] != NULL) {                                              \
+          children[pos++] = load.roots[frag];                                        \
+        }                                                                            \
+      }                                                                              \
+      hamt->root = name##_hamt_create_branch(bitmap, children);                      \
+    }                                                                                \
+    hamt->root->size = size;                                                         \
+    hamt->root->content = content;                                                   \
+                                                                                     \
+  done:                                                                              \
+    for (int i = 0; i < nthreads; ++i) {                                             \
+      free(load.chunks[i].entries);                                                  \
+    }                                                                                \
+    free(load.chunks);                                                               \
+    free(load.sorted);                                                               \
+    if (atomic_load(&load.failed)) {                                                 \
+      free(hamt);                                                                    \
+      return NULL;                                                                   \
+    }                                                                                \
+    return hamt;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /* ====== Compaction ====== */                                                     \
+  typedef struct name##_hamt_compact_item {                                          \
+    name##_hamt_node *node;                                                          \
+    /* where its copy goes */                                                        \
+    name##_hamt_node **slot;                                                         \
+  } name##_hamt_compact_item;                                                        \
+                                                                                     \
+  typedef struct name##_hamt_compaction {                                            \
+    /* any change to the trie after this version starts the pass over */             \
+    unsigned long version;                                                           \
+    bool started;                                                                    \
+    /* times it did, up to HAMT_COMPACT_RESTARTS */                                  \
+    unsigned int restarts;                                                           \
+    /* bytes the trie takes up, counted by the first walk */                         \
+    size_t size;                                                                     \
+    /* filled in by the second walk, NULL while counting */                          \
+    char *arena;                                                                     \
+    enum hamt_storage storage;                                                       \
+    size_t used;                                                                     \
+    name##_hamt_node *root;                                                          \
+    name##_hamt_compact_item *stack;                                                 \
+    unsigned int depth;                                                              \
+    unsigned int capacity;                                                           \
+  } name##_hamt_compaction;                                                          \
+                                                                                     \
+  static bool name##_hamt_compact_push(name##_hamt_compaction *pass,                 \
+                                       name##_hamt_node *node,                       \
+                                       name##_hamt_node **slot) {                    \
+    if (!hamt_grow((void **)&pass->stack, &pass->capacity, pass->depth + 1,          \
+                   sizeof(name##_hamt_compact_item))) {                              \
+      return false;                                                                  \
+    }                                                                                \
+    pass->stack[pass->depth].node = node;                                            \
+    pass->stack[pass->depth++].slot = slot;                                          \
+    return true;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  static void name##_hamt_compact_reset(name##_hamt_compaction *pass) {              \
+    hamt_storage_free(pass->arena, pass->size, pass->storage);                       \
+    pass->arena = NULL;                                                              \
+    pass->started = false;                                                           \
+    pass->size = 0;                                                                  \
+    pass->used = 0;                                                                  \
+    pass->depth = 0;                                                                 \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Free the nodes under `node` that `hamt` holds alone and that aren't             \
+   * part of its arena. Below a node it shares, everything is shared.                \
+   */ \
+  static void name##_hamt_free_nodes(name##_hamt *hamt,                              \
+                                     name##_hamt_node *node) {                       \
+    unsigned int slots = name##_hamt_slots(node);                                    \
+                                                                                     \
+    if (!name##_hamt_owns(hamt, node)) {                                             \
+      return;                                                                        \
+    }                                                                                \
+    for (unsigned int i = 0; i < slots; ++i) {                                       \
+      if (node->children[i] != NULL) {                                               \
+        name##_hamt_free_nodes(hamt, node->children[i]);                             \
+      }                                                                              \
+    }                                                                                \
+    name##_hamt_retire(hamt, node);                                                  \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Do up to `budget` nodes worth of compaction, and return whether there           \
+   * is more to do. A pass walks the trie twice, once to size a new arena            \
+   * and once to copy every node into it depth first, each next to its               \
+   * first child. Then the new root replaces the old one and the old nodes           \
+   * it alone holds are freed. As lookups never run alongside `set` or               \
+   * `remove`, nothing can still be reading them. Updates made between               \
+   * steps invalidate the copy, so the pass starts over after them. It               \
+   * does not track which nodes changed, so a trie updated between every             \
+   * step would never be compacted. Instead the step that starts the pass            \
+   * over for the `HAMT_COMPACT_RESTARTS`th time finishes it whatever the            \
+   * budget.                                                                         \
+   */ \
+  bool name##_hamt_compact_step(name##_hamt *hamt, size_t budget) {                  \
+    name##_hamt_compaction *pass = hamt->compaction;                                 \
+    unsigned long version =                                                          \
+        atomic_load_explicit(&hamt->version, memory_order_relaxed);                  \
+                                                                                     \
+    if (pass == NULL) {                                                              \
+      if ((pass = (name##_hamt_compaction *)calloc(                                  \
+               1, sizeof(name##_hamt_compaction))) == NULL) {                        \
+        fprintf(stderr, "Failed to allocate memory for compaction\n");               \
+        return false;                                                                \
+      }                                                                              \
+      hamt->compaction = pass;                                                       \
+    }                                                                                \
+    if (pass->started && pass->version != version) {                                 \
+      name##_hamt_compact_reset(pass);                                               \
+      if (++pass->restarts == HAMT_COMPACT_RESTARTS) {                               \
+        while (name##_hamt_compact_step(hamt, SIZE_MAX)) {                           \
+        }                                                                            \
+        return false;                                                                \
+      }                                                                              \
+    }                                                                                \
+    if (!pass->started) {                                                            \
+      if (hamt->root == NULL ||                                                      \
+          !name##_hamt_compact_push(pass, hamt->root, &pass->root)) {                \
+        goto done;                                                                   \
+      }                                                                              \
+      pass->started = true;                                                          \
+      pass->version = version;                                                       \
+    }                                                                                \
+                                                                                     \
+    for (; budget > 0 && pass->depth > 0; --budget) {                                \
+      name##_hamt_compact_item item = pass->stack[--pass->depth];                    \
+      name##_hamt_node *node = item.node;                                            \
+      unsigned int slots = name##_hamt_slots(node);                                  \
+      /* collisions lose their spare room */                                         \
+      size_t bytes = sizeof(name##_hamt_node) +                                      \
+                     (node->type == COLLISION                                        \
+                          ? name##_hamt_collision_bytes(slots)                       \
+                          : sizeof(name##_hamt_node *) * slots);                     \
+      name##_hamt_node **children = node->children;                                  \
+                                                                                     \
+      if (pass->arena == NULL) {                                                     \
+        pass->size += bytes;                                                         \
+      } else {                                                                       \
+        name##_hamt_node *copy = (name##_hamt_node *)(pass->arena + pass->used);     \
+                                                                                     \
+        pass->used += bytes;                                                         \
+        *copy = *node;                                                               \
+        copy->epoch =                                                                \
+            atomic_load_explicit(&name##_hamt_epochs, memory_order_relaxed);         \
+        copy->children = (name##_hamt_node **)(copy + 1);                            \
+        if (slots > 0) {                                                             \
+          memcpy(copy->children, node->children,                                     \
+                 sizeof(name##_hamt_node *) * slots);                                \
+        }                                                                            \
+        if (node->type == COLLISION) {                                               \
+          copy->size = slots;                                                        \
+          if (name##_hamt_fingerprints(copy) != NULL) {                              \
+            memcpy(name##_hamt_fingerprints(copy),                                   \
+                   name##_hamt_fingerprints(node), slots);                           \
+          }                                                                          \
+        }                                                                            \
+        *item.slot = copy;                                                           \
+        children = copy->children;                                                   \
+      }                                                                              \
+      /* in reverse, so the first child comes off the stack next */                  \
+      for (unsigned int i = slots; i-- > 0;) {                                       \
+        if (children[i] != NULL &&                                                   \
+            !name##_hamt_compact_push(pass, children[i], &children[i])) {            \
+          goto done;                                                                 \
+        }                                                                            \
+      }                                                                              \
+    }                                                                                \
+    if (pass->depth > 0) {                                                           \
+      return true;                                                                   \
+    }                                                                                \
+                                                                                     \
+    if (pass->arena == NULL) {                                                       \
+      if ((pass->arena = hamt_storage_alloc(pass->size, hamt->huge_pages,            \
+                                            &pass->storage)) == NULL) {              \
+        fprintf(stderr, "Failed to allocate memory for arena\n");                    \
+        goto done;                                                                   \
+      }                                                                              \
+      return name##_hamt_compact_push(pass, hamt->root, &pass->root);                \
+    }                                                                                \
+    /* the old arena starts with its root, which dates it */                         \
+    name##_hamt_free_nodes(hamt, hamt->root);                                        \
+    if (hamt->arena == NULL ||                                                       \
+        name##_hamt_owns(hamt, (name##_hamt_node *)hamt->arena)) {                   \
+      hamt_storage_free(hamt->arena, hamt->arena_size, hamt->arena_storage);         \
+    }                                                                                \
+    hamt->root = pass->root;                                                         \
+    hamt->arena = pass->arena;                                                       \
+    hamt->arena_size = pass->size;                                                   \
+    hamt->arena_storage = pass->storage;                                             \
+    pass->arena = NULL;                                                              \
+                                                                                     \
+  done:                                                                              \
+    name##_hamt_compact_reset(pass);                                                 \
+    free(pass->stack);                                                               \
+    free(pass);                                                                      \
+    hamt->compaction = NULL;                                                         \
+    return false;                                                                    \
+  }                                                                                  \
+                                                                                     \
+  /* Relocate the whole trie into one block in a single go */                        \
+  void name##_hamt_compact(name##_hamt *hamt) {                                      \
+    while (name##_hamt_compact_step(hamt, SIZE_MAX)) {                               \
+    }                                                                                \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Put the arenas of later compactions on huge pages where the system              \
+   * allows, see `hamt_storage_alloc`. Worth it once a trie outgrows the             \
+   * last level cache, compacted after loading and every so often after.             \
+   */ \
+  void name##_hamt_enable_huge_pages(name##_hamt *hamt) {                            \
+    hamt->huge_pages = true;                                                         \
+  }                                                                                  \
+                                                                                     \
+  static void name##_hamt_count_nodes(name##_hamt *hamt, name##_hamt_node *node,     \
+                                      hamt_stats *stats) {                           \
+    unsigned int slots = name##_hamt_slots(node);                                    \
+                                                                                     \
+    stats->nodes++;                                                                  \
+    if ((uintptr_t)node - (uintptr_t)hamt->arena < hamt->arena_size) {               \
+      stats->arena_nodes++;                                                          \
+    }                                                                                \
+    for (unsigned int i = 0; i < slots; ++i) {                                       \
+      if (node->children[i] != NULL) {                                               \
+        name##_hamt_count_nodes(hamt, node->children[i], stats);                     \
+      }                                                                              \
+    }                                                                                \
+  }                                                                                  \
+                                                                                     \
+  /* Fill in `stats`, walking the whole trie to count its nodes */                   \
+  void name##_hamt_stats(name##_hamt *hamt, hamt_stats *stats) {                     \
+    stats->entries = name##_hamt_subtree_size(hamt->root);                           \
+    stats->nodes = 0;                                                                \
+    stats->arena_nodes = 0;                                                          \
+    stats->arena_bytes = hamt->arena_size;                                           \
+    stats->storage = hamt->arena_storage;                                            \
+    if (hamt->root != NULL) {                                                        \
+      name##_hamt_count_nodes(hamt, hamt->root, stats);                              \
+    }                                                                                \
+  }                                                                                  \
+  /* ====== Frozen tries ====== */                                                   \
+  /**                                                                                \
+   * A read only copy of a hamt in one block of memory. Internal nodes are           \
+   * laid out breadth first with the children of a node next to each                 \
+   * other, so a node is just a bitmap and the index of its first child.             \
+   * A node with an empty bitmap is a leaf, and `first` then indexes                 \
+   * `leaves` instead. Keys sharing a full hash sit next to each other               \
+   * there, with `count` telling how many follow.                                    \
+   */ \
+  typedef struct name##_hamt_frozen_node {                                           \
+    name##_hamt_bitmap bitmap;                                                       \
+    unsigned int first;                                                              \
+  } name##_hamt_frozen_node;                                                         \
+                                                                                     \
+  typedef struct name##_hamt_frozen_leaf {                                           \
+    unsigned int hash;                                                               \
+    unsigned int count;                                                              \
+    name *key;                                                                       \
+    void *value;                                                                     \
+  } name##_hamt_frozen_leaf;                                                         \
+                                                                                     \
+  typedef struct name##_hamt_frozen {                                                \
+    size_t size;                                                                     \
+    unsigned int node_count;                                                         \
+    unsigned int leaf_count;                                                         \
+    name##_hamt_frozen_node *nodes;                                                  \
+    name##_hamt_frozen_leaf *leaves;                                                 \
+  } name##_hamt_frozen;                                                              \
+                                                                                     \
+  static void name##_hamt_frozen_count(name##_hamt_node *node, size_t *nodes,        \
+                                       size_t *leaves) {                             \
+    if (node == NULL) {                                                              \
+      return;                                                                        \
+    }                                                                                \
+    (*nodes)++;                                                                      \
+    switch (node->type) {                                                            \
+    case LEAF:                                                                       \
+      (*leaves)++;                                                                   \
+      return;                                                                        \
+    case COLLISION:                                                                  \
+      *leaves += node->bitmap;                                                       \
+      return;                                                                        \
+    case BRANCH:                                                                     \
+      for (int i = 0; i < name##_hamt_popcount(node->hash); ++i) {                   \
+        name##_hamt_frozen_count(node->children[i], nodes, leaves);                  \
+      }                                                                              \
+      return;                                                                        \
+    case ARRAY_NODE:                                                                 \
+      for (int i = 0; i < name##_hamt_SIZE; ++i) {                                   \
+        name##_hamt_frozen_count(node->children[i], nodes, leaves);                  \
+      }                                                                              \
+      return;                                                                        \
+    }                                                                                \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Copy `hamt` into a single allocation which can be read with                     \
+   * `get_frozen` and released with `free`. The hamt itself is untouched.            \
+   */ \
+  name##_hamt_frozen *name##_hamt_freeze(name##_hamt *hamt) {                        \
+    size_t node_count = 0, leaf_count = 0;                                           \
+    name##_hamt_frozen_count(hamt->root, &node_count, &leaf_count);                  \
+                                                                                     \
+    size_t size = sizeof(name##_hamt_frozen) +                                       \
+                  sizeof(name##_hamt_frozen_node) * node_count +                     \
+                  sizeof(name##_hamt_frozen_leaf) * leaf_count;                      \
+    name##_hamt_frozen *frozen;                                                      \
+    name##_hamt_node **queue;                                                        \
+                                                                                     \
+    if ((frozen = (name##_hamt_frozen *)malloc(size)) == NULL) {                     \
+      fprintf(stderr, "Failed to allocate memory for frozen hamt\n");                \
+      return NULL;                                                                   \
+    }                                                                                \
+    if ((queue = (name##_hamt_node **)malloc(sizeof(name##_hamt_node *) *            \
+                                             (node_count + 1))) == NULL) {           \
+      fprintf(stderr, "Failed to allocate memory for frozen hamt\n");                \
+      free(frozen);                                                                  \
+      return NULL;                                                                   \
+    }                                                                                \
+                                                                                     \
+    frozen->size = size;                                                             \
+    frozen->node_count = node_count;                                                 \
+    frozen->leaf_count = leaf_count;                                                 \
+    frozen->nodes = (name##_hamt_frozen_node *)(frozen + 1);                         \
+    frozen->leaves = (name##_hamt_frozen_leaf *)(frozen->nodes + node_count);        \
+                                                                                     \
+    size_t tail = 0, leaf = 0;                                                       \
+    queue[tail++] = hamt->root;                                                      \
+    for (size_t i = 0; i < node_count; ++i) {                                        \
+      name##_hamt_node *node = queue[i];                                             \
+      name##_hamt_frozen_node *out = &frozen->nodes[i];                              \
+                                                                                     \
+      out->bitmap = 0;                                                               \
+      out->first = tail;                                                             \
+      switch (node->type) {                                                          \
+      case LEAF:                                                                     \
+      case COLLISION: {                                                              \
+        int len = node->type == LEAF ? 1 : node->bitmap;                             \
+        out->first = leaf;                                                           \
+        for (int j = 0; j < len; ++j) {                                              \
+          name##_hamt_node *child = node->type == LEAF ? node : node->children[j];   \
+          frozen->leaves[leaf].hash = child->hash;                                   \
+          frozen->leaves[leaf].count = len - j;                                      \
+          frozen->leaves[leaf].key = child->key;                                     \
+          frozen->leaves[leaf++].value = child->value;                               \
+        }                                                                            \
+        break;                                                                       \
+      }                                                                              \
+      case BRANCH:                                                                   \
+        out->bitmap = node->hash;                                                    \
+        for (int j = 0; j < name##_hamt_popcount(node->hash); ++j) {                 \
+          queue[tail++] = node->children[j];                                         \
+        }                                                                            \
+        break;                                                                       \
+      case ARRAY_NODE:                                                               \
+        for (int j = 0; j < name##_hamt_SIZE; ++j) {                                 \
+          if (node->children[j] != NULL) {                                           \
+            out->bitmap |= name##_hamt_get_mask(j);                                  \
+            queue[tail++] = node->children[j];                                       \
+          }                                                                          \
+        }                                                                            \
+        break;                                                                       \
+      }                                                                              \
+    }                                                                                \
+                                                                                     \
+    free(queue);                                                                     \
+    return frozen;                                                                   \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Walk from `nodes[root]` down to the leaves holding `hash`. Every level          \
+   * is one bitmap test and an index into `nodes`, with no dispatch on the           \
+   * node type.                                                                      \
+   */ \
+  static name##_hamt_frozen_leaf *name##_hamt_frozen_lookup(                         \
+      name##_hamt_frozen_node *nodes, name##_hamt_frozen_leaf *leaves,               \
+      unsigned int root, unsigned int hash, name *key) {                             \
+    name##_hamt_frozen_node *node = &nodes[root];                                    \
+                                                                                     \
+    for (int depth = 0; node->bitmap; ++depth) {                                     \
+      unsigned int frag = name##_hamt_get_frag(hash, depth);                         \
+                                                                                     \
+      if (!(node->bitmap & name##_hamt_get_mask(frag))) {                            \
+        return NULL;                                                                 \
+      }                                                                              \
+      node = &nodes[node->first + name##_hamt_get_position(node->bitmap, frag)];     \
+    }                                                                                \
+                                                                                     \
+    name##_hamt_frozen_leaf *leaf = &leaves[node->first];                            \
+    for (unsigned int i = 0; i < leaf->count; ++i) {                                 \
+      if (leaf[i].hash == hash && equals(leaf[i].key, key)) {                        \
+        return &leaf[i];                                                             \
+      }                                                                              \
+    }                                                                                \
+    return NULL;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /* Same as `get`, on a frozen copy */                                              \
+  void *name##_hamt_get_frozen(name##_hamt_frozen *frozen, name *key) {              \
+    name##_hamt_frozen_leaf *leaf;                                                   \
+                                                                                     \
+    if (frozen->node_count == 0) {                                                   \
+      return NULL;                                                                   \
+    }                                                                                \
+    leaf = name##_hamt_frozen_lookup(frozen->nodes, frozen->leaves, 0,               \
+                                     hashof(key), key);                              \
+    return leaf ? leaf->value : NULL;                                                \
+  }                                                                                  \
+                                                                                     \
+  /* ====== 32-bit tries ====== */                                                   \
+  /**                                                                                \
+   * A mutable hamt kept in the frozen layout: nodes are 8 byte records in           \
+   * one growable arena and refer to their children by 32-bit index, and             \
+   * only leaves carry a key and value. Updates copy the path from the               \
+   * root into new slots at the end of the arenas, and `hamt32_compact`              \
+   * later drops the slots nothing refers to any more. Since references              \
+   * are indices, the arenas can move when they grow.                                \
+   */ \
+  typedef struct name##_hamt32 {                                                     \
+    name##_hamt_frozen_node *nodes;                                                  \
+    name##_hamt_frozen_leaf *leaves;                                                 \
+    unsigned int node_count, node_capacity;                                          \
+    unsigned int leaf_count, leaf_capacity;                                          \
+    /* index of the root node, HAMT_NONE when empty */                               \
+    unsigned int root;                                                               \
+    /* arena sizes right after the last compaction */                                \
+    unsigned int compacted_nodes, compacted_leaves;                                  \
+    bool failed;                                                                     \
+  } name##_hamt32;                                                                   \
+                                                                                     \
+  name##_hamt32 *name##_hamt32_new() {                                               \
+    name##_hamt32 *hamt;                                                             \
+                                                                                     \
+    if ((hamt = (name##_hamt32 *)calloc(1, sizeof(name##_hamt32))) == NULL) {        \
+      fprintf(stderr, "Failed to allocate memory for hamt\n");                       \
+      return NULL;                                                                   \
+    }                                                                                \
+    hamt->root = HAMT_NONE;                                                          \
+    return hamt;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  void name##_hamt32_free(name##_hamt32 *hamt) {                                     \
+    free(hamt->nodes);                                                               \
+    free(hamt->leaves);                                                              \
+    free(hamt);                                                                      \
+  }                                                                                  \
+                                                                                     \
+  /* Reserve `n` adjacent node slots, returning the first */                         \
+  static unsigned int name##_hamt32_alloc_nodes(name##_hamt32 *hamt,                 \
+                                                unsigned int n) {                    \
+    unsigned int first = hamt->node_count;                                           \
+                                                                                     \
+    if (!hamt_grow((void **)&hamt->nodes, &hamt->node_capacity, first + (size_t)n,   \
+                   sizeof(name##_hamt_frozen_node))) {                               \
+      hamt->failed = true;                                                           \
+      return HAMT_NONE;                                                              \
+    }                                                                                \
+    hamt->node_count += n;                                                           \
+    return first;                                                                    \
+  }                                                                                  \
+                                                                                     \
+  static unsigned int name##_hamt32_alloc_leaves(name##_hamt32 *hamt,                \
+                                                 unsigned int n) {                   \
+    unsigned int first = hamt->leaf_count;                                           \
+                                                                                     \
+    if (!hamt_grow((void **)&hamt->leaves, &hamt->leaf_capacity, first + (size_t)n,  \
+                   sizeof(name##_hamt_frozen_leaf))) {                               \
+      hamt->failed = true;                                                           \
+      return HAMT_NONE;                                                              \
+    }                                                                                \
+    hamt->leaf_count += n;                                                           \
+    return first;                                                                    \
+  }                                                                                  \
+                                                                                     \
+  static name##_hamt_frozen_node name##_hamt32_create_leaf(                          \
+      name##_hamt32 *hamt, unsigned int hash, name *key, void *value) {              \
+    name##_hamt_frozen_node node = {.bitmap = 0, .first = HAMT_NONE};                \
+    unsigned int first = name##_hamt32_alloc_leaves(hamt, 1);                        \
+                                                                                     \
+    if (first != HAMT_NONE) {                                                        \
+      name##_hamt_frozen_leaf *leaf = &hamt->leaves[first];                          \
+      leaf->hash = hash;                                                             \
+      leaf->count = 1;                                                               \
+      leaf->key = key;                                                               \
+      leaf->value = value;                                                           \
+      node.first = first;                                                            \
+    }                                                                                \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Copy the `size` children of `node` into a new block, leaving a gap of           \
+   * `grow` slots at `pos` when growing and dropping slot `pos` when                 \
+   * shrinking. Returns the first slot of the new block.                             \
+   */ \
+  static unsigned int name##_hamt32_copy_children(name##_hamt32 *hamt,               \
+                                                  name##_hamt_frozen_node node,      \
+                                                  unsigned int pos, int grow) {      \
+    unsigned int size = name##_hamt_popcount(node.bitmap);                           \
+    unsigned int first = name##_hamt32_alloc_nodes(hamt, size + grow);               \
+    name##_hamt_frozen_node *from, *to;                                              \
+                                                                                     \
+    if (first == HAMT_NONE) {                                                        \
+      return HAMT_NONE;                                                              \
+    }                                                                                \
+    from = &hamt->nodes[node.first];                                                 \
+    to = &hamt->nodes[first];                                                        \
+    if (grow >= 0) {                                                                 \
+      memcpy(to, from, sizeof(name##_hamt_frozen_node) * pos);                       \
+      memcpy(to + pos + grow, from + pos,                                            \
+             sizeof(name##_hamt_frozen_node) * (size - pos));                        \
+    } else {                                                                         \
+      memcpy(to, from, sizeof(name##_hamt_frozen_node) * pos);                       \
+      memcpy(to + pos, from + pos + 1,                                               \
+             sizeof(name##_hamt_frozen_node) * (size - pos - 1));                    \
+    }                                                                                \
+    return first;                                                                    \
+  }                                                                                  \
+                                                                                     \
+  /* See `merge_leaves`, `h1` and `h2` must differ */                                \
+  static name##_hamt_frozen_node name##_hamt32_merge_leaves(                         \
+      name##_hamt32 *hamt, int depth, unsigned int h1,                               \
+      name##_hamt_frozen_node n1, unsigned int h2,                                   \
+      name##_hamt_frozen_node n2) {                                                  \
+    unsigned int sub_h1 = name##_hamt_get_frag(h1, depth);                           \
+    unsigned int sub_h2 = name##_hamt_get_frag(h2, depth);                           \
+    name##_hamt_frozen_node node = {                                                 \
+        .bitmap = name##_hamt_get_mask(sub_h1) | name##_hamt_get_mask(sub_h2),       \
+        .first = name##_hamt32_alloc_nodes(hamt, sub_h1 == sub_h2 ? 1 : 2)};         \
+                                                                                     \
+    if (node.first == HAMT_NONE) {                                                   \
+      return n1;                                                                     \
+    }                                                                                \
+    if (sub_h1 == sub_h2) {                                                          \
+      name##_hamt_frozen_node child =                                                \
+          name##_hamt32_merge_leaves(hamt, depth + 1, h1, n1, h2, n2);               \
+      hamt->nodes[node.first] = child;                                               \
+    } else {                                                                         \
+      hamt->nodes[node.first + (sub_h1 > sub_h2)] = n1;                              \
+      hamt->nodes[node.first + (sub_h1 < sub_h2)] = n2;                              \
+    }                                                                                \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  static name##_hamt_frozen_node name##_hamt32_insert(                               \
+      name##_hamt32 *hamt, name##_hamt_frozen_node node, unsigned int hash,          \
+      name *key, void *value, int depth) {                                           \
+    if (node.bitmap == 0) {                                                          \
+      unsigned int len = hamt->leaves[node.first].count;                             \
+      unsigned int other = hamt->leaves[node.first].hash;                            \
+                                                                                     \
+      if (other != hash) {                                                           \
+        name##_hamt_frozen_node leaf =                                               \
+            name##_hamt32_create_leaf(hamt, hash, key, value);                       \
+        if (hamt->failed) {                                                          \
+          return node;                                                               \
+        }                                                                            \
+        return name##_hamt32_merge_leaves(hamt, depth, other, node, hash, leaf);     \
+      }                                                                              \
+                                                                                     \
+      /* replace the key if it is there, append it otherwise */                      \
+      unsigned int i = 0;                                                            \
+      while (i < len && !equals(hamt->leaves[node.first + i].key, key)) {            \
+        i++;                                                                         \
+      }                                                                              \
+      unsigned int new_len = i < len ? len : len + 1;                                \
+      unsigned int first = name##_hamt32_alloc_leaves(hamt, new_len);                \
+      if (first == HAMT_NONE) {                                                      \
+        return node;                                                                 \
+      }                                                                              \
+      memcpy(&hamt->leaves[first], &hamt->leaves[node.first],                        \
+             sizeof(name##_hamt_frozen_leaf) * len);                                 \
+      hamt->leaves[first + i].hash = hash;                                           \
+      hamt->leaves[first + i].key = key;                                             \
+      hamt->leaves[first + i].value = value;                                         \
+      for (unsigned int j = 0; j < new_len; ++j) {                                   \
+        hamt->leaves[first + j].count = new_len - j;                                 \
+      }                                                                              \
+      node.first = first;                                                            \
+      return node;                                                                   \
+    }                                                                                \
+                                                                                     \
+    unsigned int frag = name##_hamt_get_frag(hash, depth);                           \
+    name##_hamt_bitmap mask = name##_hamt_get_mask(frag);                            \
+    unsigned int pos = name##_hamt_get_position(node.bitmap, frag);                  \
+    name##_hamt_frozen_node child;                                                   \
+    unsigned int first;                                                              \
+                                                                                     \
+    if (node.bitmap & mask) {                                                        \
+      child = name##_hamt32_insert(hamt, hamt->nodes[node.first + pos], hash, key,   \
+                                   value, depth + 1);                                \
+      if (hamt->failed ||                                                            \
+          (first = name##_hamt32_copy_children(hamt, node, pos, 0)) ==               \
+              HAMT_NONE) {                                                           \
+        return node;                                                                 \
+      }                                                                              \
+    } else {                                                                         \
+      child = name##_hamt32_create_leaf(hamt, hash, key, value);                     \
+      if (hamt->failed ||                                                            \
+          (first = name##_hamt32_copy_children(hamt, node, pos, 1)) ==               \
+              HAMT_NONE) {                                                           \
+        return node;                                                                 \
+      }                                                                              \
+      node.bitmap |= mask;                                                           \
+    }                                                                                \
+                                                                                     \
+    hamt->nodes[first + pos] = child;                                                \
+    node.first = first;                                                              \
+    return node;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Returns the node without `key`, with `first` set to HAMT_NONE when              \
+   * nothing is left. Collapses like `remove_node`.                                  \
+   */ \
+  static name##_hamt_frozen_node name##_hamt32_remove_node(                          \
+      name##_hamt32 *hamt, name##_hamt_frozen_node node, unsigned int hash,          \
+      name *key, int depth, bool *changed) {                                         \
+    name##_hamt_frozen_node empty = {.bitmap = 0, .first = HAMT_NONE};               \
+                                                                                     \
+    if (node.bitmap == 0) {                                                          \
+      unsigned int len = hamt->leaves[node.first].count;                             \
+      unsigned int i = 0;                                                            \
+                                                                                     \
+      if (hamt->leaves[node.first].hash != hash) {                                   \
+        return node;                                                                 \
+      }                                                                              \
+      while (i < len && !equals(hamt->leaves[node.first + i].key, key)) {            \
+        i++;                                                                         \
+      }                                                                              \
+      if (i == len) {                                                                \
+        return node;                                                                 \
+      }                                                                              \
+      *changed = true;                                                               \
+      if (len == 1) {                                                                \
+        return empty;                                                                \
+      }                                                                              \
                                                                                      \
-  typedef struct name##_hamt {                                                       \
-    name##_hamt_node *root;                                                          \
-  } name##_hamt;                                                                     \
+      unsigned int first = name##_hamt32_alloc_leaves(hamt, len - 1);                \
+      if (first == HAMT_NONE) {                                                      \
+        return node;                                                                 \
+      }                                                                              \
+      name##_hamt_frozen_leaf *from = &hamt->leaves[node.first];                     \
+      name##_hamt_frozen_leaf *to = &hamt->leaves[first];                            \
+      memcpy(to, from, sizeof(name##_hamt_frozen_leaf) * i);                         \
+      memcpy(to + i, from + i + 1,                                                   \
+             sizeof(name##_hamt_frozen_leaf) * (len - i - 1));                       \
+      for (unsigned int j = 0; j < len - 1; ++j) {                                   \
+        to[j].count = len - 1 - j;                                                   \
+      }                                                                              \
+      node.first = first;                                                            \
+      return node;                                                                   \
+    }                                                                                \
                                                                                      \
-  /*======= hashing =========================*/                                      \
-  /**                                                                                \
-   * From Ideal hash trees Phil Bagwell, page 3                                      \
-   * https://lampwww.epfl.ch/papers/idealhashtrees.pdf                               \
-   * Count number of bits in a number                                                \
-   */                                                                                \
-  static const unsigned int name##_hamt_SK5 = 0x55555555;                            \
-  static const unsigned int name##_hamt_SK3 = 0x33333333;                            \
-  static const unsigned int name##_hamt_SKF0 = 0xF0F0F0F;                            \
+    unsigned int frag = name##_hamt_get_frag(hash, depth);                           \
+    name##_hamt_bitmap mask = name##_hamt_get_mask(frag);                            \
+    if (!(node.bitmap & mask)) {                                                     \
+      return node;                                                                   \
+    }                                                                                \
                                                                                      \
-  static inline int name##_hamt_popcount(unsigned int bits) {                        \
-    bits -= ((bits >> 1) & name##_hamt_SK5);                                         \
-    bits = (bits & name##_hamt_SK3) + ((bits >> 2) & name##_hamt_SK3);               \
-    bits = (bits & name##_hamt_SKF0) + ((bits >> 4) & name##_hamt_SKF0);             \
-    bits += bits >> 8;                                                               \
-    return (bits + (bits >> 16)) & 0x3F;                                             \
+    unsigned int pos = name##_hamt_get_position(node.bitmap, frag);                  \
+    unsigned int size = name##_hamt_popcount(node.bitmap);                           \
+    name##_hamt_frozen_node child = name##_hamt32_remove_node(                       \
+        hamt, hamt->nodes[node.first + pos], hash, key, depth + 1, changed);         \
+    unsigned int first;                                                              \
+                                                                                     \
+    if (!*changed || hamt->failed) {                                                 \
+      return node;                                                                   \
+    }                                                                                \
+    if (child.first == HAMT_NONE) {                                                  \
+      if (size == 1) {                                                               \
+        return empty;                                                                \
+      }                                                                              \
+      /* Collapse the node */                                                        \
+      if (size == 2 && hamt->nodes[node.first + (pos ^ 1)].bitmap == 0) {            \
+        return hamt->nodes[node.first + (pos ^ 1)];                                  \
+      }                                                                              \
+      if ((first = name##_hamt32_copy_children(hamt, node, pos, -1)) ==              \
+          HAMT_NONE) {                                                               \
+        return node;                                                                 \
+      }                                                                              \
+      node.bitmap &= ~mask;                                                          \
+      node.first = first;                                                            \
+      return node;                                                                   \
+    }                                                                                \
+    if (size == 1 && child.bitmap == 0) {                                            \
+      return child;                                                                  \
+    }                                                                                \
+                                                                                     \
+    if ((first = name##_hamt32_copy_children(hamt, node, pos, 0)) == HAMT_NONE) {    \
+      return node;                                                                   \
+    }                                                                                \
+    hamt->nodes[first + pos] = child;                                                \
+    node.first = first;                                                              \
+    return node;                                                                     \
   }                                                                                  \
                                                                                      \
-  static inline unsigned int name##_hamt_get_mask(unsigned int frag) {               \
-    return 1 << frag;                                                                \
+  static void name##_hamt32_count(name##_hamt_frozen_node *nodes,                    \
+                                  name##_hamt_frozen_leaf *leaves,                   \
+                                  unsigned int at, size_t *node_count,               \
+                                  size_t *leaf_count) {                              \
+    name##_hamt_frozen_node node = nodes[at];                                        \
+                                                                                     \
+    (*node_count)++;                                                                 \
+    if (node.bitmap == 0) {                                                          \
+      *leaf_count += leaves[node.first].count;                                       \
+      return;                                                                        \
+    }                                                                                \
+    for (int i = 0; i < name##_hamt_popcount(node.bitmap); ++i) {                    \
+      name##_hamt32_count(nodes, leaves, node.first + i, node_count, leaf_count);    \
+    }                                                                                \
   }                                                                                  \
                                                                                      \
-  /* take 5 bits of the hash */                                                      \
-  static inline unsigned int name##_hamt_get_frag(unsigned int hash,                 \
-                                                  int depth) {                       \
-    return ((unsigned int)hash >> (BITS * depth)) & MASK;                            \
+  /**                                                                                \
+   * Copy what is reachable from `nodes[root]` breadth first into `to_nodes`         \
+   * and `to_leaves`, with the root ending up at index 0.                            \
+   */ \
+  static void name##_hamt32_relocate(                                                \
+      name##_hamt_frozen_node *nodes, name##_hamt_frozen_leaf *leaves,               \
+      unsigned int root, name##_hamt_frozen_node *to_nodes,                          \
+      name##_hamt_frozen_leaf *to_leaves) {                                          \
+    unsigned int tail = 1, leaf = 0;                                                 \
+                                                                                     \
+    to_nodes[0] = nodes[root];                                                       \
+    for (unsigned int i = 0; i < tail; ++i) {                                        \
+      name##_hamt_frozen_node *node = &to_nodes[i];                                  \
+                                                                                     \
+      if (node->bitmap == 0) {                                                       \
+        unsigned int len = leaves[node->first].count;                                \
+        memcpy(&to_leaves[leaf], &leaves[node->first],                               \
+               sizeof(name##_hamt_frozen_leaf) * len);                               \
+        node->first = leaf;                                                          \
+        leaf += len;                                                                 \
+      } else {                                                                       \
+        unsigned int size = name##_hamt_popcount(node->bitmap);                      \
+        memcpy(&to_nodes[tail], &nodes[node->first],                                 \
+               sizeof(name##_hamt_frozen_node) * size);                              \
+        node->first = tail;                                                          \
+        tail += size;                                                                \
+      }                                                                              \
+    }                                                                                \
   }                                                                                  \
                                                                                      \
   /**                                                                                \
-   * Get the position in the array where the child is located                        \
-   *                                                                                 \
-   */                                                                                \
-  static unsigned int name##_hamt_get_position(unsigned int hash,                    \
-                                               unsigned int frag) {                  \
-    return name##_hamt_popcount(hash & (name##_hamt_get_mask(frag) - 1));            \
+   * Move the live part of the arenas into new, exactly sized ones, laid             \
+   * out breadth first like a frozen hamt.                                           \
+   */ \
+  void name##_hamt32_compact(name##_hamt32 *hamt) {                                  \
+    size_t node_count = 0, leaf_count = 0;                                           \
+    name##_hamt_frozen_node *nodes;                                                  \
+    name##_hamt_frozen_leaf *leaves;                                                 \
+                                                                                     \
+    if (hamt->root != HAMT_NONE) {                                                   \
+      name##_hamt32_count(hamt->nodes, hamt->leaves, hamt->root, &node_count,        \
+                          &leaf_count);                                              \
+    }                                                                                \
+    if ((nodes = (name##_hamt_frozen_node *)malloc(                                  \
+             sizeof(name##_hamt_frozen_node) * (node_count + 1))) == NULL ||         \
+        (leaves = (name##_hamt_frozen_leaf *)malloc(                                 \
+             sizeof(name##_hamt_frozen_leaf) * (leaf_count + 1))) == NULL) {         \
+      fprintf(stderr, "Failed to allocate memory for compaction\n");                 \
+      free(nodes);                                                                   \
+      return;                                                                        \
+    }                                                                                \
+                                                                                     \
+    if (hamt->root != HAMT_NONE) {                                                   \
+      name##_hamt32_relocate(hamt->nodes, hamt->leaves, hamt->root, nodes, leaves);  \
+      hamt->root = 0;                                                                \
+    }                                                                                \
+    free(hamt->nodes);                                                               \
+    free(hamt->leaves);                                                              \
+    hamt->nodes = nodes;                                                             \
+    hamt->leaves = leaves;                                                           \
+    hamt->node_count = hamt->compacted_nodes = node_count;                           \
+    hamt->leaf_count = hamt->compacted_leaves = leaf_count;                          \
+    hamt->node_capacity = node_count + 1;                                            \
+    hamt->leaf_capacity = leaf_count + 1;                                            \
   }                                                                                  \
                                                                                      \
-  name##_hamt *name##_hamt_new() {                                                   \
-    name##_hamt *hamt;                                                               \
+  /* Compact once three quarters of either arena is garbage */                       \
+  static void name##_hamt32_set_root(name##_hamt32 *hamt,                            \
+                                     name##_hamt_frozen_node root) {                 \
+    unsigned int at;                                                                 \
                                                                                      \
-    if ((hamt = (name##_hamt *)malloc(sizeof(name##_hamt))) == NULL) {               \
-      fprintf(stderr, "Failed to allocate memory for hamt\n");                       \
+    if (root.first == HAMT_NONE) {                                                   \
+      hamt->root = HAMT_NONE;                                                        \
+    } else if ((at = name##_hamt32_alloc_nodes(hamt, 1)) != HAMT_NONE) {             \
+      hamt->nodes[at] = root;                                                        \
+      hamt->root = at;                                                               \
+    }                                                                                \
+    if (hamt->node_count > 4 * (size_t)hamt->compacted_nodes + 4096 ||               \
+        hamt->leaf_count > 4 * (size_t)hamt->compacted_leaves + 4096) {              \
+      name##_hamt32_compact(hamt);                                                   \
     }                                                                                \
+  }                                                                                  \
                                                                                      \
-    hamt->root = NULL;                                                               \
+  name##_hamt32 *name##_hamt32_set(name##_hamt32 *hamt, name *key, void *value) {    \
+    unsigned int hash = hashof(key);                                                 \
+    name##_hamt_frozen_node root;                                                    \
+                                                                                     \
+    hamt->failed = false;                                                            \
+    if (hamt->root == HAMT_NONE) {                                                   \
+      root = name##_hamt32_create_leaf(hamt, hash, key, value);                      \
+    } else {                                                                         \
+      root = name##_hamt32_insert(hamt, hamt->nodes[hamt->root], hash, key, value,   \
+                                  0);                                                \
+    }                                                                                \
+    if (!hamt->failed) {                                                             \
+      name##_hamt32_set_root(hamt, root);                                            \
+    }                                                                                \
     return hamt;                                                                     \
   }                                                                                  \
-  /* Insertion methods  */                                                           \
-  typedef struct name##_hamt_insert_instruction_t {                                  \
-    name##_hamt_node *node;                                                          \
-    unsigned int hash;                                                               \
-    name *key;                                                                       \
-    void *value;                                                                     \
-    int depth;                                                                       \
-  } name##_hamt_insert_instruction_t;                                                \
-                                                                                     \
-  static name##_hamt_node *name##_hamt_handle_collision_insert(                      \
-      name##_hamt_insert_instruction_t *ins);                                        \
-  static name##_hamt_node *name##_hamt_handle_branch_insert(                         \
-      name##_hamt_insert_instruction_t *ins);                                        \
-  static name##_hamt_node *name##_hamt_handle_leaf_insert(                           \
-      name##_hamt_insert_instruction_t *ins);                                        \
-  static name##_hamt_node *name##_hamt_handle_arraynode_insert(                      \
-      name##_hamt_insert_instruction_t *ins);                                        \
-                                                                                     \
-  /* Removal methods */                                                              \
-  typedef struct name##_hamt_removal_t {                                             \
-    name##_hamt_node *node;                                                          \
-    unsigned int hash;                                                               \
-    name *key;                                                                       \
-    int depth;                                                                       \
-  } name##_hamt_removal_t;                                                           \
                                                                                      \
-  static name##_hamt_node *name##_hamt_handle_collision_removal(                     \
-      name##_hamt_removal_t *rem);                                                   \
-  static name##_hamt_node *name##_hamt_handle_branch_removal(                        \
-      name##_hamt_removal_t *rem);                                                   \
-  static name##_hamt_node *name##_hamt_handle_leaf_removal(                          \
-      name##_hamt_removal_t *rem);                                                   \
-  static name##_hamt_node *name##_hamt_handle_arraynode_removal(                     \
-      name##_hamt_removal_t *rem);                                                   \
-                                                                                     \
-  /*======= node constructors =====================*/                                \
-  static name##_hamt_node *name##_hamt_create_node(                                  \
-      int hash, name *key, void *value, enum NODE_TYPE type,                         \
-      name##_hamt_node **children, unsigned long bitmap) {                           \
-    name##_hamt_node *node;                                                          \
+  void *name##_hamt32_get(name##_hamt32 *hamt, name *key) {                          \
+    name##_hamt_frozen_leaf *leaf;                                                   \
                                                                                      \
-    if ((node = (name##_hamt_node *)malloc(sizeof(name##_hamt_node))) ==             \
-        NULL) {                                                                      \
-      fprintf(stderr, "failed to allocate memory for node\n");                       \
+    if (hamt->root == HAMT_NONE) {                                                   \
       return NULL;                                                                   \
     }                                                                                \
+    leaf = name##_hamt_frozen_lookup(hamt->nodes, hamt->leaves, hamt->root,          \
+                                     hashof(key), key);                              \
+    return leaf ? leaf->value : NULL;                                                \
+  }                                                                                  \
                                                                                      \
-    node->hash = hash;                                                               \
-    node->type = type;                                                               \
-    node->key = key;                                                                 \
-    node->value = value;                                                             \
-    node->children = children;                                                       \
-    node->bitmap = bitmap;                                                           \
+  name##_hamt32 *name##_hamt32_remove(name##_hamt32 *hamt, name *key) {              \
+    bool changed = false;                                                            \
+    name##_hamt_frozen_node root;                                                    \
                                                                                      \
-    return node;                                                                     \
+    if (hamt->root == HAMT_NONE) {                                                   \
+      return hamt;                                                                   \
+    }                                                                                \
+    hamt->failed = false;                                                            \
+    root = name##_hamt32_remove_node(hamt, hamt->nodes[hamt->root], hashof(key),     \
+                                     key, 0, &changed);                              \
+    if (changed && !hamt->failed) {                                                  \
+      name##_hamt32_set_root(hamt, root);                                            \
+    }                                                                                \
+    return hamt;                                                                     \
   }                                                                                  \
                                                                                      \
-  static name##_hamt_node *name##_hamt_create_leaf(unsigned int hash,                \
-                                                   name *key, void *value) {         \
-    return name##_hamt_create_node(hash, key, value, LEAF, NULL, 0);                 \
+  /* Copy a 32-bit hamt into a single block, see `freeze` */                         \
+  name##_hamt_frozen *name##_hamt32_freeze(name##_hamt32 *hamt) {                    \
+    size_t node_count = 0, leaf_count = 0;                                           \
+    name##_hamt_frozen *frozen;                                                      \
+                                                                                     \
+    if (hamt->root != HAMT_NONE) {                                                   \
+      name##_hamt32_count(hamt->nodes, hamt->leaves, hamt->root, &node_count,        \
+                          &leaf_count);                                              \
+    }                                                                                \
+    size_t size = sizeof(name##_hamt_frozen) +                                       \
+                  sizeof(name##_hamt_frozen_node) * node_count +                     \
+                  sizeof(name##_hamt_frozen_leaf) * leaf_count;                      \
+    if ((frozen = (name##_hamt_frozen *)malloc(size)) == NULL) {                     \
+      fprintf(stderr, "Failed to allocate memory for frozen hamt\n");                \
+      return NULL;                                                                   \
+    }                                                                                \
+                                                                                     \
+    frozen->size = size;                                                             \
+    frozen->node_count = node_count;                                                 \
+    frozen->leaf_count = leaf_count;                                                 \
+    frozen->nodes = (name##_hamt_frozen_node *)(frozen + 1);                         \
+    frozen->leaves = (name##_hamt_frozen_leaf *)(frozen->nodes + node_count);        \
+    if (hamt->root != HAMT_NONE) {                                                   \
+      name##_hamt32_relocate(hamt->nodes, hamt->leaves, hamt->root, frozen->nodes,   \
+                             frozen->leaves);                                        \
+    }                                                                                \
+    return frozen;                                                                   \
   }                                                                                  \
                                                                                      \
-  static name##_hamt_node *name##_hamt_create_collision(                             \
-      unsigned int hash, name##_hamt_node **children, int bitmap) {                  \
-    return name##_hamt_create_node(hash, NULL, NULL, COLLISION, children,            \
-                                   bitmap);                                          \
+  /* Start a 32-bit hamt from a frozen one, e.g. one made by `freeze` */             \
+  name##_hamt32 *name##_hamt32_from_frozen(name##_hamt_frozen *frozen) {             \
+    name##_hamt32 *hamt = name##_hamt32_new();                                       \
+                                                                                     \
+    if (hamt == NULL || frozen->node_count == 0) {                                   \
+      return hamt;                                                                   \
+    }                                                                                \
+    if (name##_hamt32_alloc_nodes(hamt, frozen->node_count) == HAMT_NONE ||          \
+        name##_hamt32_alloc_leaves(hamt, frozen->leaf_count) == HAMT_NONE) {         \
+      name##_hamt32_free(hamt);                                                      \
+      return NULL;                                                                   \
+    }                                                                                \
+    memcpy(hamt->nodes, frozen->nodes,                                               \
+           sizeof(name##_hamt_frozen_node) * frozen->node_count);                    \
+    memcpy(hamt->leaves, frozen->leaves,                                             \
+           sizeof(name##_hamt_frozen_leaf) * frozen->leaf_count);                    \
+    hamt->root = 0;                                                                  \
+    hamt->compacted_nodes = frozen->node_count;                                      \
+    hamt->compacted_leaves = frozen->leaf_count;                                     \
+    return hamt;                                                                     \
   }                                                                                  \
                                                                                      \
-  static name##_hamt_node *name##_hamt_create_branch(                                \
-      unsigned int hash, name##_hamt_node **children) {                              \
-    return name##_hamt_create_node(hash, NULL, NULL, BRANCH, children, 0);           \
+  /* ====== Filters ====== */                                                        \
+  static void name##_hamt_filter_fill(hamt_filter *filter,                           \
+                                      name##_hamt_node *node) {                      \
+    if (node == NULL) {                                                              \
+      return;                                                                        \
+    }                                                                                \
+    switch (node->type) {                                                            \
+    case LEAF:                                                                       \
+      hamt_filter_add(filter, node->hash);                                           \
+      return;                                                                        \
+    case COLLISION:                                                                  \
+      for (int i = 0; i < node->bitmap; ++i) {                                       \
+        hamt_filter_add(filter, node->hash);                                         \
+      }                                                                              \
+      return;                                                                        \
+    case BRANCH:                                                                     \
+      for (int i = 0; i < name##_hamt_popcount(node->hash); ++i) {                   \
+        name##_hamt_filter_fill(filter, node->children[i]);                          \
+      }                                                                              \
+      return;                                                                        \
+    case ARRAY_NODE:                                                                 \
+      for (int i = 0; i < name##_hamt_SIZE; ++i) {                                   \
+        name##_hamt_filter_fill(filter, node->children[i]);                          \
+      }                                                                              \
+      return;                                                                        \
+    }                                                                                \
   }                                                                                  \
                                                                                      \
-  /* again, bitmap is size  */                                                       \
-  static name##_hamt_node *name##_hamt_create_arraynode(                             \
-      name##_hamt_node **children, unsigned int bitmap) {                            \
-    return name##_hamt_create_node(0, NULL, NULL, ARRAY_NODE, children,              \
-                                   bitmap);                                          \
+  /**                                                                                \
+   * (Re)build the filter of `hamt` from its current keys, sized for at              \
+   * least `capacity` keys and twice the keys it holds now. Returns false,           \
+   * keeping the filter it had, if memory runs out.                                  \
+   */ \
+  bool name##_hamt_enable_filter(name##_hamt *hamt, size_t capacity) {               \
+    size_t nodes = 0, keys = 0;                                                      \
+    hamt_filter *filter;                                                             \
+                                                                                     \
+    name##_hamt_frozen_count(hamt->root, &nodes, &keys);                             \
+    if (capacity < keys * 2) {                                                       \
+      capacity = keys * 2;                                                           \
+    }                                                                                \
+    if ((filter = hamt_filter_new(capacity)) == NULL) {                              \
+      return false;                                                                  \
+    }                                                                                \
+    name##_hamt_filter_fill(filter, hamt->root);                                     \
+    hamt_filter_free(hamt->filter);                                                  \
+    hamt->filter = filter;                                                           \
+    return true;                                                                     \
   }                                                                                  \
                                                                                      \
-  static bool name##_hamt_is_leaf(name##_hamt_node *node) {                          \
-    return node != NULL && (node->type == LEAF || node->type == COLLISION);          \
+  void name##_hamt_disable_filter(name##_hamt *hamt) {                               \
+    hamt_filter_free(hamt->filter);                                                  \
+    hamt->filter = NULL;                                                             \
   }                                                                                  \
                                                                                      \
-  /*======= Allocators ==============*/                                              \
-  /* Assign `n` number of children, at least `CAPACITY` in size */                   \
-  static name##_hamt_node **name##_hamt_alloc_children(int size) {                   \
-    name##_hamt_node **children;                                                     \
+  /* ====== Front caches ====== */                                                   \
+  /**                                                                                \
+   * Put a cache of `sets` times `HAMT_CACHE_WAYS` recently found keys in            \
+   * front of `hamt`. Not safe to call while other threads are reading.              \
+   */ \
+  void name##_hamt_enable_cache(name##_hamt *hamt, size_t sets) {                    \
+    hamt_cache *cache = hamt_cache_new(sets);                                        \
                                                                                      \
-    if ((children = (name##_hamt_node **)calloc(sizeof(name##_hamt_node *),          \
-                                                size)) == NULL) {                    \
-      fprintf(stderr, "Failed to allocate memory for children");                     \
-      return NULL;                                                                   \
+    if (cache != NULL) {                                                             \
+      hamt_cache_free(hamt->cache);                                                  \
+      hamt->cache = cache;                                                           \
     }                                                                                \
+  }                                                                                  \
                                                                                      \
-    return children;                                                                 \
+  void name##_hamt_disable_cache(name##_hamt *hamt) {                                \
+    hamt_cache_free(hamt->cache);                                                    \
+    hamt->cache = NULL;                                                              \
+  }                                                                                  \
+                                                                                     \
+  /* ====== Scanning ====== */                                                       \
+  typedef void (*name##_hamt_scan_fn)(name *key, void *value, void *ctx);            \
+                                                                                     \
+  /* step between neighbouring positions in trie order */                            \
+  static const unsigned long long name##_hamt_SCAN_STEP =                            \
+      1ULL << (64 - name##_hamt_BITS * name##_hamt_MAX_DEPTH);                       \
+                                                                                     \
+  /**                                                                                \
+   * Position of `hash` in trie order, with the fragment of depth 0 in the           \
+   * top bits, then depth 1 and so on. This order doesn't depend on how              \
+   * the trie is shaped at the moment, so it survives any `set` or                   \
+   * `remove` made in between.                                                       \
+   */ \
+  static inline unsigned long long name##_hamt_scan_order(unsigned int hash) {       \
+    unsigned long long order = 0;                                                    \
+                                                                                     \
+    for (int depth = 0; depth < name##_hamt_MAX_DEPTH; ++depth) {                    \
+      order |= (unsigned long long)name##_hamt_get_frag(hash, depth)                 \
+               << (64 - name##_hamt_BITS * (depth + 1));                             \
+    }                                                                                \
+    return order;                                                                    \
   }                                                                                  \
                                                                                      \
-  /*======= moving / inserting child nodes ==============*/                          \
   /**                                                                                \
-   * Insert child at given position                                                  \
-   */                                                                                \
-  static inline void name##_hamt_insert_child(                                       \
-      name##_hamt_node *parent, name##_hamt_node *child,                             \
-      unsigned int position, unsigned int size) {                                    \
-    name##_hamt_node *temp[sizeof(name##_hamt_node *) * size];                       \
+   * Hand the entries of `node` at or after `cursor` to `fn` in trie                 \
+   * order. `bounded` is set while `node` lies on the path of the cursor.            \
+   * Returns false once `*left` runs out, with `*next` set to where the              \
+   * next slice starts.                                                              \
+   */ \
+  static bool name##_hamt_scan_node(name##_hamt_node *node, int depth,               \
+                                    unsigned long long cursor, bool bounded,         \
+                                    size_t *left, unsigned long long *next,          \
+                                    name##_hamt_scan_fn fn, void *ctx) {             \
+    switch (node->type) {                                                            \
+    case LEAF:                                                                       \
+    case COLLISION: {                                                                \
+      unsigned long long order = name##_hamt_scan_order(node->hash);                 \
+      size_t count = node->type == LEAF ? 1 : (size_t)node->bitmap;                  \
                                                                                      \
-    unsigned int i = 0, j = 0;                                                       \
+      if (order < cursor) {                                                          \
+        return true;                                                                 \
+      }                                                                              \
+      if (node->type == LEAF) {                                                      \
+        fn(node->key, node->value, ctx);                                             \
+      } else {                                                                       \
+        for (int i = 0; i < node->bitmap; ++i) {                                     \
+          fn(node->children[i]->key, node->children[i]->value, ctx);                 \
+        }                                                                            \
+      }                                                                              \
+      if (count >= *left) {                                                          \
+        *left = 0;                                                                   \
+        /* wraps to 0 after the last position, which also means done */              \
+        *next = order + name##_hamt_SCAN_STEP;                                       \
+        return false;                                                                \
+      }                                                                              \
+      *left -= count;                                                                \
+      return true;                                                                   \
+    }                                                                                \
+                                                                                     \
+    case BRANCH:                                                                     \
+    case ARRAY_NODE: {                                                               \
+      unsigned int from =                                                            \
+          bounded ? (cursor >> (64 - name##_hamt_BITS * (depth + 1))) &              \
+                        name##_hamt_MASK                                             \
+                  : 0;                                                               \
                                                                                      \
-    while (j < position) {                                                           \
-      temp[i++] = parent->children[j++];                                             \
+      for (unsigned int frag = from; frag < name##_hamt_SIZE; ++frag) {              \
+        name##_hamt_node *child = NULL;                                              \
+                                                                                     \
+        if (node->type == ARRAY_NODE) {                                              \
+          child = node->children[frag];                                              \
+        } else if (node->hash & name##_hamt_get_mask(frag)) {                        \
+          child = node->children[name##_hamt_get_position(node->hash, frag)];        \
+        }                                                                            \
+        if (child != NULL &&                                                         \
+            !name##_hamt_scan_node(child, depth + 1, cursor,                         \
+                                   bounded && frag == from, left, next, fn,          \
+                                   ctx)) {                                           \
+          return false;                                                              \
+        }                                                                            \
+      }                                                                              \
+      return true;                                                                   \
     }                                                                                \
-    temp[i++] = child;                                                               \
-    while (j < size) {                                                               \
-      temp[i++] = parent->children[j++];                                             \
     }                                                                                \
-    memcpy(parent->children, temp, sizeof(name##_hamt_node *) * (size + 1));         \
+    return true;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Walk `hamt` a slice at a time, like Redis SCAN. Pass 0 to start and             \
+   * then whatever the previous call returned, until it returns 0 again.             \
+   * Each call hands about `max_items` entries to `fn`. Keys sharing a               \
+   * hash are never split, so a slice can hold a few more.                           \
+   *                                                                                 \
+   * The cursor is a position in hash order rather than a reference into             \
+   * the trie, so `set` and `remove` are fine between calls: a key present           \
+   * for the whole scan is handed out exactly once. Keys added or removed            \
+   * meanwhile may or may not be. The trie must not change during a call,            \
+   * including from `fn`.                                                            \
+   */ \
+  unsigned long long name##_hamt_scan(name##_hamt *hamt,                             \
+                                      unsigned long long cursor,                     \
+                                      size_t max_items, name##_hamt_scan_fn fn,      \
+                                      void *ctx) {                                   \
+    size_t left = max_items > 0 ? max_items : 1;                                     \
+    unsigned long long next = 0;                                                     \
+                                                                                     \
+    if (hamt->root != NULL) {                                                        \
+      name##_hamt_scan_node(hamt->root, 0, cursor, true, &left, &next, fn, ctx);     \
+    }                                                                                \
+    return next;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /* ====== Counting ====== */                                                       \
+  /* Number of entries, kept up to date by every change */                           \
+  size_t name##_hamt_size(name##_hamt *hamt) {                                       \
+    return name##_hamt_subtree_size(hamt->root);                                     \
   }                                                                                  \
                                                                                      \
   /**                                                                                \
-   * Remove child                                                                    \
-   */                                                                                \
-  static inline void name##_hamt_remove_child(                                       \
-      name##_hamt_node *parent, unsigned int position, unsigned int size) {          \
-    int arr_size = sizeof(name##_hamt_node *) * (size - 1);                          \
-    name##_hamt_node **new_children = name##_hamt_alloc_children(arr_size);          \
+   * The entry at `index` in trie order, the order `scan` hands them out             \
+   * in, found by skipping whole subtrees by their size. Returns false if            \
+   * there are no more than `index` entries.                                         \
+   */ \
+  bool name##_hamt_nth(name##_hamt *hamt, size_t index, name **key,                  \
+                       void **value) {                                               \
+    name##_hamt_node *node = hamt->root;                                             \
                                                                                      \
-    unsigned int i = 0, j = 0;                                                       \
+    if (index >= name##_hamt_subtree_size(node)) {                                   \
+      return false;                                                                  \
+    }                                                                                \
+    while (node->type == BRANCH || node->type == ARRAY_NODE) {                       \
+      unsigned int slots = name##_hamt_slots(node);                                  \
+      unsigned int i = 0;                                                            \
+                                                                                     \
+      for (;; ++i) {                                                                 \
+        size_t size = name##_hamt_subtree_size(node->children[i]);                   \
                                                                                      \
-    while (j < position) {                                                           \
-      new_children[i++] = parent->children[j++];                                     \
+        if (index < size || i + 1 == slots) {                                        \
+          break;                                                                     \
+        }                                                                            \
+        index -= size;                                                               \
+      }                                                                              \
+      node = node->children[i];                                                      \
     }                                                                                \
-    j++;                                                                             \
-    while (j < size) {                                                               \
-      new_children[i++] = parent->children[j++];                                     \
+    if (node->type == COLLISION) {                                                   \
+      node = node->children[index];                                                  \
+    }                                                                                \
+    *key = node->key;                                                                \
+    *value = node->value;                                                            \
+    return true;                                                                     \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Pick `k` entries uniformly at random, with replacement, into `keys`             \
+   * and `values`. `rng` is the caller's splitmix64 state, seeded with               \
+   * anything. Returns the number picked, which is 0 for an empty hamt.              \
+   * Enough to evict like Redis does, by sampling a few keys and dropping            \
+   * the oldest of them, without a full scan.                                        \
+   */ \
+  size_t name##_hamt_sample(name##_hamt *hamt, unsigned long long *rng,              \
+                            size_t k, name **keys, void **values) {                  \
+    size_t size = name##_hamt_size(hamt);                                            \
+                                                                                     \
+    if (size == 0) {                                                                 \
+      return 0;                                                                      \
     }                                                                                \
+    for (size_t i = 0; i < k; ++i) {                                                 \
+      unsigned long long r = (*rng += 0x9E3779B97F4A7C15ULL);                        \
                                                                                      \
-    parent->children = new_children;                                                 \
+      r = (r ^ (r >> 30)) * 0xBF58476D1CE4E5B9ULL;                                   \
+      r = (r ^ (r >> 27)) * 0x94D049BB133111EBULL;                                   \
+      r ^= r >> 31;                                                                  \
+      name##_hamt_nth(hamt, (size_t)(r % size), &keys[i], &values[i]);               \
+    }                                                                                \
+    return k;                                                                        \
   }                                                                                  \
                                                                                      \
+  /* ====== Deriving tries ====== */                                                 \
   /**                                                                                \
-   * Replace child                                                                   \
-   */                                                                                \
-  static inline void name##_hamt_replace_child(name##_hamt_node *node,               \
-                                               name##_hamt_node *child,              \
-                                               unsigned int position) {              \
-    node->children[position] = child;                                                \
+   * Decide whether an entry stays, or give its new value. Called from               \
+   * several threads at once.                                                        \
+   */ \
+  typedef bool (*name##_hamt_keep_fn)(name *key, void *value, void *ctx);            \
+  typedef void *(*name##_hamt_map_fn)(name *key, void *value, void *ctx);            \
+                                                                                     \
+  typedef struct name##_hamt_derive_t {                                              \
+    /* the hamt being built, which holds the new nodes alone */                      \
+    name##_hamt *derived;                                                            \
+    name##_hamt_node *root;                                                          \
+    name##_hamt_node **results;                                                      \
+    name##_hamt_keep_fn keep;                                                        \
+    name##_hamt_map_fn map;                                                          \
+    void *ctx;                                                                       \
+    atomic_bool failed;                                                              \
+  } name##_hamt_derive_t;                                                            \
+                                                                                     \
+  static name##_hamt_node *name##_hamt_derive_leaf(name##_hamt_derive_t *derive,     \
+                                                   name##_hamt_node *leaf) {         \
+    name##_hamt_node *copy;                                                          \
+    void *value;                                                                     \
+                                                                                     \
+    if (derive->keep != NULL) {                                                      \
+      return derive->keep(leaf->key, leaf->value, derive->ctx) ? leaf : NULL;        \
+    }                                                                                \
+    if ((value = derive->map(leaf->key, leaf->value, derive->ctx)) ==                \
+        leaf->value) {                                                               \
+      return leaf;                                                                   \
+    }                                                                                \
+    if ((copy = name##_hamt_create_leaf(leaf->hash, leaf->key, value)) == NULL) {    \
+      atomic_store(&derive->failed, true);                                           \
+    }                                                                                \
+    return copy;                                                                     \
   }                                                                                  \
                                                                                      \
   /**                                                                                \
-   * Function is just to split out the other methods                                 \
-   * This is an atempt at polymorphism                                               \
-   */                                                                                \
-  static name##_hamt_node *name##_hamt_insert(name##_hamt_node *node,                \
-                                              unsigned int hash, name *key,          \
-                                              void *value, int depth) {              \
+   * The node holding `results`, the derived children of `node`. That is             \
+   * `node` itself when none of them changed, and NULL when none are                 \
+   * left. A lone leaf or collision takes the place of its parent, as it             \
+   * would after `remove`. New Branches and ArrayNodes are sized the way             \
+   * `from_array` sizes them.                                                        \
+   */ \
+  static name##_hamt_node *name##_hamt_derive_join(name##_hamt_derive_t *derive,     \
+                                                   name##_hamt_node *node,           \
+                                                   name##_hamt_node **results) {     \
+    unsigned int slots = name##_hamt_slots(node);                                    \
+    unsigned int count = 0, size = 0, pos = 0;                                       \
+    unsigned long long content = 0;                                                  \
+    name##_hamt_node *last = NULL, *joined;                                          \
+    bool changed = false;                                                            \
                                                                                      \
-    name##_hamt_insert_instruction_t ins = {.node = node,                            \
-                                            .key = key,                              \
-                                            .hash = hash,                            \
-                                            .value = value,                          \
-                                            .depth = depth};                         \
+    for (unsigned int i = 0; i < slots; ++i) {                                       \
+      changed |= results[i] != node->children[i];                                    \
+      if (results[i] != NULL) {                                                      \
+        count++;                                                                     \
+        size += name##_hamt_subtree_size(results[i]);                                \
+        content += name##_hamt_content(results[i]);                                  \
+        last = results[i];                                                           \
+      }                                                                              \
+    }                                                                                \
+    if (!changed || count == 0) {                                                    \
+      return changed ? NULL : node;                                                  \
+    }                                                                                \
+    if (count == 1 && name##_hamt_is_leaf(last)) {                                   \
+      return last;                                                                   \
+    }                                                                                \
                                                                                      \
-    switch (node->type) {                                                            \
-    case LEAF:                                                                       \
-      return name##_hamt_handle_leaf_insert(&ins);                                   \
-    case BRANCH:                                                                     \
-      return name##_hamt_handle_branch_insert(&ins);                                 \
-    case COLLISION:                                                                  \
-      return name##_hamt_handle_collision_insert(&ins);                              \
-    case ARRAY_NODE:                                                                 \
-      return name##_hamt_handle_arraynode_insert(&ins);                              \
-    default:                                                                         \
+    if (node->type == COLLISION) {                                                   \
+      joined = name##_hamt_alloc_collision(node->hash, count, count);                \
+    } else if (count > name##_hamt_MAX_BRANCH_SIZE) {                                \
+      joined = name##_hamt_alloc_node(ARRAY_NODE, 0, count, name##_hamt_SIZE);       \
+    } else {                                                                         \
+      joined = name##_hamt_alloc_node(BRANCH, 0, 0, count);                          \
+    }                                                                                \
+    if (joined == NULL) {                                                            \
+      atomic_store(&derive->failed, true);                                           \
+      for (unsigned int i = 0; i < slots; ++i) {                                     \
+        if (results[i] != NULL) {                                                    \
+          name##_hamt_free_nodes(derive->derived, results[i]);                       \
+        }                                                                            \
+      }                                                                              \
+      return NULL;                                                                   \
+    }                                                                                \
+    joined->content = content;                                                       \
+    if (node->type == COLLISION) {                                                   \
+      for (unsigned int i = 0; i < slots; ++i) {                                     \
+        if (results[i] != NULL) {                                                    \
+          joined->children[pos++] = results[i];                                      \
+        }                                                                            \
+      }                                                                              \
+      name##_hamt_fingerprint_from(joined, 0);                                       \
+      return joined;                                                                 \
+    }                                                                                \
+    joined->size = size;                                                             \
+    for (unsigned int frag = 0, i = 0; frag < name##_hamt_SIZE; ++frag) {            \
+      name##_hamt_node *child = NULL;                                                \
+                                                                                     \
+      if (node->type == ARRAY_NODE ||                                                \
+          (node->hash & name##_hamt_get_mask(frag)) != 0) {                          \
+        child = results[i++];                                                        \
+      }                                                                              \
+      if (joined->type == ARRAY_NODE) {                                              \
+        joined->children[frag] = child;                                              \
+      } else if (child != NULL) {                                                    \
+        joined->children[pos++] = child;                                             \
+        joined->hash |= name##_hamt_get_mask(frag);                                  \
+      }                                                                              \
+    }                                                                                \
+    return joined;                                                                   \
+  }                                                                                  \
+                                                                                     \
+  static name##_hamt_node *name##_hamt_derive_node(name##_hamt_derive_t *derive,     \
+                                                   name##_hamt_node *node) {         \
+    unsigned int slots = name##_hamt_slots(node);                                    \
+    name##_hamt_node *stack[name##_hamt_SIZE];                                       \
+    name##_hamt_node **results = stack;                                              \
+    name##_hamt_node *joined;                                                        \
+                                                                                     \
+    if (node->type == LEAF) {                                                        \
+      return name##_hamt_derive_leaf(derive, node);                                  \
+    }                                                                                \
+    /* only collisions outgrow the stack */                                          \
+    if (slots > name##_hamt_SIZE &&                                                  \
+        (results = (name##_hamt_node **)malloc(sizeof(name##_hamt_node *) *          \
+                                               slots)) == NULL) {                    \
+      fprintf(stderr, "Failed to allocate memory for children\n");                   \
+      atomic_store(&derive->failed, true);                                           \
       return NULL;                                                                   \
     }                                                                                \
+    for (unsigned int i = 0; i < slots; ++i) {                                       \
+      results[i] = node->children[i] != NULL                                         \
+                       ? name##_hamt_derive_node(derive, node->children[i])          \
+                       : NULL;                                                       \
+    }                                                                                \
+    joined = name##_hamt_derive_join(derive, node, results);                         \
+    if (results != stack) {                                                          \
+      free(results);                                                                 \
+    }                                                                                \
+    return joined;                                                                   \
+  }                                                                                  \
+                                                                                     \
+  /* Derive the subtree under one child of the root */                               \
+  static void name##_hamt_derive_task(void *arg, size_t i) {                         \
+    name##_hamt_derive_t *derive = (name##_hamt_derive_t *)arg;                      \
+    name##_hamt_node *child = derive->root->children[i];                             \
+                                                                                     \
+    derive->results[i] =                                                             \
+        child != NULL ? name##_hamt_derive_node(derive, child) : NULL;               \
   }                                                                                  \
                                                                                      \
   /**                                                                                \
-   * If the hashes clash create a new collision node                                 \
-   *                                                                                 \
-   * If the partial hashes are the same recurse                                      \
-   *                                                                                 \
-   * Otherwise create a new Branch with the new hash                                 \
-   */                                                                                \
-  static inline name##_hamt_node *name##_hamt_merge_leaves(                          \
-      unsigned int depth, unsigned int h1, name##_hamt_node *n1,                     \
-      unsigned int h2, name##_hamt_node *n2) {                                       \
-    name##_hamt_node **new_children = NULL;                                          \
+   * From now on `a` and `b` may hold the same nodes. Both start a new               \
+   * epoch, so neither changes or frees a node it held until then.                   \
+   */ \
+  static void name##_hamt_share(name##_hamt *a, name##_hamt *b) {                    \
+    unsigned long long epoch = atomic_fetch_add(&name##_hamt_epochs, 1) + 1;         \
                                                                                      \
-    if (h1 == h2) {                                                                  \
-      new_children = name##_hamt_alloc_children(MIN_COLLISION_NODE_SIZE);            \
-      new_children[0] = n2;                                                          \
-      new_children[1] = n1;                                                          \
-      return name##_hamt_create_collision(h1, new_children, 2);                      \
-    }                                                                                \
+    a->epoch = epoch;                                                                \
+    b->epoch = epoch;                                                                \
+  }                                                                                  \
                                                                                      \
-    unsigned int sub_h1 = name##_hamt_get_frag(h1, depth);                           \
-    unsigned int sub_h2 = name##_hamt_get_frag(h2, depth);                           \
-    unsigned int new_hash =                                                          \
-        name##_hamt_get_mask(sub_h1) | name##_hamt_get_mask(sub_h2);                 \
-    new_children = name##_hamt_alloc_children(MAX_BRANCH_SIZE);                      \
+  static name##_hamt *name##_hamt_derive(name##_hamt *hamt,                          \
+                                         name##_hamt_derive_t *derive,               \
+                                         int nthreads) {                             \
+    name##_hamt *derived = name##_hamt_new();                                        \
+    name##_hamt_node *root = hamt->root;                                             \
                                                                                      \
-    if (sub_h1 == sub_h2) {                                                          \
-      new_children[0] = name##_hamt_merge_leaves(depth + 1, h1, n1, h2, n2);         \
-    } else if (sub_h1 < sub_h2) {                                                    \
-      new_children[0] = n1;                                                          \
-      new_children[1] = n2;                                                          \
+    atomic_init(&derive->failed, false);                                             \
+    derive->derived = derived;                                                       \
+    derive->root = root;                                                             \
+    if (root == NULL) {                                                              \
+      return derived;                                                                \
+    }                                                                                \
+    name##_hamt_share(hamt, derived);                                                \
+    if (root->type == BRANCH || root->type == ARRAY_NODE) {                          \
+      name##_hamt_node *results[name##_hamt_SIZE];                                   \
+                                                                                     \
+      derive->results = results;                                                     \
+      hamt_parallel_for(name##_hamt_slots(root), nthreads,                           \
+                        name##_hamt_derive_task, derive);                            \
+      derived->root = name##_hamt_derive_join(derive, root, results);                \
     } else {                                                                         \
-      new_children[0] = n2;                                                          \
-      new_children[1] = n1;                                                          \
+      derived->root = name##_hamt_derive_node(derive, root);                         \
+    }                                                                                \
+    /* the nodes built before memory ran out, but none of the shared ones */         \
+    if (atomic_load(&derive->failed)) {                                              \
+      if (derived->root != NULL) {                                                   \
+        name##_hamt_free_nodes(derived, derived->root);                              \
+      }                                                                              \
+      free(derived);                                                                 \
+      return NULL;                                                                   \
     }                                                                                \
-                                                                                     \
-    return name##_hamt_create_branch(new_hash, new_children);                        \
+    return derived;                                                                  \
   }                                                                                  \
                                                                                      \
   /**                                                                                \
-   * If what we are trying to insert matches key return a new LeafNode               \
+   * A new hamt holding the entries of `hamt` for which `keep` returns               \
+   * true. It is rebuilt bottom up, sharing every subtree in which                   \
+   * nothing was dropped, so it costs about one scan plus the nodes on               \
+   * the paths that changed. The subtrees under the root are filtered on             \
+   * up to `nthreads` threads. Returns NULL if memory runs out.                      \
    *                                                                                 \
-   * If we got here and there is no match we need to transform the node              \
-   * into a branch node using 'name##_hamt_merge_leaves'                             \
-   */                                                                                \
-  static inline name##_hamt_node *name##_hamt_handle_leaf_insert(                    \
-      name##_hamt_insert_instruction_t *ins) {                                       \
-    name##_hamt_node *new_child =                                                    \
-        name##_hamt_create_leaf(ins->hash, ins->key, ins->value);                    \
-    if (equals(ins->node->key, ins->key)) {                                          \
-      /* if (strcmp(ins->node->key, ins->key) == 0) { */                             \
-      return new_child;                                                              \
-    }                                                                                \
+   * Updates and compaction copy the nodes the two share rather than                 \
+   * change or free them, so either may be changed while the other is in             \
+   * use. Shared nodes are never freed.                                              \
+   */ \
+  name##_hamt *name##_hamt_filter(name##_hamt *hamt, name##_hamt_keep_fn keep,       \
+                                  void *ctx, int nthreads) {                         \
+    name##_hamt_derive_t derive = {.keep = keep, .ctx = ctx};                        \
                                                                                      \
-    return name##_hamt_merge_leaves(ins->depth, ins->node->hash, ins->node,          \
-                                    new_child->hash, new_child);                     \
+    return name##_hamt_derive(hamt, &derive, nthreads);                              \
   }                                                                                  \
                                                                                      \
-  static inline name##_hamt_node *name##_hamt_expand_branch_to_array_node(           \
-      int idx, name##_hamt_node *child, unsigned int bitmap,                         \
-      name##_hamt_node **children) {                                                 \
-    name##_hamt_node **new_children = name##_hamt_alloc_children(SIZE);              \
-    unsigned int bit = bitmap;                                                       \
-    unsigned int count = 0;                                                          \
-                                                                                     \
-    for (unsigned int i = 0; bit; ++i) {                                             \
-      if (bit & 1) {                                                                 \
-        new_children[i] = children[count++];                                         \
-      }                                                                              \
-      bit >>= 1U;                                                                    \
-    }                                                                                \
+  /**                                                                                \
+   * A new hamt with the same keys as `hamt`, each mapped to what `map`              \
+   * returns for it. Entries whose value comes back unchanged are shared             \
+   * with `hamt`, like subtrees are by `name##_hamt_filter`.                         \
+   */ \
+  name##_hamt *name##_hamt_map_values(name##_hamt *hamt, name##_hamt_map_fn map,     \
+                                      void *ctx, int nthreads) {                     \
+    name##_hamt_derive_t derive = {.map = map, .ctx = ctx};                          \
                                                                                      \
-    new_children[idx] = child;                                                       \
-    return name##_hamt_create_arraynode(new_children, count + 1);                    \
+    return name##_hamt_derive(hamt, &derive, nthreads);                              \
   }                                                                                  \
                                                                                      \
-  /* clang-format off */                                                           \
-  /**                                                                              \
-   * If there is no node at the given index insert the child and update            \
-   * the hash.                                                                     \
-   *                                                                               \
-   * If there is no node at ^   ^^     ^^   but the size is bigger than the        \
-   * maximum capacity for a Branch, then expand into an ArrayNode                  \
-   *                                                                               \
-   * If the child exists in the slot recurse into the tree.                        \
-   */ \
-  /* clang-format on */                                                              \
-  static inline name##_hamt_node *name##_hamt_handle_branch_insert(                  \
-      name##_hamt_insert_instruction_t *ins) {                                       \
-    unsigned int frag = name##_hamt_get_frag(ins->hash, ins->depth);                 \
-    unsigned int mask = name##_hamt_get_mask(frag);                                  \
-    unsigned int pos = name##_hamt_get_position(ins->node->hash, frag);              \
-    bool exists = ins->node->hash & mask;                                            \
+  /* ====== Batch updates ====== */                                                  \
                                                                                      \
-    if (!exists) {                                                                   \
-      unsigned int size = name##_hamt_popcount(ins->node->hash);                     \
-      name##_hamt_node *new_child =                                                  \
-          name##_hamt_create_leaf(ins->hash, ins->key, ins->value);                  \
+  /* The first of `n` sorted entries at or after `hash` in trie order */             \
+  static size_t name##_hamt_lower_bound(name##_hamt_entry *entries, size_t n,        \
+                                        unsigned int hash) {                         \
+    unsigned long long order = name##_hamt_scan_order(hash);                         \
+    size_t low = 0, high = n;                                                        \
                                                                                      \
-      if (size >= MAX_BRANCH_SIZE) {                                                 \
-        return name##_hamt_expand_branch_to_array_node(                              \
-            frag, new_child, ins->node->hash, ins->node->children);                  \
-      } else {                                                                       \
-        name##_hamt_node *new_branch = name##_hamt_create_branch(                    \
-            ins->node->hash | mask, ins->node->children);                            \
-        name##_hamt_insert_child(new_branch, new_child, pos, size);                  \
+    while (low < high) {                                                             \
+      size_t mid = low + (high - low) / 2;                                           \
                                                                                      \
-        return new_branch;                                                           \
+      if (name##_hamt_scan_order(entries[mid].hash) < order) {                       \
+        low = mid + 1;                                                               \
+      } else {                                                                       \
+        high = mid;                                                                  \
       }                                                                              \
-    } else {                                                                         \
-      name##_hamt_node *new_branch =                                                 \
-          name##_hamt_create_branch(ins->node->hash, ins->node->children);           \
-      name##_hamt_node *child = new_branch->children[pos];                           \
-                                                                                     \
-      /* go to next depth, inserting a branch as the child */                        \
-      name##_hamt_replace_child(new_branch,                                          \
-                                name##_hamt_insert(child, ins->hash, ins->key,       \
-                                                   ins->value,                       \
-                                                   ins->depth + 1),                  \
-                                pos);                                                \
+    }                                                                                \
+    return low;                                                                      \
+  }                                                                                  \
                                                                                      \
-      return new_branch;                                                             \
+  /* The child of a Branch or ArrayNode at `frag`, or NULL */                        \
+  static inline name##_hamt_node *name##_hamt_child_at(name##_hamt_node *node,       \
+                                                       unsigned int frag) {          \
+    if (node->type == ARRAY_NODE) {                                                  \
+      return node->children[frag];                                                   \
+    }                                                                                \
+    if (node->hash & name##_hamt_get_mask(frag)) {                                   \
+      return node->children[name##_hamt_get_position(node->hash, frag)];             \
     }                                                                                \
+    return NULL;                                                                     \
   }                                                                                  \
                                                                                      \
   /**                                                                                \
-   * If the key string is the same as the one we are trying to                       \
-   * name##_hamt_insert then replace the node. Otherwise                             \
-   * name##_hamt_insert the node at the end of the collision node's                  \
-   * children                                                                        \
-   */                                                                                \
-  static inline name##_hamt_node *name##_hamt_handle_collision_insert(               \
-      name##_hamt_insert_instruction_t *ins) {                                       \
-    unsigned int len = ins->node->bitmap;                                            \
-    name##_hamt_node *new_child =                                                    \
-        name##_hamt_create_leaf(ins->hash, ins->key, ins->value);                    \
-    name##_hamt_node *collision_node = name##_hamt_create_collision(                 \
-        ins->node->hash, ins->node->children, ins->node->bitmap);                    \
+   * Set entries sharing the hash of the leaf or collision `node`. Equal             \
+   * keys take the new value, the others are appended to the collision,              \
+   * which grows as `set` grows it. A collision is made writable once,               \
+   * and so is each leaf whose value changes.                                        \
+   */ \
+  static name##_hamt_node *name##_hamt_set_keys(name##_hamt *hamt,                   \
+                                                name##_hamt_node *node,              \
+                                                name##_hamt_entry *entries,          \
+                                                size_t n) {                          \
+    if (node->type == COLLISION) {                                                   \
+      node = name##_hamt_writable(hamt, node);                                       \
+    }                                                                                \
+    for (size_t i = 0; i < n; ++i) {                                                 \
+      name##_hamt_node *leaf = node;                                                 \
+      int j = 0;                                                                     \
                                                                                      \
-    if (ins->hash == ins->node->hash) {                                              \
-      for (int i = 0; i < collision_node->bitmap; ++i) {                             \
-        if (equals(ins->node->children[i]->key, ins->key)) {                         \
-          /* if (strcmp(ins->node->children[i]->key, ins->key) == 0) { */            \
-          name##_hamt_replace_child(ins->node, new_child, i);                        \
-          return collision_node;                                                     \
+      if (node->type == COLLISION) {                                                 \
+        j = name##_hamt_collision_find(node, entries[i].key);                        \
+        leaf = j < node->bitmap ? node->children[j] : NULL;                          \
+      } else if (!equals(node->key, entries[i].key)) {                               \
+        leaf = NULL;                                                                 \
+      }                                                                              \
+      if (leaf != NULL) {                                                            \
+        if (node->type == COLLISION) {                                               \
+          leaf = name##_hamt_writable(hamt, leaf);                                   \
+          node->children[j] = leaf;                                                  \
+          node->content += hamt_content_entry(entries[i].hash, entries[i].value) -   \
+                           name##_hamt_content(leaf);                                \
+        } else {                                                                     \
+          node = leaf = name##_hamt_writable(hamt, node);                            \
         }                                                                            \
+        leaf->key = entries[i].key;                                                  \
+        leaf->value = entries[i].value;                                              \
+        continue;                                                                    \
       }                                                                              \
+      leaf = name##_hamt_create_leaf(entries[i].hash, entries[i].key,                \
+                                     entries[i].value);                              \
+      if (node->type == LEAF) {                                                      \
+        name##_hamt_node *first = node;                                              \
                                                                                      \
-      name##_hamt_insert_child(collision_node, new_child, len, len);                 \
-      collision_node->bitmap++;                                                      \
-      return collision_node;                                                         \
-    }                                                                                \
+        node = name##_hamt_alloc_collision(first->hash, 2, 2);                       \
+        node->children[0] = first;                                                   \
+        node->children[1] = leaf;                                                    \
+        node->content = name##_hamt_content(first) + name##_hamt_content(leaf);      \
+      } else {                                                                       \
+        name##_hamt_node *grown = name##_hamt_collision_add(node, leaf);             \
                                                                                      \
-    return name##_hamt_merge_leaves(ins->depth, ins->node->hash, ins->node,          \
-                                    new_child->hash, new_child);                     \
+        if (grown != node) {                                                         \
+          name##_hamt_retire(hamt, node);                                            \
+        }                                                                            \
+        node = grown;                                                                \
+      }                                                                              \
+    }                                                                                \
+    return node;                                                                     \
   }                                                                                  \
                                                                                      \
   /**                                                                                \
-   * If there is a child in the place where we are trying to                         \
-   * name##_hamt_insert, step into the tree.                                         \
+   * Merge `n` sorted entries, which all belong below `node` at `depth`,             \
+   * into it and return what takes its place. The entries are split by               \
+   * fragment and each run handed to its child, so every node is reached             \
+   * once however many entries land below it. A node that changes is                 \
+   * made writable once, after its children, and a Branch gaining                    \
+   * children is reallocated once at its final size.                                 \
    *                                                                                 \
-   * Otherwise we can create a leaf and replace the empty slot. We                   \
-   * allocate 'SIZE' worth of children and fill the blank spaces with                \
-   * null so it is easy to keep track off.                                           \
-   *                                                                                 \
-   * Could switch out to a bitmap                                                    \
-   */                                                                                \
-  static inline name##_hamt_node *name##_hamt_handle_arraynode_insert(               \
-      name##_hamt_insert_instruction_t *ins) {                                       \
-    unsigned int frag = name##_hamt_get_frag(ins->hash, ins->depth);                 \
-    int size = ins->node->bitmap;                                                    \
-                                                                                     \
-    name##_hamt_node *child = ins->node->children[frag];                             \
-    name##_hamt_node *new_child = NULL;                                              \
-                                                                                     \
-    if (child) {                                                                     \
-      new_child = name##_hamt_insert(child, ins->hash, ins->key, ins->value,         \
-                                     ins->depth + 1);                                \
-    } else {                                                                         \
-      new_child = name##_hamt_create_leaf(ins->hash, ins->key, ins->value);          \
+   * Below a leaf or collision one entry with another hash is merged in              \
+   * as by `set`, and entries sharing its hash replace or join its keys.             \
+   * Anything else is rebuilt together with the keys it held, which the              \
+   * entries win over.                                                               \
+   */ \
+  static name##_hamt_node *name##_hamt_set_run(name##_hamt *hamt,                    \
+                                               name##_hamt_node *node,               \
+                                               name##_hamt_entry *entries,           \
+                                               size_t n, int depth) {                \
+    name##_hamt_node *merged[name##_hamt_SIZE];                                      \
+    unsigned int frags[name##_hamt_SIZE];                                            \
+    unsigned int groups = 0, added = 0;                                              \
+    int delta = 0;                                                                   \
+    unsigned long long change = 0;                                                   \
+                                                                                     \
+    if (node == NULL) {                                                              \
+      return name##_hamt_build(entries, n, depth);                                   \
+    }                                                                                \
+    if (n == 1 && name##_hamt_is_leaf(node) && entries[0].hash != node->hash) {      \
+      return name##_hamt_merge_leaves(                                               \
+          depth, node->hash, node, entries[0].hash,                                  \
+          name##_hamt_create_leaf(entries[0].hash, entries[0].key,                   \
+                                  entries[0].value));                                \
+    }                                                                                \
+    if (name##_hamt_is_leaf(node) && entries[0].hash == node->hash &&                \
+        entries[n - 1].hash == node->hash) {                                         \
+      return name##_hamt_set_keys(hamt, node, entries, n);                           \
     }                                                                                \
+    if (node->type == LEAF || node->type == COLLISION) {                             \
+      size_t held = node->type == LEAF ? 1 : (size_t)node->bitmap;                   \
+      size_t at = name##_hamt_lower_bound(entries, n, node->hash);                   \
+      name##_hamt_entry *all;                                                        \
+      name##_hamt_node *built;                                                       \
                                                                                      \
-    name##_hamt_replace_child(ins->node, new_child, frag);                           \
+      if ((all = (name##_hamt_entry *)malloc(sizeof(name##_hamt_entry) *             \
+                                             (n + held))) == NULL) {                 \
+        fprintf(stderr, "Failed to allocate memory for entries\n");                  \
+        return node;                                                                 \
+      }                                                                              \
+      memcpy(all, entries, sizeof(name##_hamt_entry) * at);                          \
+      for (size_t i = 0; i < held; ++i) {                                            \
+        name##_hamt_node *leaf = node->type == LEAF ? node : node->children[i];      \
                                                                                      \
-    if (child == NULL && new_child != NULL) {                                        \
-      return name##_hamt_create_arraynode(ins->node->children, size + 1);            \
+        all[at + i].hash = leaf->hash;                                               \
+        all[at + i].key = leaf->key;                                                 \
+        all[at + i].value = leaf->value;                                             \
+      }                                                                              \
+      memcpy(all + at + held, entries + at,                                          \
+             sizeof(name##_hamt_entry) * (n - at));                                  \
+      built = name##_hamt_build(all, n + held, depth);                               \
+      free(all);                                                                     \
+      for (size_t i = 0; node->type == COLLISION && i < held; ++i) {                 \
+        name##_hamt_retire(hamt, node->children[i]);                                 \
+      }                                                                              \
+      name##_hamt_retire(hamt, node);                                                \
+      return built;                                                                  \
     }                                                                                \
                                                                                      \
-    return name##_hamt_create_arraynode(ins->node->children, size);                  \
-  }                                                                                  \
+    for (size_t start = 0; start < n;) {                                             \
+      unsigned int frag = name##_hamt_get_frag(entries[start].hash, depth);          \
+      name##_hamt_node *child = name##_hamt_child_at(node, frag);                    \
+      int size = (int)name##_hamt_subtree_size(child);                               \
+      unsigned long long content = name##_hamt_content(child);                       \
+      size_t end = start + 1;                                                        \
                                                                                      \
-  /**                                                                                \
-   * Return a new node                                                               \
-   */                                                                                \
-  name##_hamt *name##_hamt_set(name##_hamt *hamt, name *key, void *value) {          \
-    unsigned int hash = hashof(key);                                                 \
+      while (end < n && name##_hamt_get_frag(entries[end].hash, depth) == frag) {    \
+        end++;                                                                       \
+      }                                                                              \
+      frags[groups] = frag;                                                          \
+      merged[groups] = name##_hamt_set_run(hamt, child, entries + start,             \
+                                           end - start, depth + 1);                  \
+      delta += (int)name##_hamt_subtree_size(merged[groups]) - size;                 \
+      change += name##_hamt_content(merged[groups++]) - content;                     \
+      added += child == NULL;                                                        \
+      start = end;                                                                   \
+    }                                                                                \
                                                                                      \
-    if (hamt->root != NULL) {                                                        \
-      hamt->root = name##_hamt_insert(hamt->root, hash, key, value, 0);              \
-    } else {                                                                         \
-      hamt->root = name##_hamt_create_leaf(hash, key, value);                        \
+    if (node->type == ARRAY_NODE || added == 0) {                                    \
+      node = name##_hamt_writable(hamt, node);                                       \
+      for (unsigned int g = 0; g < groups; ++g) {                                    \
+        node->children[node->type == ARRAY_NODE                                      \
+                           ? frags[g]                                                \
+                           : name##_hamt_get_position(node->hash, frags[g])] =       \
+            merged[g];                                                               \
+      }                                                                              \
+      node->bitmap += node->type == ARRAY_NODE ? added : 0;                          \
+      node->size += delta;                                                           \
+      node->content += change;                                                       \
+      return node;                                                                   \
     }                                                                                \
                                                                                      \
-    return hamt;                                                                     \
+    unsigned int count = name##_hamt_popcount(node->hash) + added;                   \
+    bool array_node = count > name##_hamt_MAX_BRANCH_SIZE;                           \
+    name##_hamt_node *grown = name##_hamt_alloc_node(                                \
+        array_node ? ARRAY_NODE : BRANCH, 0, array_node ? (int)count : 0,            \
+        array_node ? name##_hamt_SIZE : count);                                      \
+    unsigned int pos = 0;                                                            \
+                                                                                     \
+    grown->size = node->size + delta;                                                \
+    grown->content = node->content + change;                                         \
+    for (unsigned int frag = 0, g = 0; frag < name##_hamt_SIZE; ++frag) {            \
+      name##_hamt_node *child = name##_hamt_child_at(node, frag);                    \
+                                                                                     \
+      if (g < groups && frags[g] == frag) {                                          \
+        child = merged[g++];                                                         \
+      }                                                                              \
+      if (array_node) {                                                              \
+        grown->children[frag] = child;                                               \
+      } else if (child != NULL) {                                                    \
+        grown->children[pos++] = child;                                              \
+        grown->hash |= name##_hamt_get_mask(frag);                                   \
+      }                                                                              \
+    }                                                                                \
+    name##_hamt_retire(hamt, node);                                                  \
+    return grown;                                                                    \
+  }                                                                                  \
+                                                                                     \
+  /* Whether `key` is among the sorted entries */                                    \
+  static bool name##_hamt_in_run(name##_hamt_entry *entries, size_t n,               \
+                                 unsigned int hash, name *key) {                     \
+    for (size_t i = name##_hamt_lower_bound(entries, n, hash);                       \
+         i < n && entries[i].hash == hash; ++i) {                                    \
+      if (equals(entries[i].key, key)) {                                             \
+        return true;                                                                 \
+      }                                                                              \
+    }                                                                                \
+    return false;                                                                    \
   }                                                                                  \
+                                                                                     \
   /**                                                                                \
-   * Wind down the tree to the leaf node using the hash.                             \
-   */                                                                                \
-  void *name##_hamt_get(name##_hamt *hamt, name *key) {                              \
-    unsigned int hash = hashof(key);                                                 \
-    name##_hamt_node *node = hamt->root;                                             \
-    int depth = 0;                                                                   \
+   * Take the keys of `n` sorted entries out from below `node` at `depth`,           \
+   * visiting every node once, and return what takes its place. A node               \
+   * that loses entries is made writable once, after its children. As                \
+   * with `remove`, a Branch or ArrayNode left with a single leaf                    \
+   * collapses into it, and an ArrayNode left with `MIN_ARRAY_NODE_SIZE`             \
+   * children or fewer becomes a Branch.                                             \
+   */ \
+  static name##_hamt_node *name##_hamt_remove_run(name##_hamt *hamt,                 \
+                                                  name##_hamt_node *node,            \
+                                                  name##_hamt_entry *entries,        \
+                                                  size_t n, int depth) {             \
+    name##_hamt_node *left[name##_hamt_SIZE];                                        \
+    unsigned int frags[name##_hamt_SIZE];                                            \
+    unsigned int groups = 0, removed = 0, emptied = 0, count = 0;                    \
+    unsigned long long lost = 0;                                                     \
                                                                                      \
-    for (;;) {                                                                       \
-      if (node == NULL) {                                                            \
-        return NULL;                                                                 \
+    if (node->type == LEAF) {                                                        \
+      if (!name##_hamt_in_run(entries, n, node->hash, node->key)) {                  \
+        return node;                                                                 \
       }                                                                              \
-      switch (node->type) {                                                          \
-      case BRANCH: {                                                                 \
-        unsigned int frag = name##_hamt_get_frag(hash, depth);                       \
-        unsigned int mask = name##_hamt_get_mask(frag);                              \
+      name##_hamt_retire(hamt, node);                                                \
+      return NULL;                                                                   \
+    }                                                                                \
+    if (node->type == COLLISION) {                                                   \
+      unsigned char *fps;                                                            \
+      int i = 0;                                                                     \
                                                                                      \
-        if (node->hash & mask) {                                                     \
-          unsigned int idx = name##_hamt_get_position(node->hash, frag);             \
-          node = node->children[idx];                                                \
-          depth++;                                                                   \
+      while (i < node->bitmap && !name##_hamt_in_run(entries, n, node->hash,         \
+                                                     node->children[i]->key)) {      \
+        i++;                                                                         \
+      }                                                                              \
+      if (i == node->bitmap) {                                                       \
+        return node;                                                                 \
+      }                                                                              \
+      node = name##_hamt_writable(hamt, node);                                       \
+      fps = name##_hamt_fingerprints(node);                                          \
+      for (count = i; i < node->bitmap; ++i) {                                       \
+        name##_hamt_node *leaf = node->children[i];                                  \
+                                                                                     \
+        if (name##_hamt_in_run(entries, n, leaf->hash, leaf->key)) {                 \
+          node->content -= name##_hamt_content(leaf);                                \
+          name##_hamt_retire(hamt, leaf);                                            \
           continue;                                                                  \
-        } else {                                                                     \
-          return NULL;                                                               \
         }                                                                            \
+        if (fps != NULL) {                                                           \
+          fps[count] = fps[i];                                                       \
+        }                                                                            \
+        node->children[count++] = leaf;                                              \
       }                                                                              \
+      if (count <= 1) {                                                              \
+        name##_hamt_node *last = count == 1 ? node->children[0] : NULL;              \
                                                                                      \
-      case COLLISION: {                                                              \
-        int len = node->bitmap;                                                      \
-        for (int i = 0; i < len; ++i) {                                              \
-          name##_hamt_node *child = node->children[i];                               \
-          if (child != NULL &&                                                       \
-              equals(child->key, key) /* strcmp(child->key, key) == 0 */)            \
-            return child->value;                                                     \
-        }                                                                            \
-        return NULL;                                                                 \
+        name##_hamt_retire(hamt, node);                                              \
+        return last;                                                                 \
+      }                                                                              \
+      node->bitmap = count;                                                          \
+      return node;                                                                   \
+    }                                                                                \
+                                                                                     \
+    for (size_t start = 0; start < n;) {                                             \
+      unsigned int frag = name##_hamt_get_frag(entries[start].hash, depth);          \
+      name##_hamt_node *child = name##_hamt_child_at(node, frag);                    \
+      size_t end = start + 1;                                                        \
+                                                                                     \
+      while (end < n && name##_hamt_get_frag(entries[end].hash, depth) == frag) {    \
+        end++;                                                                       \
       }                                                                              \
+      if (child != NULL) {                                                           \
+        unsigned int size = name##_hamt_subtree_size(child);                         \
+        unsigned long long content = name##_hamt_content(child);                     \
                                                                                      \
-      case LEAF: {                                                                   \
-        if (node != NULL &&                                                          \
-            equals(node->key, key) /* strcmp(node->key, key) == 0 */                 \
-        ) {                                                                          \
-          return node->value;                                                        \
+        left[groups] = name##_hamt_remove_run(hamt, child, entries + start,          \
+                                              end - start, depth + 1);               \
+        /* a child changed in place stays put but shrinks */                         \
+        if (name##_hamt_subtree_size(left[groups]) != size) {                        \
+          removed += size - name##_hamt_subtree_size(left[groups]);                  \
+          lost += content - name##_hamt_content(left[groups]);                       \
+          emptied += left[groups] == NULL;                                           \
+          frags[groups++] = frag;                                                    \
         }                                                                            \
-        return NULL;                                                                 \
       }                                                                              \
+      start = end;                                                                   \
+    }                                                                                \
+    if (groups == 0) {                                                               \
+      return node;                                                                   \
+    }                                                                                \
+    node = name##_hamt_writable(hamt, node);                                         \
+    for (unsigned int g = 0; g < groups; ++g) {                                      \
+      node->children[node->type == ARRAY_NODE                                        \
+                         ? frags[g]                                                  \
+                         : name##_hamt_get_position(node->hash, frags[g])] =         \
+          left[g];                                                                   \
+    }                                                                                \
+    node->size -= removed;                                                           \
+    node->content -= lost;                                                           \
+    /* a Branch whose only child shrank to a leaf still collapses below */           \
+    if (emptied == 0 &&                                                              \
+        (node->type == ARRAY_NODE || name##_hamt_popcount(node->hash) > 1 ||         \
+         !name##_hamt_is_leaf(node->children[0]))) {                                 \
+      return node;                                                                   \
+    }                                                                                \
                                                                                      \
-      case ARRAY_NODE: {                                                             \
-        node = node->children[name##_hamt_get_frag(hash, depth)];                    \
-        if (node != NULL) {                                                          \
-          depth++;                                                                   \
-          continue;                                                                  \
+    /* close the gaps left by emptied children */                                    \
+    name##_hamt_bitmap bitmap = 0;                                                   \
+    name##_hamt_node *last = NULL;                                                   \
+    for (unsigned int frag = 0, i = 0; frag < name##_hamt_SIZE; ++frag) {            \
+      name##_hamt_node *child;                                                       \
+                                                                                     \
+      if (node->type == BRANCH && !(node->hash & name##_hamt_get_mask(frag))) {      \
+        continue;                                                                    \
+      }                                                                              \
+      child = node->children[node->type == ARRAY_NODE ? frag : i++];                 \
+      if (child != NULL) {                                                           \
+        bitmap |= name##_hamt_get_mask(frag);                                        \
+        last = child;                                                                \
+        if (node->type == BRANCH) {                                                  \
+          node->children[count] = child;                                             \
         }                                                                            \
-        return NULL;                                                                 \
+        count++;                                                                     \
       }                                                                              \
+    }                                                                                \
+    if (count == 0 || (count == 1 && name##_hamt_is_leaf(last))) {                   \
+      name##_hamt_retire(hamt, node);                                                \
+      return last;                                                                   \
+    }                                                                                \
+    if (node->type == BRANCH) {                                                      \
+      node->hash = bitmap;                                                           \
+      return node;                                                                   \
+    }                                                                                \
+    node->bitmap = count;                                                            \
+    if (count > name##_hamt_MIN_ARRAY_NODE_SIZE) {                                   \
+      return node;                                                                   \
+    }                                                                                \
+                                                                                     \
+    name##_hamt_node *branch = name##_hamt_alloc_node(BRANCH, bitmap, 0, count);     \
+    unsigned int pos = 0;                                                            \
+                                                                                     \
+    branch->size = node->size;                                                       \
+    branch->content = node->content;                                                 \
+    for (unsigned int frag = 0; frag < name##_hamt_SIZE; ++frag) {                   \
+      if (node->children[frag] != NULL) {                                            \
+        branch->children[pos++] = node->children[frag];                              \
       }                                                                              \
     }                                                                                \
+    name##_hamt_retire(hamt, node);                                                  \
+    return branch;                                                                   \
   }                                                                                  \
                                                                                      \
-  /* Just to split out the functions, does nothing special */                        \
-  static name##_hamt_node *name##_hamt_remove_node(                                  \
-      name##_hamt_removal_t *rem) {                                                  \
-    if (rem->node == NULL) {                                                         \
+  /**                                                                                \
+   * Set `n` keys at once, as `n` calls to `set` in that order would.                \
+   * The batch is hashed and sorted into trie order first, then merged in            \
+   * a single walk down the trie, so each node it touches is changed or              \
+   * reallocated once rather than once per key. Returns NULL, leaving the            \
+   * hamt as it was, if memory runs out.                                             \
+   */ \
+  name##_hamt *name##_hamt_set_many(name##_hamt *hamt, name **keys, void **values,   \
+                                    size_t n) {                                      \
+    name##_hamt_entry *entries;                                                      \
+    unsigned int size = name##_hamt_subtree_size(hamt->root);                        \
+                                                                                     \
+    if (n == 0) {                                                                    \
+      return hamt;                                                                   \
+    }                                                                                \
+    if ((entries = name##_hamt_sorted_entries(keys, values, n)) == NULL) {           \
       return NULL;                                                                   \
     }                                                                                \
+    for (size_t i = 0; hamt->trace != NULL && i < n; ++i) {                          \
+      name##_hamt_trace_op(hamt, keys[i], hashof(keys[i]), HAMT_LOG_SET);            \
+    }                                                                                \
+    hamt->root = name##_hamt_set_run(hamt, hamt->root, entries, n, 0);               \
                                                                                      \
-    switch (rem->node->type) {                                                       \
-    case LEAF:                                                                       \
-      return name##_hamt_handle_leaf_removal(rem);                                   \
-    case BRANCH:                                                                     \
-      return name##_hamt_handle_branch_removal(rem);                                 \
-    case COLLISION:                                                                  \
-      return name##_hamt_handle_collision_removal(rem);                              \
-    case ARRAY_NODE:                                                                 \
-      return name##_hamt_handle_arraynode_removal(rem);                              \
-                                                                                     \
-    default:                                                                         \
-      /* NOT REACHED  */                                                             \
-      return rem->node;                                                              \
+    atomic_fetch_add_explicit(&hamt->version, 1, memory_order_release);              \
+    /* keys already there have their bits set, but only new ones count */            \
+    for (size_t i = 0; hamt->filter != NULL && i < n; ++i) {                         \
+      hamt_filter_mark(hamt->filter, entries[i].hash);                               \
     }                                                                                \
+    free(entries);                                                                   \
+    if (hamt->filter != NULL) {                                                      \
+      hamt->filter->inserted += name##_hamt_subtree_size(hamt->root) - size;         \
+      name##_hamt_refilter(hamt);                                                    \
+    }                                                                                \
+    for (size_t i = 0; hamt->log != NULL && i < n; ++i) {                            \
+      name##_hamt_log_append(hamt, keys[i], values[i], HAMT_LOG_SET);                \
+    }                                                                                \
+    return hamt;                                                                     \
   }                                                                                  \
                                                                                      \
-  /**                                                                                \
-   * Removing a child from the CollisionNode or collapsing if there is               \
-   * only one child left.                                                            \
-   */                                                                                \
-  static inline name##_hamt_node *name##_hamt_handle_collision_removal(              \
-      name##_hamt_removal_t *rem) {                                                  \
-    if (rem->node->hash == rem->hash) {                                              \
-      for (int i = 0; i < rem->node->bitmap; ++i) {                                  \
-        name##_hamt_node *child = rem->node->children[i];                            \
+  /* Remove `n` keys at once, the counterpart of `name##_hamt_set_many` */           \
+  name##_hamt *name##_hamt_remove_many(name##_hamt *hamt, name **keys, size_t n) {   \
+    name##_hamt_entry *entries;                                                      \
+    unsigned int size = name##_hamt_subtree_size(hamt->root);                        \
                                                                                      \
-        if (equals(child->key, rem->key)) {                                          \
-          /* if (strcmp(child->key, rem->key) == 0) { */                             \
-          name##_hamt_remove_child(rem->node, i, rem->node->bitmap);                 \
-          /* could free rem->node here */                                            \
-          if ((rem->node->bitmap - 1) > 1) {                                         \
-            return name##_hamt_create_collision(                                     \
-                rem->node->hash, rem->node->children, rem->node->bitmap - 1);        \
-          }                                                                          \
-          /* Collapse collision node */                                              \
-          return rem->node->children[0];                                             \
-        }                                                                            \
-      }                                                                              \
+    if (n == 0 || hamt->root == NULL) {                                              \
+      return hamt;                                                                   \
+    }                                                                                \
+    if ((entries = name##_hamt_sorted_entries(keys, NULL, n)) == NULL) {             \
+      return NULL;                                                                   \
+    }                                                                                \
+    for (size_t i = 0; hamt->trace != NULL && i < n; ++i) {                          \
+      name##_hamt_trace_op(hamt, keys[i], hashof(keys[i]), HAMT_LOG_REMOVE);         \
     }                                                                                \
+    hamt->root = name##_hamt_remove_run(hamt, hamt->root, entries, n, 0);            \
+    free(entries);                                                                   \
                                                                                      \
-    return rem->node;                                                                \
+    atomic_fetch_add_explicit(&hamt->version, 1, memory_order_release);              \
+    if (hamt->filter != NULL) {                                                      \
+      hamt->filter->removed += size - name##_hamt_subtree_size(hamt->root);          \
+      name##_hamt_refilter(hamt);                                                    \
+    }                                                                                \
+    for (size_t i = 0; hamt->log != NULL && i < n; ++i) {                            \
+      name##_hamt_log_append(hamt, keys[i], NULL, HAMT_LOG_REMOVE);                  \
+    }                                                                                \
+    return hamt;                                                                     \
   }                                                                                  \
                                                                                      \
+  /* ====== Content equality ====== */                                               \
   /**                                                                                \
-   * Removing an element from a branch node. Either traversing down                  \
-   * the tree, collapsing the node, removing a child or a noop.                      \
-   */                                                                                \
-  static inline name##_hamt_node *name##_hamt_handle_branch_removal(                 \
-      name##_hamt_removal_t *rem) {                                                  \
-    unsigned int frag = name##_hamt_get_frag(rem->hash, rem->depth);                 \
-    unsigned int mask = name##_hamt_get_mask(frag);                                  \
-                                                                                     \
-    name##_hamt_node *branch_node = rem->node;                                       \
-    bool exists = branch_node->hash & mask;                                          \
+   * Hash of all the entries of `hamt`, kept up to date by every update,             \
+   * so reading it costs nothing. Tries with the same keys and the same              \
+   * value pointers hash alike however they were built, so it can key a              \
+   * cache of things derived from a trie. Keys count by their `hashof`,              \
+   * so tries differing only in keys which share a hash also hash alike.             \
+   * `name##_hamt_equals` tells those apart. An empty trie hashes to 0.              \
+   */ \
+  unsigned long long name##_hamt_content_hash(name##_hamt *hamt) {                   \
+    return name##_hamt_content(hamt->root);                                          \
+  }                                                                                  \
                                                                                      \
-    if (!exists) {                                                                   \
-      return branch_node;                                                            \
+  /**                                                                                \
+   * Whether `a` and `b`, both at `depth`, hold the same entries. Nodes              \
+   * they share are equal and nodes with different sizes or content                  \
+   * hashes aren't, without looking further down. With `trust`, nodes                \
+   * whose sizes and content hashes match are taken as equal too. Tries              \
+   * holding the same keys can still differ in shape, as ArrayNodes only             \
+   * shrink back into Branches well below where Branches grow, so this               \
+   * goes by fragment.                                                               \
+   */ \
+  static bool name##_hamt_same_nodes(name##_hamt_node *a, name##_hamt_node *b,       \
+                                     int depth, bool trust) {                        \
+    if (a == b) {                                                                    \
+      return true;                                                                   \
     }                                                                                \
+    if (a == NULL || b == NULL ||                                                    \
+        name##_hamt_subtree_size(a) != name##_hamt_subtree_size(b) ||                \
+        name##_hamt_content(a) != name##_hamt_content(b)) {                          \
+      return false;                                                                  \
+    }                                                                                \
+    if (trust) {                                                                     \
+      return true;                                                                   \
+    }                                                                                \
+    if (name##_hamt_is_leaf(b)) {                                                    \
+      name##_hamt_node *swap = a;                                                    \
                                                                                      \
-    unsigned int pos = name##_hamt_get_position(branch_node->hash, frag);            \
-    int size = name##_hamt_popcount(branch_node->hash);                              \
-    name##_hamt_node *child = branch_node->children[pos];                            \
-    rem->node = child;                                                               \
-    rem->depth++;                                                                    \
-                                                                                     \
-    name##_hamt_node *new_child = name##_hamt_remove_node(rem);                      \
+      a = b;                                                                         \
+      b = swap;                                                                      \
+    }                                                                                \
+    if (!name##_hamt_is_leaf(a)) {                                                   \
+      for (unsigned int frag = 0; frag < name##_hamt_SIZE; ++frag) {                 \
+        if (!name##_hamt_same_nodes(name##_hamt_child_at(a, frag),                   \
+                                    name##_hamt_child_at(b, frag), depth + 1,        \
+                                    false)) {                                        \
+          return false;                                                              \
+        }                                                                            \
+      }                                                                              \
+      return true;                                                                   \
+    }                                                                                \
                                                                                      \
-    if (child == new_child) {                                                        \
-      return branch_node;                                                            \
+    /* the keys of `a` share a hash, so they sit on one path down `b` */             \
+    while (b != NULL && !name##_hamt_is_leaf(b)) {                                   \
+      b = name##_hamt_child_at(b, name##_hamt_get_frag(a->hash, depth++));           \
+    }                                                                                \
+    if (b == NULL || b->hash != a->hash ||                                           \
+        name##_hamt_subtree_size(b) != name##_hamt_subtree_size(a)) {                \
+      return false;                                                                  \
     }                                                                                \
+    for (unsigned int i = 0; i < name##_hamt_subtree_size(a); ++i) {                 \
+      name##_hamt_node *leaf = a->type == LEAF ? a : a->children[i];                 \
+      name##_hamt_node *match = b;                                                   \
                                                                                      \
-    if (new_child == NULL) {                                                         \
-      unsigned int new_hash = branch_node->hash & ~mask;                             \
-      if (!new_hash) {                                                               \
-        return NULL;                                                                 \
-      }                                                                              \
+      if (b->type == COLLISION) {                                                    \
+        int j = name##_hamt_collision_find(b, leaf->key);                            \
                                                                                      \
-      /* Collapse the node */                                                        \
-      if (size == 2 && name##_hamt_is_leaf(branch_node->children[pos ^ 1])) {        \
-        return branch_node->children[pos ^ 1];                                       \
+        match = j < b->bitmap ? b->children[j] : NULL;                               \
+      } else if (!equals(b->key, leaf->key)) {                                       \
+        match = NULL;                                                                \
+      }                                                                              \
+      if (match == NULL || match->value != leaf->value) {                            \
+        return false;                                                                \
       }                                                                              \
-                                                                                     \
-      name##_hamt_remove_child(branch_node, pos, size);                              \
-      return name##_hamt_create_branch(new_hash, branch_node->children);             \
     }                                                                                \
+    return true;                                                                     \
+  }                                                                                  \
                                                                                      \
-    if (size == 1 && name##_hamt_is_leaf(new_child)) {                               \
-      return new_child;                                                              \
-    }                                                                                \
+  /**                                                                                \
+   * Whether `a` and `b` hold the same keys, by `equals`, with the same              \
+   * value pointers. Tries of different sizes or content hashes compare              \
+   * in constant time, and subtrees that are shared, as between a trie               \
+   * and what `filter` or `map_values` derived from it, are skipped.                 \
+   */ \
+  bool name##_hamt_equals(name##_hamt *a, name##_hamt *b) {                          \
+    return name##_hamt_same_nodes(a->root, b->root, 0, false);                       \
+  }                                                                                  \
                                                                                      \
-    name##_hamt_replace_child(branch_node, new_child, pos);                          \
-    return name##_hamt_create_branch(branch_node->hash,                              \
-                                     branch_node->children);                         \
+  /**                                                                                \
+   * `name##_hamt_equals` trusting the size and content hash of every                \
+   * subtree, so it decides at the root in constant time, also for equal             \
+   * tries built apart, such as a reloaded config. It can be fooled where            \
+   * the content hash can: by keys that differ but share a hash, and by              \
+   * two different sets of entries whose 64-bit sums collide.                        \
+   */ \
+  bool name##_hamt_probably_equals(name##_hamt *a, name##_hamt *b) {                 \
+    return name##_hamt_same_nodes(a->root, b->root, 0, true);                        \
   }                                                                                  \
                                                                                      \
+  /* ====== Shared memory ====== */                                                  \
   /**                                                                                \
-   * Remove the node, as a modification if you passed through a free                 \
-   * function from the top, you could then free your object here.                    \
-   */                                                                                \
-  static inline name##_hamt_node *name##_hamt_handle_leaf_removal(                   \
-      name##_hamt_removal_t *rem) {                                                  \
-    if (equals(rem->node->key, rem->key)) {                                          \
-      /* if (strcmp(rem->node->key, rem->key) == 0) { */                             \
-      /* could free rem->node here */                                                \
+   * Point `entry->key` and `entry->value` at the bytes to publish for one           \
+   * key and value, and set their lengths. They only need to stay valid              \
+   * until `publish_shm` returns.                                                    \
+   */ \
+  typedef void (*name##_hamt_encode_fn)(name *key, void *value,                      \
+                                        hamt_static_entry *entry, void *ctx);        \
+                                                                                     \
+  static void name##_hamt_collect_static(name##_hamt_node *node,                     \
+                                         hamt_static_entry *entries, size_t *n,      \
+                                         name##_hamt_encode_fn encode,               \
+                                         void *ctx) {                                \
+    switch (node->type) {                                                            \
+    case LEAF:                                                                       \
+      entries[*n].hash = node->hash;                                                 \
+      encode(node->key, node->value, &entries[(*n)++], ctx);                         \
+      return;                                                                        \
+    case COLLISION:                                                                  \
+    case BRANCH:                                                                     \
+      for (unsigned int i = 0; i < name##_hamt_slots(node); ++i) {                   \
+        name##_hamt_collect_static(node->children[i], entries, n, encode, ctx);      \
+      }                                                                              \
+      return;                                                                        \
+    case ARRAY_NODE:                                                                 \
+      for (int i = 0; i < name##_hamt_SIZE; ++i) {                                   \
+        if (node->children[i] != NULL) {                                             \
+          name##_hamt_collect_static(node->children[i], entries, n, encode,          \
+                                     ctx);                                           \
+        }                                                                            \
+      }                                                                              \
+      return;                                                                        \
+    }                                                                                \
+  }                                                                                  \
+                                                                                     \
+  /* Encode what `hamt` holds now as a static table, released with free */           \
+  static hamt_static_table *name##_hamt_to_static(name##_hamt *hamt,                 \
+                                                  name##_hamt_encode_fn encode,      \
+                                                  void *ctx) {                       \
+    size_t nodes = 0, keys = 0, n = 0;                                               \
+    hamt_static_entry *entries;                                                      \
+    hamt_static_table *table;                                                        \
+                                                                                     \
+    name##_hamt_frozen_count(hamt->root, &nodes, &keys);                             \
+    if ((entries = (hamt_static_entry *)malloc(sizeof(hamt_static_entry) *           \
+                                               (keys + 1))) == NULL) {               \
+      fprintf(stderr, "Failed to allocate memory for entries\n");                    \
+      errno = ENOMEM;                                                                \
       return NULL;                                                                   \
     }                                                                                \
+    if (hamt->root != NULL) {                                                        \
+      name##_hamt_collect_static(hamt->root, entries, &n, encode, ctx);              \
+    }                                                                                \
+    table = hamt_static_build(entries, n);                                           \
+    free(entries);                                                                   \
+    if (table == NULL) {                                                             \
+      errno = ENOMEM;                                                                \
+    }                                                                                \
+    return table;                                                                    \
+  }                                                                                  \
                                                                                      \
-    return rem->node;                                                                \
+  /**                                                                                \
+   * Publish what `hamt` holds now to `shm` as a static table, see                   \
+   * `hamt_shm_publish`. Keys keep the hash `hashof` gave them, so readers           \
+   * find them with `hamt_static_lookup` and that hash, or simply with               \
+   * `hamt_static_get` if `hashof` is `get_hash` of the encoded key.                 \
+   */ \
+  int name##_hamt_publish_shm(name##_hamt *hamt, hamt_shm *shm,                      \
+                              name##_hamt_encode_fn encode, void *ctx) {             \
+    hamt_static_table *table = name##_hamt_to_static(hamt, encode, ctx);             \
+    int result;                                                                      \
+                                                                                     \
+    if (table == NULL) {                                                             \
+      return -1;                                                                     \
+    }                                                                                \
+    result = hamt_shm_publish(shm, table);                                           \
+    free(table);                                                                     \
+    return result;                                                                   \
   }                                                                                  \
                                                                                      \
+  /* ====== Durability ====== */                                                     \
   /**                                                                                \
-   * Transform ArrayNode into a BranchNode. Setting each bit in the hash for         \
-   * where a child is not NULL.                                                      \
-   *                                                                                 \
-   * We alloc MIN_ARRAY_NODE_SIZE as inorder to have got here the lower bound        \
-   * limit for the ArrayNode must have been met.                                     \
-   */                                                                                \
-  static inline name##_hamt_node *name##_hamt_compress_array_to_branch(              \
-      unsigned int idx, name##_hamt_node **children) {                               \
+   * Turn the bytes `encode` made of a key and value back into them,                 \
+   * storing the value in `*value`. The bytes belong to the file being               \
+   * read, so keep copies. A logged remove has no value bytes. Return                \
+   * NULL to skip the entry.                                                         \
+   */ \
+  typedef name *(*name##_hamt_decode_fn)(const char *key, size_t key_len,            \
+                                        const char *value, size_t value_len,         \
+                                        void **value_out, void *ctx);                \
                                                                                      \
-    name##_hamt_node **new_children =                                                \
-        name##_hamt_alloc_children(MAX_BRANCH_SIZE);                                 \
-    name##_hamt_node *child = NULL;                                                  \
-    int j = 0;                                                                       \
-    unsigned int hash = 0;                                                           \
+  typedef struct name##_hamt_log {                                                   \
+    hamt_log_file file;                                                              \
+    char *dir;                                                                       \
+    name##_hamt_encode_fn encode;                                                    \
+    name##_hamt_decode_fn decode;                                                    \
+    void *ctx;                                                                       \
+    /* logged operations between automatic checkpoints, 0 for none */                \
+    size_t checkpoint_every;                                                         \
+    size_t since_checkpoint;                                                         \
+    /* an operation was lost for lack of memory, so until the next                   \
+     * checkpoint the log can't restore the trie */                                  \
+    bool failed;                                                                     \
+  } name##_hamt_log;                                                                 \
                                                                                      \
-    for (unsigned int i = 0; i < SIZE; ++i) {                                        \
-      if (i != idx) {                                                                \
-        child = children[i];                                                         \
-        if (child != NULL) {                                                         \
-          new_children[j++] = child;                                                 \
-          hash |= 1 << i;                                                            \
-        }                                                                            \
+  /**                                                                                \
+   * Write what `hamt` holds now to its checkpoint and empty the log. A              \
+   * crash in between leaves a log that is already in the checkpoint,                \
+   * which does no harm: replaying it again ends in the same state.                  \
+   */ \
+  int name##_hamt_checkpoint(name##_hamt *hamt) {                                    \
+    name##_hamt_log *log = hamt->log;                                                \
+    hamt_static_table *table;                                                        \
+    int result = -1;                                                                 \
+                                                                                     \
+    if ((table = name##_hamt_to_static(hamt, log->encode, log->ctx)) != NULL &&      \
+        hamt_log_flush(&log->file) == 0 &&                                           \
+        hamt_write_file(log->dir, "checkpoint", table, table->size) == 0) {          \
+      if (ftruncate(log->file.fd, 0) == 0) {                                         \
+        log->since_checkpoint = 0;                                                   \
+        log->failed = false;                                                         \
+        result = 0;                                                                  \
+      } else {                                                                       \
+        fprintf(stderr, "Failed to truncate log: %s\n", strerror(errno));            \
       }                                                                              \
     }                                                                                \
+    free(table);                                                                     \
+    return result;                                                                   \
+  }                                                                                  \
+                                                                                     \
+  static void name##_hamt_log_append(name##_hamt *hamt, name *key, void *value,      \
+                                     unsigned int op) {                              \
+    name##_hamt_log *log = hamt->log;                                                \
+    hamt_static_entry entry = {0};                                                   \
                                                                                      \
-    return name##_hamt_create_branch(hash, new_children);                            \
+    log->encode(key, value, &entry, log->ctx);                                       \
+    if (op == HAMT_LOG_REMOVE) {                                                     \
+      entry.value_len = 0;                                                           \
+    }                                                                                \
+    if (hamt_log_append(&log->file, op, entry.key, entry.key_len, entry.value,       \
+                        entry.value_len) != 0) {                                     \
+      log->failed = true;                                                            \
+    } else if (log->checkpoint_every != 0 &&                                         \
+               ++log->since_checkpoint >= log->checkpoint_every &&                   \
+               name##_hamt_checkpoint(hamt) != 0) {                                  \
+      /* the log still holds everything, try again after as many more */             \
+      log->since_checkpoint = 0;                                                     \
+    }                                                                                \
   }                                                                                  \
                                                                                      \
   /**                                                                                \
-   * Returns a new array node with the child with key `rem->key` removed             \
-   * from the children                                                               \
-   *                                                                                 \
-   * Or if the total number of children is less than `MIN_ARRAY_NODE_SIZE`           \
-   * will compress the node to a branch node and create the branch node hash         \
-   */                                                                                \
-  static inline name##_hamt_node *name##_hamt_handle_arraynode_removal(              \
-      name##_hamt_removal_t *rem) {                                                  \
-    unsigned int idx = name##_hamt_get_frag(rem->hash, rem->depth);                  \
-                                                                                     \
-    /* The node we are looking at */                                                 \
-    name##_hamt_node *array_node = rem->node;                                        \
-    /* This is nasty as the bitmap is used for different things.                     \
-                         Here it is just a counter with the number of elements       \
-       in the array `children` */                                                    \
-                                                                                     \
-    int size = array_node->bitmap;                                                   \
-                                                                                     \
-    name##_hamt_node *child = array_node->children[idx];                             \
-    name##_hamt_node *new_child = NULL;                                              \
-                                                                                     \
-    if (child != NULL) {                                                             \
-      rem->node = child;                                                             \
-      rem->depth++;                                                                  \
-      /* go 'in' to the structure */                                                 \
-      new_child = name##_hamt_remove_node(rem);                                      \
+   * Write out the operations gathered so far, retrying a batch an earlier           \
+   * flush failed on. Returns -1 if that fails, and also while an earlier            \
+   * `set` or `remove` couldn't be logged at all, until a checkpoint                 \
+   * succeeds.                                                                       \
+   */ \
+  int name##_hamt_sync(name##_hamt *hamt) {                                          \
+    int result = hamt_log_flush(&hamt->log->file);                                   \
+                                                                                     \
+    return hamt->log->failed ? -1 : result;                                          \
+  }                                                                                  \
+                                                                                     \
+  /* Sync and stop logging, the trie itself stays */                                 \
+  int name##_hamt_close_log(name##_hamt *hamt) {                                     \
+    name##_hamt_log *log = hamt->log;                                                \
+    int result = name##_hamt_sync(hamt);                                             \
+                                                                                     \
+    close(log->file.fd);                                                             \
+    free(log->file.buf);                                                             \
+    free(log->dir);                                                                  \
+    free(log);                                                                       \
+    hamt->log = NULL;                                                                \
+    return result;                                                                   \
+  }                                                                                  \
+                                                                                     \
+  static void name##_hamt_replay(void *ctx, unsigned int op, const char *key,        \
+                                 unsigned int key_len, const char *value,            \
+                                 unsigned int value_len) {                           \
+    name##_hamt *hamt = (name##_hamt *)ctx;                                          \
+    name##_hamt_log *log = hamt->log;                                                \
+    void *decoded = NULL;                                                            \
+    name *k = log->decode(key, key_len, value, value_len, &decoded, log->ctx);       \
+                                                                                     \
+    if (k == NULL) {                                                                 \
+      return;                                                                        \
+    }                                                                                \
+    /* logging is off until the whole log has been read */                           \
+    hamt->log = NULL;                                                                \
+    if (op == HAMT_LOG_SET) {                                                        \
+      name##_hamt_set(hamt, k, decoded);                                             \
     } else {                                                                         \
-      new_child = NULL;                                                              \
+      name##_hamt_remove(hamt, k);                                                   \
+    }                                                                                \
+    hamt->log = log;                                                                 \
+  }                                                                                  \
+                                                                                     \
+  /**                                                                                \
+   * Open the trie kept in the directory `dir`, creating it if needed: the           \
+   * checkpoint is loaded in bulk and the log written since is replayed on           \
+   * top, so recovery costs one checkpoint interval of log at most. From             \
+   * then on every `set` and `remove` is logged, and after every                     \
+   * `checkpoint_every` of them (0 for never) a new checkpoint is taken.             \
+   * `encode` serializes keys and values as for `publish_shm`, with a NULL           \
+   * value for removes, and `decode` reverses it.                                    \
+   */ \
+  name##_hamt *name##_hamt_recover(const char *dir, name##_hamt_encode_fn encode,    \
+                                   name##_hamt_decode_fn decode, void *ctx,          \
+                                   size_t checkpoint_every) {                        \
+    name##_hamt_log *log;                                                            \
+    name##_hamt *hamt = NULL;                                                        \
+    char *path, *data = NULL;                                                        \
+    size_t size, valid;                                                              \
+                                                                                     \
+    if ((mkdir(dir, 0700) == -1 && errno != EEXIST) ||                               \
+        (log = (name##_hamt_log *)calloc(1, sizeof(name##_hamt_log))) == NULL) {     \
+      fprintf(stderr, "Failed to open %s\n", dir);                                   \
+      return NULL;                                                                   \
     }                                                                                \
+    log->file.fd = -1;                                                               \
+    log->dir = strdup(dir);                                                          \
+    log->encode = encode;                                                            \
+    log->decode = decode;                                                            \
+    log->ctx = ctx;                                                                  \
+    log->checkpoint_every = checkpoint_every;                                        \
                                                                                      \
-    if (child == new_child) {                                                        \
-      return array_node;                                                             \
+    /* the checkpoint, built in one pass */                                          \
+    if (log->dir == NULL || (path = hamt_path(dir, "checkpoint")) == NULL) {         \
+      goto fail;                                                                     \
+    }                                                                                \
+    data = hamt_read_file(path, &size);                                              \
+    free(path);                                                                      \
+    if (data == NULL) {                                                              \
+      goto fail;                                                                     \
     }                                                                                \
+    if (size == 0) {                                                                 \
+      hamt = name##_hamt_new();                                                      \
+    } else {                                                                         \
+      const hamt_static_table *table = (const hamt_static_table *)data;              \
+      name **keys;                                                                   \
+      void **values;                                                                 \
+      size_t n = 0;                                                                  \
+                                                                                     \
+      if (size < sizeof(*table) || table->magic != HAMT_STATIC_MAGIC ||              \
+          table->size != size) {                                                     \
+        fprintf(stderr, "Bad checkpoint in %s\n", dir);                              \
+        goto fail;                                                                   \
+      }                                                                              \
+      keys = (name **)malloc(sizeof(name *) * (table->leaf_count + 1));              \
+      values = (void **)malloc(sizeof(void *) * (table->leaf_count + 1));            \
+      if (keys == NULL || values == NULL) {                                          \
+        fprintf(stderr, "Failed to allocate memory for checkpoint\n");               \
+        free(keys);                                                                  \
+        free(values);                                                                \
+        goto fail;                                                                   \
+      }                                                                              \
+      for (unsigned int i = 0; i < table->leaf_count; ++i) {                         \
+        const hamt_static_leaf *leaf = &hamt_static_leaves(table)[i];                \
+        const char *pool = hamt_static_pool(table);                                  \
                                                                                      \
-    if (child != NULL && new_child == NULL) {                                        \
-      if ((size - 1) <= MIN_ARRAY_NODE_SIZE) {                                       \
-        return name##_hamt_compress_array_to_branch(idx,                             \
-                                                    array_node->children);           \
+        values[n] = NULL;                                                            \
+        if ((keys[n] = decode(pool + leaf->key, leaf->key_len,                       \
+                              pool + leaf->value, leaf->value_len, &values[n],       \
+                              ctx)) != NULL) {                                       \
+          n++;                                                                       \
+        }                                                                            \
       }                                                                              \
-      name##_hamt_replace_child(array_node, NULL, idx);                              \
-      return name##_hamt_create_arraynode(array_node->children,                      \
-                                          array_node->bitmap - 1);                   \
+      hamt = name##_hamt_from_array(keys, values, n);                                \
+      free(keys);                                                                    \
+      free(values);                                                                  \
+    }                                                                                \
+    free(data);                                                                      \
+    data = NULL;                                                                     \
+    if (hamt == NULL) {                                                              \
+      goto fail;                                                                     \
     }                                                                                \
                                                                                      \
-    name##_hamt_replace_child(array_node, new_child, idx);                           \
-    return name##_hamt_create_arraynode(array_node->children,                        \
-                                        array_node->bitmap);                         \
+    /* then the log tail, cut back to its last intact record */                      \
+    if ((path = hamt_path(dir, "log")) == NULL) {                                    \
+      goto fail;                                                                     \
+    }                                                                                \
+    if ((data = hamt_read_file(path, &size)) == NULL ||                              \
+        (log->file.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600)) == -1) {    \
+      fprintf(stderr, "Failed to open log in %s\n", dir);                            \
+      free(path);                                                                    \
+      goto fail;                                                                     \
+    }                                                                                \
+    free(path);                                                                      \
+    hamt->log = log;                                                                 \
+    valid = hamt_log_replay(data, size, name##_hamt_replay, hamt);                   \
+    if (valid < size && ftruncate(log->file.fd, valid) == -1) {                      \
+      fprintf(stderr, "Failed to truncate log: %s\n", strerror(errno));              \
+      hamt->log = NULL;                                                              \
+      goto fail;                                                                     \
+    }                                                                                \
+    free(data);                                                                      \
+    return hamt;                                                                     \
+                                                                                     \
+  fail:                                                                              \
+    if (log->file.fd != -1) {                                                        \
+      close(log->file.fd);                                                           \
+    }                                                                                \
+    free(data);                                                                      \
+    free(log->dir);                                                                  \
+    free(log);                                                                       \
+    if (hamt != NULL && hamt->root != NULL) {                                        \
+      name##_hamt_free_nodes(hamt, hamt->root);                                      \
+    }                                                                                \
+    free(hamt);                                                                      \
+    return NULL;                                                                     \
+  }                                                                                  \
+  /* ====== Tracing ====== */                                                        \
+  typedef struct name##_hamt_trace {                                                 \
+    FILE *file;                                                                      \
+    struct timespec start;                                                           \
+    name##_hamt_encode_fn encode;                                                    \
+    void *ctx;                                                                       \
+  } name##_hamt_trace;                                                               \
+                                                                                     \
+  static void name##_hamt_trace_op(name##_hamt *hamt, name *key,                     \
+                                   unsigned int hash, unsigned int op) {             \
+    name##_hamt_trace *trace = hamt->trace;                                          \
+    hamt_static_entry entry = {0};                                                   \
+                                                                                     \
+    trace->encode(key, NULL, &entry, trace->ctx);                                    \
+    hamt_trace_write(trace->file, hamt_trace_now(&trace->start), op, hash,           \
+                     entry.key, entry.key_len);                                      \
   }                                                                                  \
                                                                                      \
   /**                                                                                \
-   * Remove a node from the tree, the delete happens on the leaf or                  \
-   * collision node layer.                                                           \
-   *                                                                                 \
-   * I've been testing this rather horribly with a counter to ensure                 \
-   * the 466550 from the test dictionary actually get removed.                       \
-   */                                                                                \
-  name##_hamt *name##_hamt_remove(name##_hamt *hamt, name *key) {                    \
-    unsigned int hash = hashof(key);                                                 \
-    name##_hamt_removal_t rem;                                                       \
-    rem.hash = hash;                                                                 \
-    rem.depth = 0;                                                                   \
-    rem.key = key;                                                                   \
-    rem.node = hamt->root;                                                           \
+   * Record every `get`, `set` and `remove` on `hamt` to the trace file at           \
+   * `path`, with the key bytes `encode` gives for each key. The value it            \
+   * is handed is always NULL. Start and stop while no other calls are               \
+   * running. Returns 0, or -1 if the file can't be created.                         \
+   */ \
+  int name##_hamt_trace_start(name##_hamt *hamt, const char *path,                   \
+                              name##_hamt_encode_fn encode, void *ctx) {             \
+    name##_hamt_trace *trace;                                                        \
+    unsigned int magic = HAMT_TRACE_MAGIC;                                           \
                                                                                      \
-    if (hamt->root != NULL) {                                                        \
-      hamt->root = name##_hamt_remove_node(&rem);                                    \
+    if ((trace = (name##_hamt_trace *)malloc(sizeof(name##_hamt_trace))) ==          \
+        NULL) {                                                                      \
+      fprintf(stderr, "Failed to allocate memory for trace\n");                      \
+      return -1;                                                                     \
     }                                                                                \
+    if ((trace->file = fopen(path, "w")) == NULL ||                                  \
+        fwrite(&magic, sizeof(magic), 1, trace->file) != 1) {                        \
+      fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));           \
+      if (trace->file != NULL) {                                                     \
+        fclose(trace->file);                                                         \
+      }                                                                              \
+      free(trace);                                                                   \
+      return -1;                                                                     \
+    }                                                                                \
+    clock_gettime(CLOCK_MONOTONIC, &trace->start);                                   \
+    trace->encode = encode;                                                          \
+    trace->ctx = ctx;                                                                \
+    hamt->trace = trace;                                                             \
+    return 0;                                                                        \
+  }                                                                                  \
                                                                                      \
-    return hamt;                                                                     \
+  /* Stop tracing and close the trace, returning -1 if writing it failed */          \
+  int name##_hamt_trace_stop(name##_hamt *hamt) {                                    \
+    name##_hamt_trace *trace = hamt->trace;                                          \
+    int result = ferror(trace->file) ? -1 : 0;                                       \
+                                                                                     \
+    if (fclose(trace->file) != 0) {                                                  \
+      result = -1;                                                                   \
+    }                                                                                \
+    free(trace);                                                                     \
+    hamt->trace = NULL;                                                              \
+    return result;                                                                   \
   }                                                                                  \
                                                                                      \
   /* ====== Visiting functions ====== */                                             \
@@ -811,17 +5507,10 @@ HAMT_DEFINE(MyKeyType, get_hash_of_mykeytype, mykeytype_equals)
     if (hamt) {                                                                      \
       switch (hamt->type) {                                                          \
       case ARRAY_NODE:                                                               \
-      case BRANCH: {                                                                 \
-        int len = name##_hamt_popcount(hamt->bitmap);                                \
-        for (int i = 0; i < len; ++i) {                                              \
-          name##_hamt_node *child = hamt->children[i];                               \
-          name##_hamt_visit_all_nodes(child, visitor);                               \
-        }                                                                            \
-        return;                                                                      \
-      }                                                                              \
+      case BRANCH:                                                                   \
       case COLLISION: {                                                              \
-        int len = name##_hamt_popcount(hamt->bitmap);                                \
-        for (int i = 0; i < len; ++i) {                                              \
+        unsigned int len = name##_hamt_slots(hamt);                                  \
+        for (unsigned int i = 0; i < len; ++i) {                                     \
           name##_hamt_node *child = hamt->children[i];                               \
           name##_hamt_visit_all_nodes(child, visitor);                               \
         }                                                                            \
@@ -0,0 +1,913 @@
+/** hamt-poly -- C++ containers over the hamt.h trie.
+
+`hamt::map<K, V, Hash, Eq, Alloc>` and `hamt::set<K, Hash, Eq, Alloc>`
+store their entries in the same trie as `HAMT_DEFINE`: Leaves, Branches
+indexed by a bitmap, ArrayNodes and Collision nodes, with children
+stored right behind their node. Branches turn into ArrayNodes past 16
+children and back below 8, as in hamt.h. The last template parameter
+selects 4, 5 or 6 hash bits per level, like `HAMT_DEFINE_EX`.
+
+Unlike the C instantiations, keys and values live inside the leaves
+rather than behind `name *` and `void *`, they are moved in rather than
+copied, and the hash and equality functors are template parameters, so
+they are inlined. Nodes come from `Alloc`, which may be a
+`std::pmr::polymorphic_allocator`; `hamt::pmr::map` and `hamt::pmr::set`
+are spelled that way.
+
+Any insert or erase invalidates iterators. Requires C++17.
+
+Same licence as hamt.h.
+*/
+#ifndef HAMT_HPP
+#define HAMT_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace hamt {
+namespace detail {
+
+enum class node_type : std::uint8_t { leaf, branch, collision, array_node };
+
+/* Same bit counts as `name_hamt_popcount` */
+inline int popcount(std::uint32_t bits) {
+  bits -= (bits >> 1) & 0x55555555;
+  bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+  bits = (bits & 0x0F0F0F0F) + ((bits >> 4) & 0x0F0F0F0F);
+  bits += bits >> 8;
+  return (bits + (bits >> 16)) & 0x3F;
+}
+
+inline int popcount(std::uint64_t bits) {
+  return popcount(static_cast<std::uint32_t>(bits)) +
+         popcount(static_cast<std::uint32_t>(bits >> 32));
+}
+
+/* Tries are indexed by 32 bits of hash, as in hamt.h */
+inline std::uint32_t fold(std::size_t hash) {
+  if constexpr (sizeof(std::size_t) > sizeof(std::uint32_t)) {
+    return static_cast<std::uint32_t>(hash ^ (hash >> 32));
+  } else {
+    return static_cast<std::uint32_t>(hash);
+  }
+}
+
+struct key_of_pair {
+  template <class Pair> const auto &operator()(const Pair &pair) const {
+    return pair.first;
+  }
+};
+
+struct key_of_self {
+  template <class Key> const Key &operator()(const Key &key) const {
+    return key;
+  }
+};
+
+/**
+ * The trie behind `map` and `set`. `Value` is what a leaf holds and
+ * `KeyOf` picks the key out of it.
+ */
+template <class Key, class Value, class KeyOf, class Hash, class Eq,
+          class Alloc, unsigned Bits>
+class trie {
+  static_assert(Bits >= 4 && Bits <= 6, "4, 5 or 6 bits per level");
+
+public:
+  using key_type = Key;
+  using value_type = Value;
+  using size_type = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using hasher = Hash;
+  using key_equal = Eq;
+  using allocator_type = Alloc;
+
+  static constexpr unsigned bits = Bits;
+  static constexpr unsigned branching = 1U << Bits;
+  static constexpr unsigned max_branch_size = branching / 2;
+  static constexpr unsigned min_array_node_size = branching / 4;
+
+protected:
+  using bitmap = std::conditional_t<(Bits > 5), std::uint64_t, std::uint32_t>;
+
+  /**
+   * `hash` is the key hash of a Leaf or Collision node, and the child
+   * bitmap of a Branch. `count` is the number of children, and
+   * `capacity` the number of child slots allocated behind the node.
+   */
+  struct alignas(void *) node {
+    node_type type;
+    std::uint32_t count;
+    std::uint32_t capacity;
+    bitmap hash;
+  };
+
+  struct inner : node {
+    node **children() { return reinterpret_cast<node **>(this + 1); }
+  };
+
+  /* An aggregate, so trivially copyable entries can be copied as bytes */
+  struct leaf : node {
+    value_type value;
+  };
+
+  /* Allocation granule, aligned for any node */
+  struct alignas(alignof(leaf) > alignof(node) ? alignof(leaf)
+                                               : alignof(node)) unit {
+    unsigned char bytes[alignof(leaf) > alignof(node) ? alignof(leaf)
+                                                      : alignof(node)];
+  };
+
+  using unit_allocator =
+      typename std::allocator_traits<Alloc>::template rebind_alloc<unit>;
+  using unit_traits = std::allocator_traits<unit_allocator>;
+
+  /* Inner nodes on a path from the root: one per level and a Collision */
+  static constexpr unsigned max_depth = 32 / Bits + 2;
+
+  struct frame {
+    node *at;
+    unsigned next;
+  };
+
+  template <bool Const> class iterator_base {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = typename trie::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = std::conditional_t<Const, const value_type *, value_type *>;
+    using reference =
+        std::conditional_t<Const, const value_type &, value_type &>;
+
+    iterator_base() = default;
+
+    template <bool C = Const, class = std::enable_if_t<C>>
+    iterator_base(const iterator_base<false> &other)
+        : owner_(other.owner_), stack_(other.stack_), depth_(other.depth_),
+          leaf_(other.leaf_) {}
+
+    reference operator*() const { return leaf_->value; }
+    pointer operator->() const { return &leaf_->value; }
+
+    iterator_base &operator++() {
+      next();
+      return *this;
+    }
+
+    iterator_base operator++(int) {
+      iterator_base old = *this;
+      next();
+      return old;
+    }
+
+    friend bool operator==(const iterator_base &a, const iterator_base &b) {
+      return a.leaf_ == b.leaf_;
+    }
+    friend bool operator!=(const iterator_base &a, const iterator_base &b) {
+      return a.leaf_ != b.leaf_;
+    }
+
+  private:
+    friend class trie;
+    template <bool> friend class iterator_base;
+
+    /* Move on to the next leaf, depth first */
+    void next() {
+      if (owner_ != nullptr) {
+        owner_->find_leaf(KeyOf()(leaf_->value), stack_.data(), &depth_);
+        owner_ = nullptr;
+      }
+      while (depth_ > 0) {
+        frame &top = stack_[depth_ - 1];
+        unsigned slots = trie::slots(top.at);
+        node **children = trie::children(top.at);
+
+        while (top.next < slots && children[top.next] == nullptr) {
+          top.next++;
+        }
+        if (top.next == slots) {
+          depth_--;
+          continue;
+        }
+        node *child = children[top.next++];
+        if (child->type == node_type::leaf) {
+          leaf_ = static_cast<leaf *>(child);
+          return;
+        }
+        stack_[depth_++] = frame{child, 0};
+      }
+      leaf_ = nullptr;
+    }
+
+    /* set when only the leaf is known, the path to it is found lazily */
+    const trie *owner_ = nullptr;
+    std::array<frame, max_depth> stack_;
+    unsigned depth_ = 0;
+    leaf *leaf_ = nullptr;
+  };
+
+public:
+  using iterator = iterator_base<false>;
+  using const_iterator = iterator_base<true>;
+
+  trie() = default;
+
+  explicit trie(const Alloc &alloc) : alloc_(alloc) {}
+
+  trie(const trie &other)
+      : hash_(other.hash_), eq_(other.eq_),
+        alloc_(unit_traits::select_on_container_copy_construction(
+            other.alloc_)) {
+    root_ = clone(other.root_);
+    size_ = other.size_;
+  }
+
+  trie(trie &&other) noexcept
+      : root_(std::exchange(other.root_, nullptr)),
+        size_(std::exchange(other.size_, 0)), hash_(std::move(other.hash_)),
+        eq_(std::move(other.eq_)), alloc_(std::move(other.alloc_)) {}
+
+  trie &operator=(const trie &other) {
+    if (this != &other) {
+      clear();
+      if constexpr (unit_traits::propagate_on_container_copy_assignment::
+                        value) {
+        alloc_ = other.alloc_;
+      }
+      hash_ = other.hash_;
+      eq_ = other.eq_;
+      root_ = clone(other.root_);
+      size_ = other.size_;
+    }
+    return *this;
+  }
+
+  /* Takes the nodes over when the allocators allow, copies them if not */
+  trie &operator=(trie &&other) noexcept(
+      unit_traits::propagate_on_container_move_assignment::value ||
+      unit_traits::is_always_equal::value) {
+    if (this == &other) {
+      return *this;
+    }
+    clear();
+    hash_ = std::move(other.hash_);
+    eq_ = std::move(other.eq_);
+    if constexpr (unit_traits::propagate_on_container_move_assignment::value) {
+      alloc_ = std::move(other.alloc_);
+    } else if (alloc_ != other.alloc_) {
+      root_ = clone(other.root_);
+      size_ = other.size_;
+      return *this;
+    }
+    root_ = std::exchange(other.root_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+    return *this;
+  }
+
+  ~trie() { clear(); }
+
+  void swap(trie &other) noexcept {
+    using std::swap;
+    swap(root_, other.root_);
+    swap(size_, other.size_);
+    swap(hash_, other.hash_);
+    swap(eq_, other.eq_);
+    if constexpr (unit_traits::propagate_on_container_swap::value) {
+      swap(alloc_, other.alloc_);
+    }
+  }
+
+  friend void swap(trie &a, trie &b) noexcept { a.swap(b); }
+
+  allocator_type get_allocator() const { return allocator_type(alloc_); }
+  hasher hash_function() const { return hash_; }
+  key_equal key_eq() const { return eq_; }
+
+  size_type size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  void clear() {
+    if (root_ != nullptr) {
+      destroy(root_);
+      root_ = nullptr;
+      size_ = 0;
+    }
+  }
+
+  iterator begin() { return first<false>(); }
+  iterator end() { return iterator(); }
+  const_iterator begin() const { return first<true>(); }
+  const_iterator end() const { return const_iterator(); }
+  const_iterator cbegin() const { return first<true>(); }
+  const_iterator cend() const { return const_iterator(); }
+
+  iterator find(const key_type &key) {
+    return at_leaf<false>(find_leaf(key, nullptr, nullptr));
+  }
+
+  const_iterator find(const key_type &key) const {
+    return at_leaf<true>(find_leaf(key, nullptr, nullptr));
+  }
+
+  bool contains(const key_type &key) const {
+    return find_leaf(key, nullptr, nullptr) != nullptr;
+  }
+
+  size_type count(const key_type &key) const { return contains(key); }
+
+  size_type erase(const key_type &key) {
+    if (root_ == nullptr || !erase_at(&root_, 0, hash_of(key), key)) {
+      return 0;
+    }
+    size_--;
+    return 1;
+  }
+
+protected:
+  std::uint32_t hash_of(const key_type &key) const {
+    return fold(hash_(key));
+  }
+
+  bool matches(node *n, const key_type &key) const {
+    return eq_(KeyOf()(static_cast<leaf *>(n)->value), key);
+  }
+
+  static unsigned frag(bitmap hash, unsigned depth) {
+    return static_cast<unsigned>(hash >> (Bits * depth)) & (branching - 1);
+  }
+
+  static bitmap bit(unsigned frag) { return bitmap(1) << frag; }
+
+  static unsigned slots(node *n) {
+    return n->type == node_type::array_node ? branching : n->count;
+  }
+
+  static node **children(node *n) {
+    return static_cast<inner *>(n)->children();
+  }
+
+  static bool is_leaf(node *n) {
+    return n->type == node_type::leaf || n->type == node_type::collision;
+  }
+
+  /* ====== Allocation ====== */
+  static std::size_t units(std::size_t bytes) {
+    return (bytes + sizeof(unit) - 1) / sizeof(unit);
+  }
+
+  void *allocate(std::size_t bytes) {
+    return unit_traits::allocate(alloc_, units(bytes));
+  }
+
+  void deallocate(void *p, std::size_t bytes) {
+    unit_traits::deallocate(alloc_, static_cast<unit *>(p), units(bytes));
+  }
+
+  inner *make_inner(node_type type, bitmap hash, std::uint32_t count,
+                    std::uint32_t capacity) {
+    void *p = allocate(sizeof(inner) + sizeof(node *) * capacity);
+    inner *n = ::new (p) inner{{type, count, capacity, hash}};
+
+    std::memset(n->children(), 0, sizeof(node *) * capacity);
+    return n;
+  }
+
+  void free_inner(node *n) {
+    deallocate(n, sizeof(inner) + sizeof(node *) * n->capacity);
+  }
+
+  template <class... Args>
+  leaf *make_leaf(std::uint32_t hash, Args &&...args) {
+    void *p = allocate(sizeof(leaf));
+
+    try {
+      return ::new (p) leaf{{node_type::leaf, 0, 0, hash},
+                            value_type(std::forward<Args>(args)...)};
+    } catch (...) {
+      deallocate(p, sizeof(leaf));
+      throw;
+    }
+  }
+
+  void free_leaf(leaf *l) {
+    if constexpr (!std::is_trivially_destructible_v<value_type>) {
+      l->~leaf();
+    }
+    deallocate(l, sizeof(leaf));
+  }
+
+  void destroy(node *n) {
+    if (n->type == node_type::leaf) {
+      free_leaf(static_cast<leaf *>(n));
+      return;
+    }
+    for (unsigned i = 0; i < slots(n); ++i) {
+      if (children(n)[i] != nullptr) {
+        destroy(children(n)[i]);
+      }
+    }
+    free_inner(n);
+  }
+
+  node *clone(node *n) {
+    if (n == nullptr) {
+      return nullptr;
+    }
+    if (n->type == node_type::leaf) {
+      if constexpr (std::is_trivially_copyable_v<value_type>) {
+        void *p = allocate(sizeof(leaf));
+        std::memcpy(p, n, sizeof(leaf));
+        return std::launder(static_cast<leaf *>(p));
+      } else {
+        return make_leaf(static_cast<std::uint32_t>(n->hash),
+                         static_cast<leaf *>(n)->value);
+      }
+    }
+
+    inner *copy = make_inner(n->type, n->hash, n->count, n->capacity);
+    try {
+      for (unsigned i = 0; i < slots(n); ++i) {
+        copy->children()[i] = clone(children(n)[i]);
+      }
+    } catch (...) {
+      destroy(copy);
+      throw;
+    }
+    return copy;
+  }
+
+  /* ====== Lookup ====== */
+  /**
+   * Find the leaf holding `key`. With a `path`, also record the inner
+   * nodes above it for an iterator to carry on from.
+   */
+  leaf *find_leaf(const key_type &key, frame *path, unsigned *depth) const {
+    std::uint32_t hash = hash_of(key);
+    node *n = root_;
+
+    for (unsigned level = 0; n != nullptr; ++level) {
+      unsigned pos = 0;
+
+      switch (n->type) {
+      case node_type::leaf:
+        return n->hash == hash && matches(n, key) ? static_cast<leaf *>(n)
+                                                  : nullptr;
+      case node_type::collision:
+        if (n->hash != hash) {
+          return nullptr;
+        }
+        for (pos = 0; pos < n->count && !matches(children(n)[pos], key);) {
+          pos++;
+        }
+        if (pos == n->count) {
+          return nullptr;
+        }
+        break;
+      case node_type::branch: {
+        bitmap b = bit(frag(hash, level));
+        if (!(n->hash & b)) {
+          return nullptr;
+        }
+        pos = popcount(n->hash & (b - 1));
+        break;
+      }
+      case node_type::array_node:
+        pos = frag(hash, level);
+        break;
+      }
+
+      if (path != nullptr) {
+        path[(*depth)++] = frame{n, pos + 1};
+      }
+      n = children(n)[pos];
+    }
+    return nullptr;
+  }
+
+  template <bool Const> iterator_base<Const> at_leaf(leaf *l) const {
+    iterator_base<Const> it;
+
+    it.leaf_ = l;
+    it.owner_ = l != nullptr ? this : nullptr;
+    return it;
+  }
+
+  template <bool Const> iterator_base<Const> first() const {
+    iterator_base<Const> it;
+
+    if (root_ != nullptr && root_->type == node_type::leaf) {
+      it.leaf_ = static_cast<leaf *>(root_);
+    } else if (root_ != nullptr) {
+      it.stack_[it.depth_++] = frame{root_, 0};
+      it.next();
+    }
+    return it;
+  }
+
+  /* ====== Insertion ====== */
+  /**
+   * Find the leaf for `key`, or create it with `make` and hang it in the
+   * trie. The second member tells whether it was created.
+   */
+  template <class Make>
+  std::pair<leaf *, bool> emplace_leaf(std::uint32_t hash,
+                                       const key_type &key, Make &&make) {
+    node **slot = &root_;
+    inner *array = nullptr;
+    unsigned depth = 0;
+
+    for (node *n; (n = *slot) != nullptr; ++depth) {
+      if (n->type == node_type::leaf) {
+        if (n->hash == hash && matches(n, key)) {
+          return {static_cast<leaf *>(n), false};
+        }
+        break;
+      }
+      if (n->type == node_type::collision) {
+        for (unsigned i = 0; n->hash == hash && i < n->count; ++i) {
+          if (matches(children(n)[i], key)) {
+            return {static_cast<leaf *>(children(n)[i]), false};
+          }
+        }
+        break;
+      }
+      if (n->type == node_type::branch) {
+        bitmap b = bit(frag(hash, depth));
+        if (!(n->hash & b)) {
+          break;
+        }
+        array = nullptr;
+        slot = &children(n)[popcount(n->hash & (b - 1))];
+      } else {
+        array = static_cast<inner *>(n);
+        slot = &children(n)[frag(hash, depth)];
+      }
+    }
+
+    leaf *l = make();
+    try {
+      place(slot, array, depth, l);
+    } catch (...) {
+      free_leaf(l);
+      throw;
+    }
+    size_++;
+    return {l, true};
+  }
+
+  /* Hang the new leaf `l` at `*slot`, where the descent stopped */
+  void place(node **slot, inner *array, unsigned depth, leaf *l) {
+    node *n = *slot;
+
+    if (n == nullptr) {
+      *slot = l;
+      if (array != nullptr) {
+        array->count++;
+      }
+    } else if (n->type == node_type::collision && n->hash == l->hash) {
+      *slot = with_child(static_cast<inner *>(n), n->count, l);
+    } else if (is_leaf(n)) {
+      *slot = merge(n, l, depth);
+    } else if (n->count >= max_branch_size) {
+      *slot = expand(static_cast<inner *>(n), depth, l);
+    } else {
+      bitmap b = bit(frag(l->hash, depth));
+      inner *grown = with_child(static_cast<inner *>(n),
+                                popcount(n->hash & (b - 1)), l);
+      grown->hash |= b;
+      *slot = grown;
+    }
+  }
+
+  /**
+   * `n` with `child` inserted at `pos`. Room left by earlier removals is
+   * reused, otherwise the node is copied with the children sized exactly.
+   */
+  inner *with_child(inner *n, unsigned pos, node *child) {
+    inner *target = n;
+
+    if (n->count == n->capacity) {
+      target = make_inner(n->type, n->hash, n->count, n->count + 1);
+      std::memcpy(target->children(), n->children(), sizeof(node *) * pos);
+    }
+    std::memmove(target->children() + pos + 1, n->children() + pos,
+                 sizeof(node *) * (n->count - pos));
+    target->children()[pos] = child;
+    target->count++;
+    if (target != n) {
+      free_inner(n);
+    }
+    return target;
+  }
+
+  /* Join two leaves, `a` being a Leaf or Collision node, at `depth` */
+  node *merge(node *a, node *b, unsigned depth) {
+    if (a->hash == b->hash) {
+      inner *collision = make_inner(node_type::collision, a->hash, 2, 2);
+      collision->children()[0] = a;
+      collision->children()[1] = b;
+      return collision;
+    }
+
+    unsigned fa = frag(a->hash, depth), fb = frag(b->hash, depth);
+    if (fa == fb) {
+      inner *branch = make_inner(node_type::branch, bit(fa), 1, 1);
+      try {
+        branch->children()[0] = merge(a, b, depth + 1);
+      } catch (...) {
+        free_inner(branch);
+        throw;
+      }
+      return branch;
+    }
+
+    inner *branch = make_inner(node_type::branch, bit(fa) | bit(fb), 2, 2);
+    branch->children()[fa > fb] = a;
+    branch->children()[fa < fb] = b;
+    return branch;
+  }
+
+  /* A full Branch becomes an ArrayNode holding its children and `l` */
+  inner *expand(inner *branch, unsigned depth, leaf *l) {
+    inner *array =
+        make_inner(node_type::array_node, 0, branch->count + 1, branching);
+    unsigned pos = 0;
+
+    for (unsigned i = 0; i < branching; ++i) {
+      if (branch->hash & bit(i)) {
+        array->children()[i] = branch->children()[pos++];
+      }
+    }
+    array->children()[frag(l->hash, depth)] = l;
+    free_inner(branch);
+    return array;
+  }
+
+  /* ====== Removal ====== */
+  void remove_child(inner *n, unsigned pos) {
+    std::memmove(n->children() + pos, n->children() + pos + 1,
+                 sizeof(node *) * (n->count - pos - 1));
+    n->count--;
+  }
+
+  /* A Branch left with a single Leaf or Collision node is replaced by it */
+  node *collapse(inner *branch) {
+    node *only = branch->count == 0 ? nullptr : branch->children()[0];
+
+    if (only == nullptr || (branch->count == 1 && is_leaf(only))) {
+      free_inner(branch);
+      return only;
+    }
+    return branch;
+  }
+
+  /* An ArrayNode that has become sparse goes back to being a Branch */
+  node *compress(inner *array) {
+    inner *branch =
+        make_inner(node_type::branch, 0, array->count, array->count);
+    unsigned pos = 0;
+
+    for (unsigned i = 0; i < branching; ++i) {
+      if (array->children()[i] != nullptr) {
+        branch->hash |= bit(i);
+        branch->children()[pos++] = array->children()[i];
+      }
+    }
+    free_inner(array);
+    return collapse(branch);
+  }
+
+  bool erase_at(node **slot, unsigned depth, std::uint32_t hash,
+                const key_type &key) {
+    node *n = *slot;
+
+    switch (n->type) {
+    case node_type::leaf:
+      if (n->hash != hash || !matches(n, key)) {
+        return false;
+      }
+      free_leaf(static_cast<leaf *>(n));
+      *slot = nullptr;
+      return true;
+    case node_type::collision:
+      for (unsigned i = 0; n->hash == hash && i < n->count; ++i) {
+        if (matches(children(n)[i], key)) {
+          free_leaf(static_cast<leaf *>(children(n)[i]));
+          remove_child(static_cast<inner *>(n), i);
+          *slot = collapse(static_cast<inner *>(n));
+          return true;
+        }
+      }
+      return false;
+    case node_type::branch: {
+      bitmap b = bit(frag(hash, depth));
+      unsigned pos = popcount(n->hash & (b - 1));
+
+      if (!(n->hash & b) || !erase_at(&children(n)[pos], depth + 1, hash, key)) {
+        return false;
+      }
+      if (children(n)[pos] == nullptr) {
+        remove_child(static_cast<inner *>(n), pos);
+        n->hash &= ~b;
+      }
+      *slot = collapse(static_cast<inner *>(n));
+      return true;
+    }
+    case node_type::array_node: {
+      node **child = &children(n)[frag(hash, depth)];
+
+      if (*child == nullptr || !erase_at(child, depth + 1, hash, key)) {
+        return false;
+      }
+      if (*child == nullptr && --n->count < min_array_node_size) {
+        *slot = compress(static_cast<inner *>(n));
+      }
+      return true;
+    }
+    }
+    return false;
+  }
+
+  node *root_ = nullptr;
+  size_type size_ = 0;
+  Hash hash_;
+  Eq eq_;
+  unit_allocator alloc_;
+};
+
+} // namespace detail
+
+/**
+ * A hash map on the hamt.h trie. Values are created in place by
+ * `try_emplace` and `operator[]`, and replaced by `insert_or_assign`.
+ */
+template <class Key, class T, class Hash = std::hash<Key>,
+          class Eq = std::equal_to<Key>,
+          class Alloc = std::allocator<std::pair<const Key, T>>,
+          unsigned Bits = 5>
+class map : public detail::trie<Key, std::pair<const Key, T>,
+                                detail::key_of_pair, Hash, Eq, Alloc, Bits> {
+  using base = detail::trie<Key, std::pair<const Key, T>, detail::key_of_pair,
+                            Hash, Eq, Alloc, Bits>;
+
+public:
+  using mapped_type = T;
+  using typename base::iterator;
+  using typename base::key_type;
+  using typename base::value_type;
+
+  using base::base;
+
+  template <class... Args>
+  std::pair<iterator, bool> try_emplace(const key_type &key, Args &&...args) {
+    return emplace_key(key, key, std::forward<Args>(args)...);
+  }
+
+  template <class... Args>
+  std::pair<iterator, bool> try_emplace(key_type &&key, Args &&...args) {
+    return emplace_key(key, std::move(key), std::forward<Args>(args)...);
+  }
+
+  template <class M>
+  std::pair<iterator, bool> insert_or_assign(const key_type &key, M &&value) {
+    auto result = try_emplace(key, std::forward<M>(value));
+    if (!result.second) {
+      result.first->second = std::forward<M>(value);
+    }
+    return result;
+  }
+
+  template <class M>
+  std::pair<iterator, bool> insert_or_assign(key_type &&key, M &&value) {
+    auto result = try_emplace(std::move(key), std::forward<M>(value));
+    if (!result.second) {
+      result.first->second = std::forward<M>(value);
+    }
+    return result;
+  }
+
+  std::pair<iterator, bool> insert(const value_type &value) {
+    return try_emplace(value.first, value.second);
+  }
+
+  std::pair<iterator, bool> insert(value_type &&value) {
+    return emplace_key(value.first, std::move(value));
+  }
+
+  template <class... Args> std::pair<iterator, bool> emplace(Args &&...args) {
+    value_type value(std::forward<Args>(args)...);
+    return emplace_key(value.first, std::move(value));
+  }
+
+  T &operator[](const key_type &key) { return try_emplace(key).first->second; }
+  T &operator[](key_type &&key) {
+    return try_emplace(std::move(key)).first->second;
+  }
+
+  T &at(const key_type &key) {
+    auto *leaf = this->find_leaf(key, nullptr, nullptr);
+    if (leaf == nullptr) {
+      throw std::out_of_range("hamt::map::at");
+    }
+    return leaf->value.second;
+  }
+
+  const T &at(const key_type &key) const {
+    return const_cast<map *>(this)->at(key);
+  }
+
+private:
+  /**
+   * Create the entry for `key` from `args` unless it exists. `key` is
+   * only read before `args` get moved into the new leaf.
+   */
+  template <class K, class... Args>
+  std::pair<iterator, bool> emplace_key(const key_type &key, K &&first,
+                                        Args &&...args) {
+    std::uint32_t hash = this->hash_of(key);
+    auto result = this->emplace_leaf(hash, key, [&] {
+      if constexpr (std::is_same_v<std::decay_t<K>, value_type>) {
+        return this->make_leaf(hash, std::forward<K>(first));
+      } else {
+        return this->make_leaf(
+            hash, std::piecewise_construct,
+            std::forward_as_tuple(std::forward<K>(first)),
+            std::forward_as_tuple(std::forward<Args>(args)...));
+      }
+    });
+    return {this->template at_leaf<false>(result.first), result.second};
+  }
+};
+
+/* A hash set on the hamt.h trie, keys can't be changed in place */
+template <class Key, class Hash = std::hash<Key>, class Eq = std::equal_to<Key>,
+          class Alloc = std::allocator<Key>, unsigned Bits = 5>
+class set : public detail::trie<Key, Key, detail::key_of_self, Hash, Eq,
+                                Alloc, Bits> {
+  using base =
+      detail::trie<Key, Key, detail::key_of_self, Hash, Eq, Alloc, Bits>;
+
+public:
+  using iterator = typename base::const_iterator;
+  using const_iterator = typename base::const_iterator;
+  using typename base::key_type;
+  using typename base::value_type;
+
+  using base::base;
+
+  iterator begin() const { return base::cbegin(); }
+  iterator end() const { return base::cend(); }
+  iterator find(const key_type &key) const { return base::find(key); }
+
+  std::pair<iterator, bool> insert(const key_type &key) {
+    return insert_key(key, key);
+  }
+
+  std::pair<iterator, bool> insert(key_type &&key) {
+    return insert_key(key, std::move(key));
+  }
+
+  template <class... Args> std::pair<iterator, bool> emplace(Args &&...args) {
+    key_type key(std::forward<Args>(args)...);
+    return insert_key(key, std::move(key));
+  }
+
+private:
+  template <class K>
+  std::pair<iterator, bool> insert_key(const key_type &key, K &&value) {
+    std::uint32_t hash = this->hash_of(key);
+    auto result = this->emplace_leaf(hash, key, [&] {
+      return this->make_leaf(hash, std::forward<K>(value));
+    });
+    return {this->template at_leaf<true>(result.first), result.second};
+  }
+};
+
+namespace pmr {
+
+template <class Key, class T, class Hash = std::hash<Key>,
+          class Eq = std::equal_to<Key>, unsigned Bits = 5>
+using map = hamt::map<Key, T, Hash, Eq,
+                      std::pmr::polymorphic_allocator<std::pair<const Key, T>>,
+                      Bits>;
+
+template <class Key, class Hash = std::hash<Key>,
+          class Eq = std::equal_to<Key>, unsigned Bits = 5>
+using set =
+    hamt::set<Key, Hash, Eq, std::pmr::polymorphic_allocator<Key>, Bits>;
+
+} // namespace pmr
+} // namespace hamt
+
+#endif